@@ -0,0 +1,181 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "blk_cache.h"
+#include "util.h"
+
+// Entries with last_use == 0 are empty
+struct cache_entry {
+    uint64_t block; // LBA / BLK_CACHE_SECTORS
+    uint32_t last_use;
+};
+
+static struct cache_entry cache[BLK_CACHE_BLOCKS];
+static uint8_t cache_data[BLK_CACHE_BLOCKS][BLK_CACHE_BLOCK_SIZE] __attribute__((aligned(16)));
+static uint32_t cache_clock;
+static struct blk_cache_stats stats;
+
+static uint64_t capacity;
+static int max_blocks;
+static blk_cache_read_fn read_blocks;
+
+// `disk_capacity` is in sectors. `max_blocks_per_read` limits how many blocks
+// go into one call to `read`.
+void blk_cache_init(uint64_t disk_capacity, int max_blocks_per_read, blk_cache_read_fn read)
+{
+    memset_(cache, 0, sizeof(cache));
+    memset_(&stats, 0, sizeof(stats));
+    cache_clock = 0;
+    capacity = disk_capacity;
+    max_blocks = max_blocks_per_read > 0 ? max_blocks_per_read : 1;
+    read_blocks = read;
+}
+
+static int cache_find(uint64_t block)
+{
+    for (int i = 0; i < BLK_CACHE_BLOCKS; i++) {
+        if (cache[i].last_use && cache[i].block == block)
+            return i;
+    }
+    return -1;
+}
+
+// Pick the least recently used entry, preferring empty ones
+static int cache_victim(void)
+{
+    int victim = 0;
+    for (int i = 1; i < BLK_CACHE_BLOCKS; i++) {
+        if (cache[i].last_use < cache[victim].last_use)
+            victim = i;
+    }
+    return victim;
+}
+
+// Read `block` into the cache along with the uncached blocks after it. The
+// first `wanted` blocks are part of the request and the rest are read-ahead.
+// Returns the entry for `block` or < 0 on error.
+static int cache_fill(uint64_t block, uint64_t wanted)
+{
+    uint64_t disk_blocks = (capacity + BLK_CACHE_SECTORS - 1) / BLK_CACHE_SECTORS;
+
+    // Don't let one read push out more than half of the cache
+    uint64_t limit = wanted + BLK_CACHE_READ_AHEAD;
+    if (limit > BLK_CACHE_BLOCKS / 2)
+        limit = BLK_CACHE_BLOCKS / 2;
+    if (limit > (uint64_t) max_blocks)
+        limit = max_blocks;
+
+    struct virtio_blk_sg sg[BLK_CACHE_BLOCKS / 2];
+    int entries[BLK_CACHE_BLOCKS / 2];
+    int n = 0;
+    do {
+        int i = cache_victim();
+        cache[i].block = block + n;
+        cache[i].last_use = ++cache_clock;
+        entries[n] = i;
+        sg[n].buffer = cache_data[i];
+        sg[n].len_bytes = BLK_CACHE_BLOCK_SIZE;
+        n++;
+    } while (n < limit && block + n < disk_blocks && cache_find(block + n) < 0);
+
+    // The last block on the disk may be partial
+    uint64_t last_lba = (block + n - 1) * BLK_CACHE_SECTORS;
+    if (capacity - last_lba < BLK_CACHE_SECTORS)
+        sg[n - 1].len_bytes = (capacity - last_lba) * SECTOR_SIZE;
+
+    int rc = read_blocks(block * BLK_CACHE_SECTORS, sg, n);
+    if (rc < 0) {
+        for (int j = 0; j < n; j++)
+            cache[entries[j]].last_use = 0;
+        return rc;
+    }
+
+    stats.misses++;
+    if ((uint64_t) n > wanted)
+        stats.read_ahead += n - wanted;
+    return entries[0];
+}
+
+// Copy the range from the cache, filling it on misses. The range must be on
+// the disk. Once more than BLK_CACHE_MAX_READ bytes are left, this stops at
+// the first block that isn't cached so that big reads don't flush
+// everything. Returns the number of bytes copied or < 0 on error.
+int blk_cache_read(uint64_t lba, uint32_t len_bytes, void *buffer)
+{
+    uint8_t *p = buffer;
+    uint32_t offset = 0;
+    uint64_t last_block = (lba + (len_bytes + SECTOR_SIZE - 1) / SECTOR_SIZE - 1) / BLK_CACHE_SECTORS;
+
+    while (offset < len_bytes) {
+        uint64_t sector = lba + offset / SECTOR_SIZE;
+        uint64_t block = sector / BLK_CACHE_SECTORS;
+        int i = cache_find(block);
+        if (i >= 0) {
+            stats.hits++;
+        } else {
+            if (len_bytes - offset > BLK_CACHE_MAX_READ)
+                break;
+
+            i = cache_fill(block, last_block - block + 1);
+            if (i < 0)
+                return i;
+        }
+        cache[i].last_use = ++cache_clock;
+
+        uint32_t block_offset = (sector % BLK_CACHE_SECTORS) * SECTOR_SIZE;
+        uint32_t len = BLK_CACHE_BLOCK_SIZE - block_offset;
+        if (len > len_bytes - offset)
+            len = len_bytes - offset;
+        memcpy_(p + offset, cache_data[i] + block_offset, len);
+        offset += len;
+    }
+    return offset;
+}
+
+// Cache data that was read some other way, like by a stream. Only whole
+// blocks are kept and no more than a miss would have read.
+void blk_cache_insert(uint64_t lba, uint32_t len_bytes, const void *data)
+{
+    uint64_t block = (lba + BLK_CACHE_SECTORS - 1) / BLK_CACHE_SECTORS;
+    uint64_t end = (lba + len_bytes / SECTOR_SIZE) / BLK_CACHE_SECTORS;
+    const uint8_t *p = (const uint8_t *) data + (block * BLK_CACHE_SECTORS - lba) * SECTOR_SIZE;
+
+    int limit = 1 + BLK_CACHE_READ_AHEAD;
+    if (limit > BLK_CACHE_BLOCKS / 2)
+        limit = BLK_CACHE_BLOCKS / 2;
+
+    for (int n = 0; n < limit && block < end; n++, block++) {
+        int i = cache_find(block);
+        if (i < 0)
+            i = cache_victim();
+        cache[i].block = block;
+        cache[i].last_use = ++cache_clock;
+        memcpy_(cache_data[i], p, BLK_CACHE_BLOCK_SIZE);
+        p += BLK_CACHE_BLOCK_SIZE;
+    }
+}
+
+// Drop any cached blocks that overlap the range
+void blk_cache_invalidate(uint64_t lba, uint32_t len_bytes)
+{
+    uint64_t first = lba / BLK_CACHE_SECTORS;
+    uint64_t last = (lba + (len_bytes + SECTOR_SIZE - 1) / SECTOR_SIZE + BLK_CACHE_SECTORS - 1) / BLK_CACHE_SECTORS;
+
+    for (int i = 0; i < BLK_CACHE_BLOCKS; i++) {
+        if (cache[i].block >= first && cache[i].block < last)
+            cache[i].last_use = 0;
+    }
+}
+
+struct blk_cache_stats blk_cache_stats(void)
+{
+    return stats;
+}
+
+void blk_cache_report(void)
+{
+    info("Block cache: %lu hits, %lu misses, %lu blocks read ahead", stats.hits, stats.misses, stats.read_ahead);
+}
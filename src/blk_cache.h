@@ -0,0 +1,49 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef BLK_CACHE_H
+#define BLK_CACHE_H
+
+#include <stdint.h>
+
+#include "virtio.h"
+
+// LRU cache of 4 KiB disk blocks. A miss reads the blocks that the request
+// needs plus up to BLK_CACHE_READ_AHEAD following ones with one
+// scatter-gather read straight into the cache slots. Read-ahead stops at the
+// first block that's already cached and never takes more than half the
+// cache. The cache doesn't know about the device. It reads through the
+// function passed to blk_cache_init().
+#define BLK_CACHE_BLOCK_SIZE 4096
+#define BLK_CACHE_SECTORS    (BLK_CACHE_BLOCK_SIZE / SECTOR_SIZE)
+#define BLK_CACHE_BLOCKS     64
+
+// Reads with more than this left to go only use blocks that are already
+// cached. This is big enough for the U-Boot environment.
+#define BLK_CACHE_MAX_READ   (128 * 1024)
+
+#ifndef BLK_CACHE_READ_AHEAD
+#define BLK_CACHE_READ_AHEAD 15
+#endif
+
+// Read `num_sg` buffers from consecutive sectors starting at `lba`. Returns
+// < 0 on error.
+typedef int (*blk_cache_read_fn)(uint64_t lba, const struct virtio_blk_sg *sg, int num_sg);
+
+struct blk_cache_stats {
+    uint64_t hits;       // Blocks copied from the cache
+    uint64_t misses;     // Reads that had to go to the disk
+    uint64_t read_ahead; // Blocks read that weren't asked for yet
+};
+
+void blk_cache_init(uint64_t disk_capacity, int max_blocks_per_read, blk_cache_read_fn read);
+int blk_cache_read(uint64_t lba, uint32_t len_bytes, void *buffer);
+void blk_cache_insert(uint64_t lba, uint32_t len_bytes, const void *data);
+void blk_cache_invalidate(uint64_t lba, uint32_t len_bytes);
+struct blk_cache_stats blk_cache_stats(void);
+void blk_cache_report(void);
+
+#endif // BLK_CACHE_H
@@ -0,0 +1,108 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "bootstage.h"
+#include "fdt_fixup.h"
+#include "util.h"
+#include "libfdt/libfdt.h"
+
+// Boot phase timing using the ARM generic timer. The virtual counter starts
+// at 0 when the VM starts, so the START timestamp also shows how long it took
+// to get to the loader.
+
+static const char *const bootstage_names[BOOTSTAGE_COUNT] = {
+    [BOOTSTAGE_START] = "start",
+    [BOOTSTAGE_UART_INIT] = "uart-init",
+    [BOOTSTAGE_VIRTIO_INIT] = "virtio-init",
+    [BOOTSTAGE_UBOOT_ENV] = "uboot-env",
+    [BOOTSTAGE_LOAD_KERNEL] = "load-kernel",
+    [BOOTSTAGE_LOAD_DTB] = "load-dtb",
+    [BOOTSTAGE_HANDOFF] = "handoff",
+};
+
+static uint64_t bootstage_ticks[BOOTSTAGE_COUNT];
+
+static uint64_t read_counter(void)
+{
+    // The ISB keeps the read from being speculated ahead of earlier work
+    asm volatile ("isb" ::: "memory");
+    return read_sysreg(cntvct_el0);
+}
+
+static uint64_t ticks_to_us(uint64_t ticks)
+{
+    uint64_t freq = read_sysreg(cntfrq_el0);
+    if (freq == 0)
+        return 0;
+
+    return (ticks / freq) * 1000000 + ((ticks % freq) * 1000000) / freq;
+}
+
+void bootstage_mark(enum bootstage_id id)
+{
+    bootstage_ticks[id] = read_counter();
+}
+
+uint64_t bootstage_elapsed_us(enum bootstage_id id)
+{
+    if (bootstage_ticks[id] == 0)
+        return 0;
+
+    return ticks_to_us(bootstage_ticks[id] - bootstage_ticks[BOOTSTAGE_START]);
+}
+
+void bootstage_report(void)
+{
+    uint64_t prev = bootstage_ticks[BOOTSTAGE_START];
+
+    info("Boot timing (loader started %lu us after reset):", ticks_to_us(prev));
+    info("  %-12s %12s %12s", "stage", "elapsed(us)", "delta(us)");
+    for (int i = BOOTSTAGE_START + 1; i < BOOTSTAGE_COUNT; i++) {
+        if (bootstage_ticks[i] == 0)
+            continue;
+
+        info("  %-12s %12lu %12lu",
+             bootstage_names[i],
+             bootstage_elapsed_us(i),
+             ticks_to_us(bootstage_ticks[i] - prev));
+        prev = bootstage_ticks[i];
+    }
+}
+
+int bootstage_fdt_fixup(struct fdt_fixup *f)
+{
+    // Store timestamps under /chosen/bootstage in microseconds since the
+    // counter started so that Linux can read them from
+    // /proc/device-tree/chosen/bootstage. The nodes are created if needed.
+    // Every stage gets a property now so that the DTB can be written before
+    // the last stages end. bootstage_fdt_update() fills them in.
+    for (int i = 0; i < BOOTSTAGE_COUNT; i++) {
+        int rc = fdt_fixup_setprop_u64(f, "/chosen/bootstage", bootstage_names[i], 0);
+        if (rc < 0)
+            ERR_RETURN("Can't set bootstage property: %s", fdt_strerror(rc));
+    }
+    return 0;
+}
+
+// Update the properties added by bootstage_fdt_fixup() in place. Stages
+// that weren't marked stay 0.
+int bootstage_fdt_update(void *fdt)
+{
+    int node = fdt_path_offset(fdt, "/chosen/bootstage");
+    if (node < 0)
+        ERR_RETURN("Can't find /chosen/bootstage: %s", fdt_strerror(node));
+
+    for (int i = 0; i < BOOTSTAGE_COUNT; i++) {
+        if (bootstage_ticks[i] == 0)
+            continue;
+
+        uint64_t us = ticks_to_us(bootstage_ticks[i]);
+        int rc = fdt_setprop_inplace_u64(fdt, node, bootstage_names[i], us);
+        if (rc < 0)
+            ERR_RETURN("Can't set bootstage property: %s", fdt_strerror(rc));
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef BOOTSTAGE_H
+#define BOOTSTAGE_H
+
+#include <stdint.h>
+
+struct fdt_fixup;
+
+// Boot phases in the order that they complete. Each mark records when the
+// phase ended, so a phase's duration is the time since the previous mark.
+enum bootstage_id {
+    BOOTSTAGE_START,
+    BOOTSTAGE_UART_INIT,
+    BOOTSTAGE_VIRTIO_INIT,
+    BOOTSTAGE_UBOOT_ENV,
+    BOOTSTAGE_LOAD_KERNEL,
+    BOOTSTAGE_LOAD_DTB,
+    BOOTSTAGE_HANDOFF,
+    BOOTSTAGE_COUNT
+};
+
+void bootstage_mark(enum bootstage_id id);
+uint64_t bootstage_elapsed_us(enum bootstage_id id);
+void bootstage_report(void);
+int bootstage_fdt_fixup(struct fdt_fixup *f);
+int bootstage_fdt_update(void *fdt);
+
+#endif // BOOTSTAGE_H
@@ -111,13 +111,137 @@ static const uint32_t crc_32_tab[256] = { /* CRC polynomial 0xedb88320 */
 #define UPDC32(octet,crc) (crc_32_tab[((crc)\
      ^ ((uint8_t)octet)) & 0xff] ^ ((crc) >> 8))
 
-uint32_t crc32buf(const char *buf, size_t len)
+// Slicing-by-8 tables. crc_slice_tab[k][n] is the CRC of byte n followed by
+// k zero bytes. They're derived from crc_32_tab on first use.
+static uint32_t crc_slice_tab[8][256];
+
+static uint32_t (*crc32_update)(uint32_t crc, const uint8_t *buf, size_t len);
+
+static uint32_t crc32_update_slice8(uint32_t crc, const uint8_t *buf, size_t len)
 {
-      uint32_t crc32 = 0xFFFFFFFF;
+      // Process bytes until 8-byte aligned
+      for ( ; len && ((uintptr_t) buf & 7); --len, ++buf)
+            crc = UPDC32(*buf, crc);
+
+      for ( ; len >= 8; len -= 8, buf += 8)
+      {
+            uint32_t lo = crc ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24));
+            uint32_t hi = buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((uint32_t) buf[7] << 24);
+
+            crc = crc_slice_tab[7][lo & 0xff] ^
+                  crc_slice_tab[6][(lo >> 8) & 0xff] ^
+                  crc_slice_tab[5][(lo >> 16) & 0xff] ^
+                  crc_slice_tab[4][lo >> 24] ^
+                  crc_slice_tab[3][hi & 0xff] ^
+                  crc_slice_tab[2][(hi >> 8) & 0xff] ^
+                  crc_slice_tab[1][(hi >> 16) & 0xff] ^
+                  crc_slice_tab[0][hi >> 24];
+      }
+
       for ( ; len; --len, ++buf)
+            crc = UPDC32(*buf, crc);
+
+      return crc;
+}
+
+#ifdef __aarch64__
+// The ARMv8 CRC32 instructions (not CRC32C) use the same reflected
+// 0xedb88320 polynomial as the table, so results are identical.
+static uint32_t crc32_update_armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+      for ( ; len && ((uintptr_t) buf & 7); --len, ++buf)
+            asm (".arch_extension crc\n crc32b %w0, %w0, %w1" : "+r"(crc) : "r"(*buf));
+
+      for ( ; len >= 8; len -= 8, buf += 8)
+            asm (".arch_extension crc\n crc32x %w0, %w0, %x1" : "+r"(crc) : "r"(*(const uint64_t *) buf));
+
+      for ( ; len; --len, ++buf)
+            asm (".arch_extension crc\n crc32b %w0, %w0, %w1" : "+r"(crc) : "r"(*buf));
+
+      return crc;
+}
+
+static int cpu_has_crc32(void)
+{
+      // ID_AA64ISAR0_EL1.CRC32 is bits [19:16]
+      uint64_t isar0;
+      asm volatile ("mrs %0, id_aa64isar0_el1" : "=r"(isar0));
+      return ((isar0 >> 16) & 0xf) != 0;
+}
+#endif
+
+static void crc32_select(void)
+{
+#ifdef __aarch64__
+      if (cpu_has_crc32())
       {
-            crc32 = UPDC32(*buf, crc32);
+            crc32_update = crc32_update_armv8;
+            return;
       }
+#endif
+
+      for (int n = 0; n < 256; n++)
+            crc_slice_tab[0][n] = crc_32_tab[n];
 
-      return ~crc32;
+      for (int k = 1; k < 8; k++)
+            for (int n = 0; n < 256; n++)
+                  crc_slice_tab[k][n] = UPDC32(0, crc_slice_tab[k - 1][n]);
+
+      crc32_update = crc32_update_slice8;
+}
+
+uint32_t crc32buf(const char *buf, size_t len)
+{
+      if (!crc32_update)
+            crc32_select();
+
+      return ~crc32_update(0xFFFFFFFF, (const uint8_t *) buf, len);
+}
+
+// Multiply a and b modulo the CRC polynomial. Both are reflected, so x^0 is
+// the top bit.
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+      uint32_t m = 1U << 31;
+      uint32_t p = 0;
+
+      for (;;)
+      {
+            if (a & m)
+            {
+                  p ^= b;
+                  if ((a & (m - 1)) == 0)
+                        break;
+            }
+            m >>= 1;
+            b = (b & 1) ? (b >> 1) ^ 0xedb88320 : b >> 1;
+      }
+      return p;
+}
+
+// x^(8 * len) modulo the CRC polynomial by repeated squaring
+static uint32_t crc32_x8nmodp(size_t len)
+{
+      uint32_t p = 1U << 31; // x^0
+      uint32_t x2k = 1U << 30; // x^1, then x^2, x^4, ...
+
+      // Start at x^8 since lengths are in bytes
+      for (int i = 0; i < 3; i++)
+            x2k = crc32_multmodp(x2k, x2k);
+
+      while (len)
+      {
+            if (len & 1)
+                  p = crc32_multmodp(x2k, p);
+            len >>= 1;
+            x2k = crc32_multmodp(x2k, x2k);
+      }
+      return p;
+}
+
+// CRC of A followed by B given crc32buf() of each and the length of B. This
+// lets pieces of a buffer be checked independently.
+uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b)
+{
+      return crc32_multmodp(crc32_x8nmodp(len_b), crc_a) ^ crc_b;
 }
@@ -11,5 +11,6 @@
 #include <stdint.h>
 
 uint32_t crc32buf(const char *buf, size_t len);
+uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b);
 
 #endif // CRC32_H
@@ -0,0 +1,88 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "decompress.h"
+#include "util.h"
+
+enum decomp_format decomp_detect(const uint8_t *buf, size_t len)
+{
+    if (len >= 3 && buf[0] == 0x1f && buf[1] == 0x8b && buf[2] == 8)
+        return DECOMP_GZIP;
+    if (len >= 4 && buf[0] == 0x28 && buf[1] == 0xb5 && buf[2] == 0x2f && buf[3] == 0xfd)
+        return DECOMP_ZSTD;
+    return DECOMP_NONE;
+}
+
+const char *decomp_format_name(enum decomp_format format)
+{
+    switch (format) {
+    case DECOMP_GZIP: return "gzip";
+    case DECOMP_ZSTD: return "zstd";
+    default: return "uncompressed";
+    }
+}
+
+static int decomp_ensure(struct decomp_input *in)
+{
+    if (in->next != in->end)
+        return 0;
+    if (!in->refill || in->refill(in) < 0 || in->next == in->end)
+        return -1;
+    return 0;
+}
+
+int decomp_read_byte(struct decomp_input *in)
+{
+    if (decomp_ensure(in) < 0)
+        return -1;
+    return *in->next++;
+}
+
+int decomp_read(struct decomp_input *in, void *dst, size_t len)
+{
+    uint8_t *d = dst;
+
+    while (len) {
+        if (decomp_ensure(in) < 0)
+            return -1;
+
+        size_t n = in->end - in->next;
+        if (n > len)
+            n = len;
+        memcpy_(d, in->next, n);
+        in->next += n;
+        d += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int decomp_skip(struct decomp_input *in, size_t len)
+{
+    while (len) {
+        if (decomp_ensure(in) < 0)
+            return -1;
+
+        size_t n = in->end - in->next;
+        if (n > len)
+            n = len;
+        in->next += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int decompress(enum decomp_format format, struct decomp_input *in, uint8_t *out, size_t out_max, size_t *out_len)
+{
+    switch (format) {
+    case DECOMP_GZIP:
+        return gunzip(in, out, out_max, out_len);
+    case DECOMP_ZSTD:
+        return unzstd(in, out, out_max, out_len);
+    default:
+        ERR_RETURN("Unsupported compression format");
+    }
+}
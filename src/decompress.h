@@ -0,0 +1,47 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compressed input is pulled through this struct so that decompression can
+// run while the rest of the data is still being read. `next` to `end` is
+// the unconsumed input. When it runs out, `refill` is called to supply the
+// next piece. It returns 0 on success or < 0 when there's no more input.
+struct decomp_input {
+    const uint8_t *next;
+    const uint8_t *end;
+    int (*refill)(struct decomp_input *in);
+    void *priv;
+};
+
+enum decomp_format {
+    DECOMP_NONE = 0,
+    DECOMP_GZIP,
+    DECOMP_ZSTD
+};
+
+enum decomp_format decomp_detect(const uint8_t *buf, size_t len);
+const char *decomp_format_name(enum decomp_format format);
+
+// These return < 0 without printing anything when the input runs out so
+// that the decompressor can report it.
+int decomp_read_byte(struct decomp_input *in);
+int decomp_read(struct decomp_input *in, void *dst, size_t len);
+int decomp_skip(struct decomp_input *in, size_t len);
+
+// Decompress one stream into `out`. Output is written in order and earlier
+// output is used as the history window, so `out` must be the final
+// destination. The decompressed length is returned in `out_len`.
+int gunzip(struct decomp_input *in, uint8_t *out, size_t out_max, size_t *out_len);
+int unzstd(struct decomp_input *in, uint8_t *out, size_t out_max, size_t *out_len);
+
+int decompress(enum decomp_format format, struct decomp_input *in, uint8_t *out, size_t out_max, size_t *out_len);
+
+#endif // DECOMPRESS_H
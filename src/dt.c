@@ -0,0 +1,63 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "dt.h"
+#include "util.h"
+#include "libfdt/libfdt.h"
+
+#define GIC_SPI_BASE 32
+
+static uint64_t read_cells(const fdt32_t *cells, int count)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < count; i++)
+        value = (value << 32) | fdt32_to_cpu(cells[i]);
+    return value;
+}
+
+static int parent_cells(const void *fdt, int node, const char *name, int default_value)
+{
+    int parent = fdt_parent_offset(fdt, node);
+    if (parent < 0)
+        return default_value;
+
+    int len;
+    const fdt32_t *cells = fdt_getprop(fdt, parent, name, &len);
+    return (cells && len == 4) ? (int) fdt32_to_cpu(*cells) : default_value;
+}
+
+// Return the address and size of the node's `index`th reg entry
+int dt_get_reg(const void *fdt, int node, int index, uint64_t *addr, uint64_t *size)
+{
+    int address_cells = parent_cells(fdt, node, "#address-cells", 2);
+    int size_cells = parent_cells(fdt, node, "#size-cells", 1);
+    if (address_cells < 1 || address_cells > 2 || size_cells < 0 || size_cells > 2)
+        return -1;
+
+    int len;
+    const fdt32_t *reg = fdt_getprop(fdt, node, "reg", &len);
+    int entry_cells = address_cells + size_cells;
+    if (!reg || len < (index + 1) * entry_cells * 4)
+        return -1;
+
+    reg += index * entry_cells;
+    *addr = read_cells(reg, address_cells);
+    if (size)
+        *size = read_cells(reg + address_cells, size_cells);
+    return 0;
+}
+
+// Return the GIC interrupt ID of the node's first interrupt if it's an SPI
+int dt_get_spi(const void *fdt, int node)
+{
+    int len;
+    const fdt32_t *interrupts = fdt_getprop(fdt, node, "interrupts", &len);
+
+    // GIC interrupt specifiers are <type number flags> and type 0 is SPI
+    if (!interrupts || len < 12 || fdt32_to_cpu(interrupts[0]) != 0)
+        return -1;
+    return GIC_SPI_BASE + (int) fdt32_to_cpu(interrupts[1]);
+}
@@ -0,0 +1,17 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef DT_H
+#define DT_H
+
+#include <stdint.h>
+
+// Device tree lookups shared by the drivers
+
+int dt_get_reg(const void *fdt, int node, int index, uint64_t *addr, uint64_t *size);
+int dt_get_spi(const void *fdt, int node);
+
+#endif // DT_H
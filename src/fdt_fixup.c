@@ -0,0 +1,520 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "fdt_fixup.h"
+#include "util.h"
+#include "libfdt/libfdt.h"
+
+// Editing a DTB in place with fdt_setprop() moves everything after the
+// change each time and fails once the blob's free space runs out. Instead,
+// the source DTB is walked once and each block is written straight to the
+// destination with the edits spliced in. Names from the source strings
+// block are reused, so its nameoffs don't need to change and unedited tags
+// are copied as is.
+
+struct fdt_writer {
+    uint8_t *buf;
+    int size;
+    int pos;
+    int err;
+};
+
+struct fixup_state {
+    struct fdt_fixup *f;
+    struct fdt_writer w;
+    int unapplied;
+
+    // Source strings block
+    const char *strings;
+    int strings_size;
+
+    // Path of the node being copied. The root is "".
+    char path[FDT_FIXUP_PATH_MAX];
+    int depth;
+    int path_len[FDT_FIXUP_MAX_DEPTH];
+
+    // Edits for each open node that haven't been written yet
+    int pending[FDT_FIXUP_MAX_DEPTH];
+};
+
+static void put(struct fdt_writer *w, const void *data, int len)
+{
+    if (w->err)
+        return;
+    if (len > w->size - w->pos) {
+        w->err = -FDT_ERR_NOSPACE;
+        return;
+    }
+    memcpy_(w->buf + w->pos, data, len);
+    w->pos += len;
+}
+
+// Structure block entries are padded to 4 bytes
+static void put_padded(struct fdt_writer *w, const void *data, int len)
+{
+    static const uint8_t zeros[FDT_TAGSIZE];
+
+    put(w, data, len);
+    put(w, zeros, ((len + FDT_TAGSIZE - 1) & ~(FDT_TAGSIZE - 1)) - len);
+}
+
+static void put32(struct fdt_writer *w, uint32_t v)
+{
+    fdt32_t be = cpu_to_fdt32(v);
+    put(w, &be, sizeof(be));
+}
+
+static void put_reserve(struct fdt_writer *w, uint64_t address, uint64_t size)
+{
+    struct fdt_reserve_entry re;
+
+    re.address = cpu_to_fdt64(address);
+    re.size = cpu_to_fdt64(size);
+    put(w, &re, sizeof(re));
+}
+
+static void put_prop(struct fdt_writer *w, const struct fdt_fixup_prop *p)
+{
+    put32(w, FDT_PROP);
+    put32(w, p->len);
+    put32(w, p->nameoff);
+    put_padded(w, p->value ? p->value : p->inline_value, p->len);
+}
+
+static int valid_path(const char *path)
+{
+    if (path[0] != '/')
+        return 0;
+    if (path[1] == '\0')
+        return 1;
+
+    // No empty node names
+    for (const char *c = path; *c; c++) {
+        if (*c == '/' && (c[1] == '/' || c[1] == '\0'))
+            return 0;
+    }
+    return strlen_(path) < FDT_FIXUP_PATH_MAX;
+}
+
+static struct fdt_fixup_prop *get_prop(struct fdt_fixup *f, const char *path, const char *name)
+{
+    if (!valid_path(path))
+        return NULL;
+
+    // Paths are compared against the copy's path where the root is ""
+    if (path[1] == '\0')
+        path = "";
+
+    // Setting the same property again replaces the earlier value
+    for (int i = 0; i < f->num_props; i++) {
+        struct fdt_fixup_prop *p = &f->props[i];
+        if (strcmp_(p->path, path) == 0 && strcmp_(p->name, name) == 0)
+            return p;
+    }
+
+    if (f->num_props == FDT_FIXUP_MAX_PROPS)
+        return NULL;
+
+    struct fdt_fixup_prop *p = &f->props[f->num_props++];
+    p->path = path;
+    p->path_len = strlen_(path);
+    p->name = name;
+    return p;
+}
+
+void fdt_fixup_init(struct fdt_fixup *f)
+{
+    memset_(f, 0, sizeof(*f));
+}
+
+int fdt_fixup_setprop(struct fdt_fixup *f, const char *path, const char *name, const void *value, int len)
+{
+    if (len < 0)
+        return -FDT_ERR_BADVALUE;
+
+    struct fdt_fixup_prop *p = get_prop(f, path, name);
+    if (!p)
+        return valid_path(path) ? -FDT_ERR_NOSPACE : -FDT_ERR_BADPATH;
+
+    p->value = value;
+    p->len = len;
+    return 0;
+}
+
+int fdt_fixup_setprop_string(struct fdt_fixup *f, const char *path, const char *name, const char *value)
+{
+    return fdt_fixup_setprop(f, path, name, value, strlen_(value) + 1);
+}
+
+int fdt_fixup_setprop_u64(struct fdt_fixup *f, const char *path, const char *name, uint64_t value)
+{
+    struct fdt_fixup_prop *p = get_prop(f, path, name);
+    if (!p)
+        return valid_path(path) ? -FDT_ERR_NOSPACE : -FDT_ERR_BADPATH;
+
+    fdt64_t be = cpu_to_fdt64(value);
+    memcpy_(p->inline_value, &be, sizeof(be));
+    p->value = NULL;
+    p->len = sizeof(be);
+    return 0;
+}
+
+int fdt_fixup_add_reserve(struct fdt_fixup *f, uint64_t address, uint64_t size)
+{
+    if (f->num_reserves == FDT_FIXUP_MAX_RESERVES)
+        return -FDT_ERR_NOSPACE;
+
+    f->reserves[f->num_reserves].address = address;
+    f->reserves[f->num_reserves].size = size;
+    f->num_reserves++;
+    return 0;
+}
+
+static int find_string(const char *strings, int size, const char *s)
+{
+    int len = strlen_(s);
+
+    // Matching the end of a longer name is fine
+    for (int off = 0; off + len < size; off++) {
+        if (strings[off + len] == '\0' && memcmp_(strings + off, s, len) == 0)
+            return off;
+    }
+    return -1;
+}
+
+// Give each property a name offset. New names go after the source's strings
+// in the order that they're first used.
+static void assign_names(struct fdt_fixup *f, const char *strings, int size)
+{
+    int next = size;
+
+    for (int i = 0; i < f->num_props; i++) {
+        struct fdt_fixup_prop *p = &f->props[i];
+        int off = find_string(strings, size, p->name);
+
+        for (int j = 0; off < 0 && j < i; j++) {
+            if (f->props[j].nameoff >= (uint32_t) size && strcmp_(f->props[j].name, p->name) == 0)
+                off = f->props[j].nameoff;
+        }
+        if (off < 0) {
+            off = next;
+            next += strlen_(p->name) + 1;
+        }
+        p->nameoff = off;
+        p->applied = 0;
+    }
+}
+
+// Check whether an edit is for the node at `s->path`. Lengths are
+// compared first since most nodes don't have edits.
+static int for_node(const struct fixup_state *s, const struct fdt_fixup_prop *p, int len)
+{
+    return !p->applied && p->path_len == len && memcmp_(p->path, s->path, len) == 0;
+}
+
+static struct fdt_fixup_prop *find_unapplied(struct fixup_state *s, const char *name)
+{
+    int len = s->path_len[s->depth];
+    for (int i = 0; i < s->f->num_props; i++) {
+        struct fdt_fixup_prop *p = &s->f->props[i];
+        if (for_node(s, p, len) && strcmp_(p->name, name) == 0)
+            return p;
+    }
+    return NULL;
+}
+
+static int count_unapplied(struct fixup_state *s, int len)
+{
+    int count = 0;
+    for (int i = 0; i < s->f->num_props; i++) {
+        if (for_node(s, &s->f->props[i], len))
+            count++;
+    }
+    return count;
+}
+
+static void apply(struct fixup_state *s, struct fdt_fixup_prop *p)
+{
+    put_prop(&s->w, p);
+    p->applied = 1;
+    s->unapplied--;
+}
+
+// Write the new properties for the node at `s->path`
+static void add_props(struct fixup_state *s, int len)
+{
+    for (int i = 0; i < s->f->num_props; i++) {
+        struct fdt_fixup_prop *p = &s->f->props[i];
+        if (for_node(s, p, len))
+            apply(s, p);
+    }
+}
+
+// Create the subnodes of `s->path` that are needed by the remaining edits
+static void add_nodes(struct fixup_state *s, int len)
+{
+    for (int i = 0; i < s->f->num_props && s->unapplied > 0; i++) {
+        struct fdt_fixup_prop *p = &s->f->props[i];
+        if (p->applied || p->path_len <= len || p->path[len] != '/' ||
+            memcmp_(p->path, s->path, len) != 0)
+            continue;
+
+        const char *name = p->path + len + 1;
+        int name_len = 0;
+        while (name[name_len] != '/' && name[name_len] != '\0')
+            name_len++;
+
+        // Paths were checked to fit when they were added
+        memcpy_(s->path + len, p->path + len, name_len + 1);
+        s->path[len + name_len + 1] = '\0';
+
+        put32(&s->w, FDT_BEGIN_NODE);
+        put_padded(&s->w, s->path + len + 1, name_len + 1);
+        add_props(s, len + name_len + 1);
+        add_nodes(s, len + name_len + 1);
+        put32(&s->w, FDT_END_NODE);
+
+        s->path[len] = '\0';
+    }
+}
+
+static void flush_props(struct fixup_state *s)
+{
+    if (s->pending[s->depth] > 0) {
+        add_props(s, s->path_len[s->depth]);
+        s->pending[s->depth] = 0;
+    }
+}
+
+// Like fdt_next_tag(), but reads the structure block directly rather than a
+// byte at a time through fdt_offset_ptr(). On errors, `*next` is negative.
+static uint32_t next_tag(const uint8_t *st, int size, int offset, int *next)
+{
+    *next = -FDT_ERR_TRUNCATED;
+    if (offset > size - FDT_TAGSIZE)
+        return FDT_END;
+
+    uint32_t tag = fdt32_ld((const fdt32_t *) (st + offset));
+    int end = offset + FDT_TAGSIZE;
+    switch (tag) {
+    case FDT_BEGIN_NODE: {
+        int len = strnlen_((const char *) st + end, size - end);
+        if (len == size - end)
+            return FDT_END;
+        end += len + 1;
+        break;
+    }
+
+    case FDT_PROP: {
+        if (end > size - 8)
+            return FDT_END;
+        uint32_t len = fdt32_ld((const fdt32_t *) (st + end));
+        if (len > (uint32_t) (size - end - 8))
+            return FDT_END;
+        end += 8 + len;
+        break;
+    }
+
+    case FDT_END_NODE:
+    case FDT_NOP:
+    case FDT_END:
+        break;
+
+    default:
+        *next = -FDT_ERR_BADSTRUCTURE;
+        return FDT_END;
+    }
+
+    end = (end + FDT_TAGSIZE - 1) & ~(FDT_TAGSIZE - 1);
+    if (end > size)
+        return FDT_END;
+    *next = end;
+    return tag;
+}
+
+static const char *prop_name(const struct fixup_state *s, const uint8_t *prop)
+{
+    uint32_t nameoff = fdt32_ld((const fdt32_t *) (prop + 8));
+    if (nameoff >= (uint32_t) s->strings_size)
+        return NULL;
+
+    const char *name = s->strings + nameoff;
+    if (strnlen_(name, s->strings_size - nameoff) == s->strings_size - nameoff)
+        return NULL;
+    return name;
+}
+
+static int copy_struct(struct fixup_state *s, const uint8_t *st, int size)
+{
+    int offset = 0;
+    int next;
+    uint32_t tag;
+
+    // Unedited tags are copied in runs. `run` is where the current run
+    // started.
+    int run = 0;
+
+    s->depth = -1;
+    s->path[0] = '\0';
+    do {
+        tag = next_tag(st, size, offset, &next);
+        if (next < 0)
+            return next;
+
+        switch (tag) {
+        case FDT_BEGIN_NODE: {
+            const char *name = (const char *) st + offset + FDT_TAGSIZE;
+            int len = 0;
+
+            if (s->depth >= 0) {
+                // New properties go before the first subnode
+                if (s->pending[s->depth] > 0) {
+                    put(&s->w, st + run, offset - run);
+                    run = offset;
+                    flush_props(s);
+                }
+
+                len = s->path_len[s->depth];
+                int name_len = strlen_(name);
+                if (s->depth + 1 == FDT_FIXUP_MAX_DEPTH || len + name_len + 1 >= FDT_FIXUP_PATH_MAX)
+                    return -FDT_ERR_BADSTRUCTURE;
+
+                s->path[len++] = '/';
+                memcpy_(s->path + len, name, name_len + 1);
+                len += name_len;
+            }
+            s->depth++;
+            s->path_len[s->depth] = len;
+            s->pending[s->depth] = s->unapplied > 0 ? count_unapplied(s, len) : 0;
+            break;
+        }
+
+        case FDT_PROP:
+            if (s->depth >= 0 && s->pending[s->depth] > 0) {
+                const char *name = prop_name(s, st + offset);
+                if (!name)
+                    return -FDT_ERR_BADSTRUCTURE;
+
+                struct fdt_fixup_prop *p = find_unapplied(s, name);
+                if (p) {
+                    put(&s->w, st + run, offset - run);
+                    run = next;
+                    apply(s, p);
+                    s->pending[s->depth]--;
+                }
+            }
+            break;
+
+        case FDT_END_NODE:
+            if (s->depth < 0)
+                return -FDT_ERR_BADSTRUCTURE;
+
+            if (s->unapplied > 0) {
+                put(&s->w, st + run, offset - run);
+                run = offset;
+                flush_props(s);
+                add_nodes(s, s->path_len[s->depth]);
+            }
+
+            s->depth--;
+            s->path[s->depth >= 0 ? s->path_len[s->depth] : 0] = '\0';
+            break;
+
+        case FDT_NOP:
+            // Drop the padding left by earlier in-place edits
+            put(&s->w, st + run, offset - run);
+            run = next;
+            break;
+
+        case FDT_END:
+            break;
+        }
+        offset = next;
+    } while (tag != FDT_END);
+
+    put(&s->w, st + run, offset - run);
+    return s->depth == -1 ? 0 : -FDT_ERR_BADSTRUCTURE;
+}
+
+// Write `src` with the edits in `f` to `dest`. The two can't overlap.
+// `headroom` bytes of free space are left at the end of the new DTB for
+// later edits.
+int fdt_fixup_apply(struct fdt_fixup *f, const void *src, void *dest, int dest_size, int headroom)
+{
+    struct fixup_state s;
+    uint64_t address, size;
+
+    int rc = fdt_check_header(src);
+    if (rc < 0)
+        return rc;
+    if (dest_size < (int) sizeof(struct fdt_header) || headroom < 0)
+        return -FDT_ERR_NOSPACE;
+
+    const char *strings = (const char *) src + fdt_off_dt_strings(src);
+    int strings_size = fdt_size_dt_strings(src);
+    assign_names(f, strings, strings_size);
+
+    s.f = f;
+    s.strings = strings;
+    s.strings_size = strings_size;
+    s.w.buf = dest;
+    s.w.size = dest_size;
+    s.w.pos = sizeof(struct fdt_header);
+    s.w.err = 0;
+    s.unapplied = f->num_props;
+
+    // Memory reservation block
+    int off_mem_rsvmap = s.w.pos;
+    int num_rsv = fdt_num_mem_rsv(src);
+    if (num_rsv < 0)
+        return num_rsv;
+    for (int i = 0; i < num_rsv; i++) {
+        fdt_get_mem_rsv(src, i, &address, &size);
+        put_reserve(&s.w, address, size);
+    }
+    for (int i = 0; i < f->num_reserves; i++)
+        put_reserve(&s.w, f->reserves[i].address, f->reserves[i].size);
+    put_reserve(&s.w, 0, 0);
+
+    // Structure block
+    int off_dt_struct = s.w.pos;
+    rc = copy_struct(&s, (const uint8_t *) src + fdt_off_dt_struct(src), fdt_size_dt_struct(src));
+    if (rc < 0)
+        return rc;
+    int size_dt_struct = s.w.pos - off_dt_struct;
+
+    // Strings block
+    int off_dt_strings = s.w.pos;
+    put(&s.w, strings, strings_size);
+    uint32_t next_name = strings_size;
+    for (int i = 0; i < f->num_props; i++) {
+        if (f->props[i].nameoff == next_name) {
+            int len = strlen_(f->props[i].name) + 1;
+            put(&s.w, f->props[i].name, len);
+            next_name += len;
+        }
+    }
+    int size_dt_strings = s.w.pos - off_dt_strings;
+
+    if (s.w.err < 0)
+        return s.w.err;
+    if (headroom > dest_size - s.w.pos)
+        return -FDT_ERR_NOSPACE;
+
+    struct fdt_header *h = dest;
+    memset_(h, 0, sizeof(*h));
+    h->magic = cpu_to_fdt32(FDT_MAGIC);
+    h->totalsize = cpu_to_fdt32(s.w.pos + headroom);
+    h->off_dt_struct = cpu_to_fdt32(off_dt_struct);
+    h->off_dt_strings = cpu_to_fdt32(off_dt_strings);
+    h->off_mem_rsvmap = cpu_to_fdt32(off_mem_rsvmap);
+    h->version = cpu_to_fdt32(17);
+    h->last_comp_version = cpu_to_fdt32(16);
+    h->boot_cpuid_phys = cpu_to_fdt32(fdt_boot_cpuid_phys(src));
+    h->size_dt_strings = cpu_to_fdt32(size_dt_strings);
+    h->size_dt_struct = cpu_to_fdt32(size_dt_struct);
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef FDT_FIXUP_H
+#define FDT_FIXUP_H
+
+#include <stdint.h>
+
+// Batched device tree edits. Properties and memory reservations are
+// collected first and then fdt_fixup_apply() writes the edited DTB to its
+// final location in one pass. Nodes in a property's path are created if
+// they don't exist.
+
+#define FDT_FIXUP_MAX_PROPS    32
+#define FDT_FIXUP_MAX_RESERVES 8
+#define FDT_FIXUP_PATH_MAX     256
+#define FDT_FIXUP_MAX_DEPTH    16
+
+struct fdt_fixup_prop {
+    // Absolute node path like "/chosen". The path, name and value must stay
+    // valid until fdt_fixup_apply() returns.
+    const char *path;
+    const char *name;
+
+    // Small values like u64s are stored in `inline_value` when `value` is
+    // NULL.
+    const void *value;
+    int len;
+    uint8_t inline_value[8];
+
+    // Used by fdt_fixup_apply()
+    int path_len;
+    uint32_t nameoff;
+    int applied;
+};
+
+struct fdt_fixup_reserve {
+    uint64_t address;
+    uint64_t size;
+};
+
+struct fdt_fixup {
+    struct fdt_fixup_prop props[FDT_FIXUP_MAX_PROPS];
+    int num_props;
+
+    struct fdt_fixup_reserve reserves[FDT_FIXUP_MAX_RESERVES];
+    int num_reserves;
+};
+
+void fdt_fixup_init(struct fdt_fixup *f);
+int fdt_fixup_setprop(struct fdt_fixup *f, const char *path, const char *name, const void *value, int len);
+int fdt_fixup_setprop_string(struct fdt_fixup *f, const char *path, const char *name, const char *value);
+int fdt_fixup_setprop_u64(struct fdt_fixup *f, const char *path, const char *name, uint64_t value);
+int fdt_fixup_add_reserve(struct fdt_fixup *f, uint64_t address, uint64_t size);
+int fdt_fixup_apply(struct fdt_fixup *f, const void *src, void *dest, int dest_size, int headroom);
+
+#endif // FDT_FIXUP_H
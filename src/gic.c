@@ -0,0 +1,222 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "gic.h"
+#include "dt.h"
+#include "util.h"
+#include "libfdt/libfdt.h"
+
+#include <stdint.h>
+
+#define MMIO32(addr) (*(volatile uint32_t *)(uintptr_t)(addr))
+#define MMIO64(addr) (*(volatile uint64_t *)(uintptr_t)(addr))
+#define MMIO8(addr)  (*(volatile uint8_t *)(uintptr_t)(addr))
+
+// Distributor (both versions)
+#define GICD_CTLR             0x0000
+#define GICD_IGROUPR(n)       (0x0080 + 4 * ((n) / 32))
+#define GICD_ISENABLER(n)     (0x0100 + 4 * ((n) / 32))
+#define GICD_ICENABLER(n)     (0x0180 + 4 * ((n) / 32))
+#define GICD_ICPENDR(n)       (0x0280 + 4 * ((n) / 32))
+#define GICD_IPRIORITYR(n)    (0x0400 + (n))
+#define GICD_ITARGETSR(n)     (0x0800 + (n))
+#define GICD_IROUTER(n)       (0x6000 + 8 * (n))
+#define GICD_CTLR_ENABLE_GRP0 (1 << 0)
+#define GICD_CTLR_ENABLE_GRP1 (1 << 1)
+#define GICD_CTLR_ARE         (1 << 4)
+#define GICD_CTLR_RWP         (1U << 31)
+
+// GICv2 CPU interface
+#define GICC_CTLR             0x0000
+#define GICC_PMR              0x0004
+#define GICC_IAR              0x000c
+#define GICC_EOIR             0x0010
+
+// GICv3 redistributor
+#define GICR_TYPER            0x0008
+#define GICR_WAKER            0x0014
+#define GICR_TYPER_VLPIS      (1 << 1)
+#define GICR_TYPER_LAST       (1 << 4)
+#define GICR_WAKER_SLEEP      (1 << 1)
+#define GICR_WAKER_ASLEEP     (1 << 2)
+
+#define ICC_SRE_SRE           (1 << 0)
+#define ICC_SRE_ENABLE        (1 << 3)
+
+#define GIC_SPURIOUS          1020
+#define GIC_PRIORITY          0xa0
+#define GIC_MAX_SPIS          4
+
+static int version;
+static uint64_t gicd;
+static uint64_t gicc;
+static int spis[GIC_MAX_SPIS];
+static int num_spis;
+
+// This CPU's affinity the way GICR_TYPER[63:32] reports it, with Aff3 in
+// bits [31:24]
+static uint64_t redistributor_affinity(void)
+{
+    uint64_t mpidr = read_sysreg(mpidr_el1);
+    return ((mpidr >> 8) & 0xff000000UL) | (mpidr & 0xffffff);
+}
+
+// GICD_IROUTER keeps the MPIDR layout with Aff3 in bits [39:32]. IRM (bit
+// 31) stays clear so that the interrupt only goes to this CPU.
+static uint64_t irouter_affinity(void)
+{
+    return read_sysreg(mpidr_el1) & 0xff00ffffffUL;
+}
+
+// Find this CPU's redistributor and make sure it's awake. The distributor
+// won't forward interrupts to a CPU whose redistributor is asleep.
+static int gicv3_wake_redistributor(uint64_t gicr, uint64_t gicr_size)
+{
+    uint64_t affinity = redistributor_affinity();
+    uint64_t end = gicr + gicr_size;
+
+    while (gicr < end) {
+        uint64_t typer = MMIO64(gicr + GICR_TYPER);
+        if ((typer >> 32) == affinity) {
+            MMIO32(gicr + GICR_WAKER) &= ~GICR_WAKER_SLEEP;
+            while (MMIO32(gicr + GICR_WAKER) & GICR_WAKER_ASLEEP)
+                ;
+            return 0;
+        }
+        if (typer & GICR_TYPER_LAST)
+            break;
+        gicr += (typer & GICR_TYPER_VLPIS) ? 0x40000 : 0x20000;
+    }
+    ERR_RETURN("GIC: no redistributor for this CPU");
+}
+
+static int gicv3_init_cpu_interface(void)
+{
+    if (get_el() == 2) {
+        write_sysreg(icc_sre_el2, read_sysreg(icc_sre_el2) | ICC_SRE_SRE | ICC_SRE_ENABLE);
+    } else {
+        write_sysreg(icc_sre_el1, read_sysreg(icc_sre_el1) | ICC_SRE_SRE);
+    }
+    asm volatile ("isb");
+
+    // A hypervisor might not allow the system register interface
+    if ((read_sysreg(icc_sre_el1) & ICC_SRE_SRE) == 0)
+        ERR_RETURN("GIC: system register interface is disabled");
+
+    write_sysreg(icc_pmr_el1, 0xff);
+    write_sysreg(icc_igrpen1_el1, 1);
+    asm volatile ("isb");
+    return 0;
+}
+
+int gic_init(const void *fdt)
+{
+    int node;
+    uint64_t gicr, gicr_size;
+
+    if (fdt_check_header(fdt) < 0)
+        ERR_RETURN("GIC: invalid DTB");
+
+    if ((node = fdt_node_offset_by_compatible(fdt, -1, "arm,gic-v3")) >= 0) {
+        OK_OR_RETURN_MSG(dt_get_reg(fdt, node, 0, &gicd, NULL), "GIC: can't read distributor address");
+        OK_OR_RETURN_MSG(dt_get_reg(fdt, node, 1, &gicr, &gicr_size), "GIC: can't read redistributor address");
+
+        // Keep interrupts from being delivered as exceptions
+        asm volatile ("msr daifset, #3");
+
+        OK_OR_RETURN(gicv3_wake_redistributor(gicr, gicr_size));
+        OK_OR_RETURN(gicv3_init_cpu_interface());
+        MMIO32(gicd + GICD_CTLR) |= GICD_CTLR_ARE | GICD_CTLR_ENABLE_GRP1;
+        while (MMIO32(gicd + GICD_CTLR) & GICD_CTLR_RWP)
+            ;
+        version = 3;
+    } else if ((node = fdt_node_offset_by_compatible(fdt, -1, "arm,cortex-a15-gic")) >= 0 ||
+               (node = fdt_node_offset_by_compatible(fdt, -1, "arm,gic-400")) >= 0) {
+        OK_OR_RETURN_MSG(dt_get_reg(fdt, node, 0, &gicd, NULL), "GIC: can't read distributor address");
+        OK_OR_RETURN_MSG(dt_get_reg(fdt, node, 1, &gicc, NULL), "GIC: can't read CPU interface address");
+
+        asm volatile ("msr daifset, #3");
+
+        MMIO32(gicc + GICC_PMR) = 0xff;
+        MMIO32(gicc + GICC_CTLR) = 1;
+        MMIO32(gicd + GICD_CTLR) |= GICD_CTLR_ENABLE_GRP0;
+        version = 2;
+    } else {
+        ERR_RETURN("GIC: no supported interrupt controller found");
+    }
+
+    num_spis = 0;
+    return 0;
+}
+
+int gic_enable_spi(int intid)
+{
+    if (version == 0 || intid < 32 || num_spis == GIC_MAX_SPIS)
+        return -1;
+
+    uint32_t bit = 1U << (intid % 32);
+    MMIO8(gicd + GICD_IPRIORITYR(intid)) = GIC_PRIORITY;
+    if (version == 3) {
+        MMIO32(gicd + GICD_IGROUPR(intid)) |= bit;
+        MMIO64(gicd + GICD_IROUTER(intid)) = irouter_affinity();
+    } else {
+        // Reads of the first ITARGETSR bytes return this CPU's target mask
+        MMIO8(gicd + GICD_ITARGETSR(intid)) = MMIO8(gicd + GICD_ITARGETSR(0));
+    }
+    MMIO32(gicd + GICD_ISENABLER(intid)) = bit;
+
+    spis[num_spis++] = intid;
+    return 0;
+}
+
+// Sleep until an enabled interrupt is pending and then acknowledge it.
+// Returns the interrupt ID or -1 if the wakeup wasn't for an interrupt. The
+// caller has to clear the source in the device before calling gic_eoi().
+// Otherwise, a level-sensitive interrupt is pending again right away.
+int gic_wait(void)
+{
+    uint32_t intid;
+
+    asm volatile ("dsb sy; wfi" ::: "memory");
+
+    if (version == 3) {
+        intid = read_sysreg(icc_iar1_el1) & 0xffffff;
+    } else {
+        intid = MMIO32(gicc + GICC_IAR) & 0x3ff;
+    }
+    return intid < GIC_SPURIOUS ? (int) intid : -1;
+}
+
+void gic_eoi(int intid)
+{
+    if (version == 3) {
+        write_sysreg(icc_eoir1_el1, (uint64_t) intid);
+    } else {
+        MMIO32(gicc + GICC_EOIR) = intid;
+    }
+}
+
+// Leave the GIC as Linux expects to find it
+void gic_shutdown(void)
+{
+    if (version == 0)
+        return;
+
+    for (int i = 0; i < num_spis; i++) {
+        uint32_t bit = 1U << (spis[i] % 32);
+        MMIO32(gicd + GICD_ICENABLER(spis[i])) = bit;
+        MMIO32(gicd + GICD_ICPENDR(spis[i])) = bit;
+    }
+    num_spis = 0;
+
+    if (version == 3) {
+        write_sysreg(icc_igrpen1_el1, 0);
+        asm volatile ("isb");
+    } else {
+        MMIO32(gicc + GICC_CTLR) = 0;
+    }
+    version = 0;
+}
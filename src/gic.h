@@ -0,0 +1,20 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef GIC_H
+#define GIC_H
+
+// Just enough of a GICv2/GICv3 driver to wake the boot CPU from WFI when a
+// device interrupts. Interrupts stay masked in PSTATE, so there are no
+// exception handlers. Pending interrupts still end WFI.
+
+int gic_init(const void *fdt);
+int gic_enable_spi(int intid);
+int gic_wait(void);
+void gic_eoi(int intid);
+void gic_shutdown(void);
+
+#endif // GIC_H
@@ -0,0 +1,430 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// gzip (RFC 1952) and DEFLATE (RFC 1951) decoder
+//
+// The complete output stays in memory, so back-references copy straight out
+// of earlier output and there's no separate sliding window. Huffman codes up
+// to FAST_BITS long are decoded with one table lookup. Longer codes are
+// rare and use the canonical code ranges.
+
+#include "decompress.h"
+#include "crc32.h"
+#include "smp.h"
+#include "util.h"
+
+#define FAST_BITS 10
+#define FAST_MASK ((1 << FAST_BITS) - 1)
+#define MAX_CODE_BITS 15
+#define NUM_LITLEN_SYMBOLS 288
+#define NUM_DIST_SYMBOLS 32
+
+#define GZIP_FHCRC    0x02
+#define GZIP_FEXTRA   0x04
+#define GZIP_FNAME    0x08
+#define GZIP_FCOMMENT 0x10
+
+struct huffman {
+    uint16_t fast[1 << FAST_BITS];  // (length << 9) | symbol or 0 if the code is longer
+    uint16_t first_code[MAX_CODE_BITS + 1];
+    uint16_t first_symbol[MAX_CODE_BITS + 1];
+    uint32_t max_code[MAX_CODE_BITS + 2]; // Exclusive and left-aligned to 16 bits
+    uint8_t size[NUM_LITLEN_SYMBOLS];
+    uint16_t value[NUM_LITLEN_SYMBOLS];
+};
+
+struct inflate_state {
+    struct decomp_input *in;
+    uint64_t bits;
+    int num_bits;
+    int overrun; // Bytes of zero padding added past the end of the input
+
+    uint8_t *out_start;
+    uint8_t *out;
+    uint8_t *out_end;
+
+    struct huffman litlen;
+    struct huffman dist;
+
+    struct smp_crc32 crc; // Checksummed on other CPUs as output is produced
+};
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const uint8_t code_length_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+// Top up the bit buffer to at least 56 bits. Past the end of the input,
+// zeros are shifted in and counted so truncation can be detected later.
+static void fill_bits(struct inflate_state *s)
+{
+    struct decomp_input *in = s->in;
+
+    while (s->num_bits <= 56) {
+        uint64_t c;
+        if (in->next != in->end) {
+            c = *in->next++;
+        } else {
+            int b = decomp_read_byte(in);
+            if (b < 0) {
+                b = 0;
+                s->overrun++;
+            }
+            c = b;
+        }
+        s->bits |= c << s->num_bits;
+        s->num_bits += 8;
+    }
+}
+
+static uint32_t get_bits(struct inflate_state *s, int n)
+{
+    if (s->num_bits < n)
+        fill_bits(s);
+
+    uint32_t v = (uint32_t) (s->bits & ((1ULL << n) - 1));
+    s->bits >>= n;
+    s->num_bits -= n;
+    return v;
+}
+
+static int bit_reverse(int v, int bits)
+{
+    int r = 0;
+    while (bits--) {
+        r = (r << 1) | (v & 1);
+        v >>= 1;
+    }
+    return r;
+}
+
+static int build_huffman(struct huffman *h, const uint8_t *lengths, int num)
+{
+    int counts[MAX_CODE_BITS + 1];
+    int next_code[MAX_CODE_BITS + 1];
+    int code = 0;
+    int k = 0;
+
+    memset_(counts, 0, sizeof(counts));
+    memset_(h->fast, 0, sizeof(h->fast));
+    for (int i = 0; i < num; i++)
+        counts[lengths[i]]++;
+    counts[0] = 0;
+
+    for (int len = 1; len <= MAX_CODE_BITS; len++) {
+        next_code[len] = code;
+        h->first_code[len] = code;
+        h->first_symbol[len] = k;
+        code += counts[len];
+        if (counts[len] && code - 1 >= (1 << len))
+            ERR_RETURN("gzip: oversubscribed Huffman code");
+        h->max_code[len] = code << (16 - len);
+        code <<= 1;
+        k += counts[len];
+    }
+    h->max_code[MAX_CODE_BITS + 1] = 0x10000;
+
+    for (int i = 0; i < num; i++) {
+        int len = lengths[i];
+        if (!len)
+            continue;
+
+        int c = next_code[len] - h->first_code[len] + h->first_symbol[len];
+        h->size[c] = len;
+        h->value[c] = i;
+        if (len <= FAST_BITS) {
+            for (int j = bit_reverse(next_code[len], len); j < (1 << FAST_BITS); j += 1 << len)
+                h->fast[j] = (len << 9) | i;
+        }
+        next_code[len]++;
+    }
+    return 0;
+}
+
+static int decode_symbol(struct inflate_state *s, const struct huffman *h)
+{
+    if (s->num_bits < 16)
+        fill_bits(s);
+
+    int entry = h->fast[s->bits & FAST_MASK];
+    int len;
+    int symbol;
+    if (entry) {
+        len = entry >> 9;
+        symbol = entry & 0x1ff;
+    } else {
+        uint32_t k = bit_reverse(s->bits & 0xffff, 16);
+        for (len = FAST_BITS + 1; k >= h->max_code[len]; len++)
+            ;
+        if (len > MAX_CODE_BITS)
+            ERR_RETURN("gzip: invalid Huffman code");
+
+        int c = (k >> (16 - len)) - h->first_code[len] + h->first_symbol[len];
+        if (c >= NUM_LITLEN_SYMBOLS || h->size[c] != len)
+            ERR_RETURN("gzip: invalid Huffman code");
+        symbol = h->value[c];
+    }
+    s->bits >>= len;
+    s->num_bits -= len;
+    return symbol;
+}
+
+static int build_fixed_tables(struct inflate_state *s)
+{
+    uint8_t lengths[NUM_LITLEN_SYMBOLS];
+    int i;
+
+    for (i = 0; i < 144; i++)
+        lengths[i] = 8;
+    for (; i < 256; i++)
+        lengths[i] = 9;
+    for (; i < 280; i++)
+        lengths[i] = 7;
+    for (; i < NUM_LITLEN_SYMBOLS; i++)
+        lengths[i] = 8;
+    OK_OR_RETURN(build_huffman(&s->litlen, lengths, NUM_LITLEN_SYMBOLS));
+
+    for (i = 0; i < NUM_DIST_SYMBOLS; i++)
+        lengths[i] = 5;
+    return build_huffman(&s->dist, lengths, NUM_DIST_SYMBOLS);
+}
+
+static int build_dynamic_tables(struct inflate_state *s)
+{
+    uint8_t lengths[NUM_LITLEN_SYMBOLS + NUM_DIST_SYMBOLS];
+    uint8_t code_lengths[19];
+    int hlit = get_bits(s, 5) + 257;
+    int hdist = get_bits(s, 5) + 1;
+    int hclen = get_bits(s, 4) + 4;
+
+    if (hlit > 286 || hdist > 30)
+        ERR_RETURN("gzip: bad dynamic block header");
+
+    memset_(code_lengths, 0, sizeof(code_lengths));
+    for (int i = 0; i < hclen; i++)
+        code_lengths[code_length_order[i]] = get_bits(s, 3);
+    OK_OR_RETURN(build_huffman(&s->litlen, code_lengths, 19));
+
+    int n = 0;
+    while (n < hlit + hdist) {
+        int sym = decode_symbol(s, &s->litlen);
+        int repeat;
+        uint8_t value = 0;
+
+        if (sym < 0 || sym > 18)
+            ERR_RETURN("gzip: bad code lengths");
+
+        if (sym < 16) {
+            lengths[n++] = sym;
+            continue;
+        } else if (sym == 16) {
+            if (n == 0)
+                ERR_RETURN("gzip: repeat with no previous length");
+            value = lengths[n - 1];
+            repeat = 3 + get_bits(s, 2);
+        } else if (sym == 17) {
+            repeat = 3 + get_bits(s, 3);
+        } else {
+            repeat = 11 + get_bits(s, 7);
+        }
+
+        if (n + repeat > hlit + hdist)
+            ERR_RETURN("gzip: code lengths overflow");
+        memset_(&lengths[n], value, repeat);
+        n += repeat;
+    }
+
+    if (lengths[256] == 0)
+        ERR_RETURN("gzip: missing end-of-block code");
+
+    OK_OR_RETURN(build_huffman(&s->litlen, lengths, hlit));
+    return build_huffman(&s->dist, &lengths[hlit], hdist);
+}
+
+static int inflate_stored(struct inflate_state *s)
+{
+    // Stored blocks start on a byte boundary
+    get_bits(s, s->num_bits & 7);
+
+    uint32_t len = get_bits(s, 16);
+    uint32_t nlen = get_bits(s, 16);
+    if ((len ^ 0xffff) != nlen)
+        ERR_RETURN("gzip: stored block length check failed");
+    if (len > (size_t) (s->out_end - s->out))
+        ERR_RETURN("gzip: output too large");
+
+    // Drain whole bytes out of the bit buffer and then copy directly
+    while (len && s->num_bits >= 8) {
+        *s->out++ = (uint8_t) get_bits(s, 8);
+        len--;
+    }
+    OK_OR_RETURN_MSG(decomp_read(s->in, s->out, len), "gzip: compressed data is truncated");
+    s->out += len;
+    return 0;
+}
+
+static int inflate_codes(struct inflate_state *s)
+{
+    for (;;) {
+        if (s->num_bits < 48) {
+            fill_bits(s);
+
+            // More padding than the bit buffer holds means some was used
+            if (s->overrun > 8)
+                ERR_RETURN("gzip: compressed data is truncated");
+        }
+
+        int sym = decode_symbol(s, &s->litlen);
+        if (sym < 256) {
+            if (sym < 0)
+                return -1;
+            if (s->out == s->out_end)
+                ERR_RETURN("gzip: output too large");
+            *s->out++ = (uint8_t) sym;
+            continue;
+        }
+        if (sym == 256)
+            return 0;
+
+        sym -= 257;
+        if (sym >= 29)
+            ERR_RETURN("gzip: bad length code");
+        size_t len = length_base[sym] + get_bits(s, length_extra[sym]);
+
+        int dsym = decode_symbol(s, &s->dist);
+        if (dsym < 0 || dsym >= 30)
+            ERR_RETURN("gzip: bad distance code");
+        size_t dist = dist_base[dsym] + get_bits(s, dist_extra[dsym]);
+
+        if (dist > (size_t) (s->out - s->out_start))
+            ERR_RETURN("gzip: distance too far back");
+        if (len > (size_t) (s->out_end - s->out))
+            ERR_RETURN("gzip: output too large");
+
+        const uint8_t *src = s->out - dist;
+        if (dist >= len) {
+            memcpy_(s->out, src, len);
+            s->out += len;
+        } else {
+            // Overlapping copies repeat the last `dist` bytes
+            while (len--)
+                *s->out++ = *src++;
+        }
+    }
+}
+
+static int skip_zero_terminated(struct inflate_state *s)
+{
+    for (;;) {
+        if (s->overrun)
+            ERR_RETURN("gzip: truncated header");
+        if (get_bits(s, 8) == 0)
+            return 0;
+    }
+}
+
+static int gunzip_stream(struct inflate_state *s)
+{
+    if (get_bits(s, 8) != 0x1f || get_bits(s, 8) != 0x8b)
+        ERR_RETURN("gzip: bad magic");
+    if (get_bits(s, 8) != 8)
+        ERR_RETURN("gzip: unsupported compression method");
+
+    int flags = get_bits(s, 8);
+    get_bits(s, 32); // MTIME
+    get_bits(s, 16); // XFL and OS
+
+    if (flags & GZIP_FEXTRA) {
+        uint32_t xlen = get_bits(s, 16);
+        while (xlen--)
+            get_bits(s, 8);
+    }
+    if (flags & GZIP_FNAME)
+        OK_OR_RETURN(skip_zero_terminated(s));
+    if (flags & GZIP_FCOMMENT)
+        OK_OR_RETURN(skip_zero_terminated(s));
+    if (flags & GZIP_FHCRC)
+        get_bits(s, 16);
+
+    int last;
+    do {
+        last = get_bits(s, 1);
+        switch (get_bits(s, 2)) {
+        case 0:
+            OK_OR_RETURN(inflate_stored(s));
+            break;
+        case 1:
+            OK_OR_RETURN(build_fixed_tables(s));
+            OK_OR_RETURN(inflate_codes(s));
+            break;
+        case 2:
+            OK_OR_RETURN(build_dynamic_tables(s));
+            OK_OR_RETURN(inflate_codes(s));
+            break;
+        default:
+            ERR_RETURN("gzip: invalid block type");
+        }
+        if (s->overrun * 8 > s->num_bits)
+            ERR_RETURN("gzip: compressed data is truncated");
+
+        smp_crc32_update(&s->crc, s->out - s->out_start);
+    } while (!last);
+
+    // The trailer is byte-aligned
+    get_bits(s, s->num_bits & 7);
+    uint32_t expected_crc = get_bits(s, 32);
+    uint32_t expected_size = get_bits(s, 32);
+    if (s->overrun * 8 > s->num_bits)
+        ERR_RETURN("gzip: missing trailer");
+
+    size_t len = s->out - s->out_start;
+    if (expected_size != (uint32_t) len)
+        ERR_RETURN("gzip: size mismatch (expected %u; got %lu)", expected_size, len);
+
+    uint32_t actual_crc = smp_crc32_end(&s->crc, len);
+    if (expected_crc != actual_crc)
+        ERR_RETURN("gzip: CRC32 mismatch (expected 0x%08x; got 0x%08x)", expected_crc, actual_crc);
+
+    return 0;
+}
+
+int gunzip(struct decomp_input *in, uint8_t *out, size_t out_max, size_t *out_len)
+{
+    // The Huffman tables are too big for the loader's stack
+    struct inflate_state *s = malloc_(sizeof(struct inflate_state));
+    if (!s)
+        ERR_RETURN("gzip: out of memory");
+
+    memset_(s, 0, sizeof(*s));
+    s->in = in;
+    s->out_start = out;
+    s->out = out;
+    s->out_end = out + out_max;
+    smp_crc32_begin(&s->crc, out);
+
+    int rc = gunzip_stream(s);
+    *out_len = s->out - s->out_start;
+
+    // Checksum jobs point into the state, so they have to finish on errors too
+    smp_wait();
+    free_(s);
+    return rc;
+}
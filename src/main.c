@@ -5,7 +5,15 @@
  */
 
 #include "virtio.h"
+#include "blk_cache.h"
+#include "bootstage.h"
+#include "decompress.h"
+#include "dt.h"
+#include "fdt_fixup.h"
+#include "gic.h"
+#include "mmu.h"
 #include "pl011_uart.h"
+#include "smp.h"
 #include "uboot_env.h"
 #include "util.h"
 #include "libfdt/libfdt.h"
@@ -16,90 +24,140 @@
 #define UBOOT_ENV_LBA        16
 #define UBOOT_ENV_SIZE       (256 * 512) // 128 KiB
 #define DEFAULT_KERNEL_LBA   512 // Initially what's not in demo/fwup.conf to avoid missing a U-Boot environment issue
-#define KERNEL_MAX_LENGTH    (64 * 1024 * 1024)
-#define KERNEL_LOAD_ADDR     0x40200000UL
-
-static struct uboot_env uboot_env;
+#define KERNEL_WINDOW_SIZE   (64 * 1024 * 1024) // Space for kernels unless the header asks for more
+#define KERNEL_ALIGN         (2 * 1024 * 1024) // Image base alignment from booting.txt
+#define KERNEL_ARGS_MAX      2048 // Same as Linux's COMMAND_LINE_SIZE on arm64
+#define DTB_MAX_SIZE         (2 * 1024 * 1024) // arm64 booting.txt limit
+#define DTB_HEADROOM         4096 // Free space left in the DTB for Linux
+
+// Image header flags
+#define KERNEL_FLAG_BE             (1UL << 0)
+#define KERNEL_FLAG_PAGE_SIZE(f)   (((f) >> 1) & 0x3)
+#define KERNEL_FLAG_PHYS_ANYWHERE  (1UL << 3)
+
+// Compressed kernels are read into the top of the kernel's window while the
+// decompressed kernel is written from the bottom.
+#define KERNEL_STAGING_SIZE  (VIRTIO_BLK_STREAM_DEPTH * VIRTIO_BLK_CHUNK_SIZE)
+
+static char kernel_args[KERNEL_ARGS_MAX];
+static struct fdt_fixup dtb_fixup;
+
+// RAM that the loader is in and what in it can't be overwritten before
+// Linux starts
+static uint64_t ram_start;
+static uint64_t ram_end;
+static uint64_t qemu_dtb_start;
+static uint64_t qemu_dtb_end;
+
+// Write the sectors that uboot_env_write() changed. Neighboring sectors are
+// written together.
+static int write_uboot_env_changes(const struct uboot_env *env, const uint8_t *buffer)
+{
+    int sectors = UBOOT_ENV_SIZE / SECTOR_SIZE;
+    int i = 0;
 
-struct boot_config {
-    uint64_t kernel_lba;
-    char *kernel_args;
-};
+    while (i < sectors) {
+        if (!uboot_env_sector_dirty(env, i)) {
+            i++;
+            continue;
+        }
 
-uint32_t be32_to_le32(uint32_t x)
-{
-    return ((x >> 24) & 0x000000FF) |
-           ((x >> 8)  & 0x0000FF00) |
-           ((x << 8)  & 0x00FF0000) |
-           ((x << 24) & 0xFF000000);
+        int first = i;
+        while (i < sectors && uboot_env_sector_dirty(env, i))
+            i++;
+        OK_OR_RETURN(virtio_blk_write(UBOOT_ENV_LBA + first, (i - first) * SECTOR_SIZE, buffer + first * SECTOR_SIZE));
+    }
+    return 0;
 }
 
-static void process_uboot_env(uint64_t *kernel_lba, char **kernel_args)
+static void process_uboot_env(uint64_t *kernel_lba, char *kernel_args)
 {
+    // Everything allocated here is released on return
+    struct heap_mark mark = heap_mark();
     uint8_t *buffer = malloc_(UBOOT_ENV_SIZE);
     struct uboot_env env;
-    struct boot_config config = {DEFAULT_KERNEL_LBA, NULL};
+    int rc = 0;
 
     uboot_env_init(&env, UBOOT_ENV_SIZE);
-    int rc = virtio_blk_read(UBOOT_ENV_LBA, UBOOT_ENV_SIZE, buffer);
+    rc = virtio_blk_read(UBOOT_ENV_LBA, UBOOT_ENV_SIZE, buffer);
     if (rc < 0)
         fatal("Failed to read u-boot environment from LBA %d\n", UBOOT_ENV_LBA);
 
     *kernel_lba = DEFAULT_KERNEL_LBA;
-    *kernel_args = NULL;
-
-    char *active_slot = NULL;
-    char *upgrade_available = NULL;
-    char *bootcount = NULL;
-    char *kernel_lba_str = NULL;
+    kernel_args[0] = '\0';
+
+    // Lookups return pointers into `buffer`, so nothing is copied
+    const char *active_slot;
+    const char *upgrade_available;
+    const char *bootcount;
+    const char *kernel_lba_str;
+    char slot;
     char kernel_lba_key[32];
     char kernel_args_key[32];
     strcpy_(kernel_lba_key, "x.kernel_lba");
     strcpy_(kernel_args_key, "x.kernel_args");
 
     OK_OR_CLEANUP_MSG(uboot_env_read(&env, (const char *)buffer), "Failed to read u-boot environment from buffer");
-    OK_OR_CLEANUP_MSG(uboot_env_getenv(&env, "nerves_fw_active", &active_slot), "Failed to get `nerves_fw_active` from U-Boot environment");
-    OK_OR_CLEANUP_MSG(uboot_env_getenv(&env, "upgrade_available", &upgrade_available), "Failed to get `upgrade_available`. Skipping automatic failback check.");
+    active_slot = uboot_env_get(&env, "nerves_fw_active");
+    if (!active_slot)
+        ERR_CLEANUP_MSG("Failed to get `nerves_fw_active` from U-Boot environment");
+    slot = active_slot[0];
+
+    upgrade_available = uboot_env_get(&env, "upgrade_available");
+    if (!upgrade_available)
+        ERR_CLEANUP_MSG("Failed to get `upgrade_available`. Skipping automatic failback check.");
 
     if (strcmp_(upgrade_available, "1") == 0) {
-        OK_OR_CLEANUP_MSG(uboot_env_getenv(&env, "bootcount", &bootcount), "Failed to get `bootcount`. Skipping automatic failback check.");
+        bootcount = uboot_env_get(&env, "bootcount");
+        if (!bootcount)
+            ERR_CLEANUP_MSG("Failed to get `bootcount`. Skipping automatic failback check.");
+
         if (strcmp_(bootcount, "1") == 0) {
             // Previous boot failed, so switch back to the other slot
-            info("Slot %s didn't validate, so reverting back...", active_slot);
-            if (active_slot[0] == 'a')
-                active_slot[0] = 'b';
-            else
-                active_slot[0] = 'a';
+            info("Slot %c didn't validate, so reverting back...", slot);
+            slot = (slot == 'a') ? 'b' : 'a';
 
-            uboot_env_setenv(&env, "nerves_fw_active", active_slot);
+            char new_active_slot[2] = {slot, '\0'};
+            uboot_env_setenv(&env, "nerves_fw_active", new_active_slot);
             uboot_env_setenv(&env, "upgrade_available", "0");
             uboot_env_setenv(&env, "bootcount", "0");
         } else {
             // First try of new firmware slot, so increment bootcount
-            info("Trying slot %s for the first time...", active_slot);
+            info("Trying slot %c for the first time...", slot);
             uboot_env_setenv(&env, "bootcount", "1");
         }
+    }
 
-        if (uboot_env_write(&env, buffer) < 0 || virtio_blk_write(UBOOT_ENV_LBA, UBOOT_ENV_SIZE, buffer) < 0)
+    if (uboot_env_dirty(&env)) {
+        // Serialize to a separate buffer since the env still points into
+        // the one that was read.
+        uint8_t *new_buffer = malloc_(UBOOT_ENV_SIZE);
+        if (uboot_env_write(&env, (char *) new_buffer) < 0 || write_uboot_env_changes(&env, new_buffer) < 0)
             info("Failed to write u-boot environment after failback!!");
+        free_(new_buffer);
     }
 
-    kernel_lba_key[0] = active_slot[0];
-    OK_OR_CLEANUP_MSG(uboot_env_getenv(&env, kernel_lba_key, &kernel_lba_str), "No '%s' variable found in u-boot environment, using default.", kernel_lba_key);
+    kernel_lba_key[0] = slot;
+    kernel_lba_str = uboot_env_get(&env, kernel_lba_key);
+    if (!kernel_lba_str)
+        ERR_CLEANUP_MSG("No '%s' variable found in u-boot environment, using default.", kernel_lba_key);
     *kernel_lba = strtoull_(kernel_lba_str, NULL, 10);
 
-    kernel_args_key[0] = active_slot[0];
-    uboot_env_getenv(&env, kernel_args_key, kernel_args);
+    // The kernel arguments are needed after the environment is freed
+    kernel_args_key[0] = slot;
+    const char *args = uboot_env_get(&env, kernel_args_key);
+    if (args) {
+        if (strnlen_(args, KERNEL_ARGS_MAX) == KERNEL_ARGS_MAX)
+            ERR_CLEANUP_MSG("'%s' is longer than %d bytes. Ignoring.", kernel_args_key, KERNEL_ARGS_MAX - 1);
+        strcpy_(kernel_args, args);
+    }
 
-    info("Booting from slot %s (kernel LBA %lu, kernel_args: %s)", active_slot, kernel_lba, *kernel_args ? *kernel_args : "<none>");
+    info("Booting from slot %c (kernel LBA %lu, kernel_args: %s)", slot, *kernel_lba, kernel_args[0] ? kernel_args : "<none>");
 
 cleanup:
-    free_(kernel_lba_str);
-    free_(active_slot);
-    free_(upgrade_available);
-    free_(bootcount);
     uboot_env_free(&env);
     free_(buffer);
+    heap_release(mark);
 }
 
 struct kernel_header {
@@ -115,65 +173,234 @@ struct kernel_header {
   uint32_t res5;	/* reserved (used for PE COFF offset) */
 };
 
-static size_t load_kernel(uint64_t lba, uint8_t *kernel_base)
+static int kernel_stream_refill(struct decomp_input *in)
 {
-    int rc = virtio_blk_read(lba, SECTOR_SIZE, kernel_base);
-    if (rc < 0)
-        fatal("Failed to read kernel header at LBA %lu", lba);
+    const uint8_t *data;
+    int len = virtio_blk_stream_next(in->priv, &data);
+    if (len <= 0)
+        return -1;
+
+    in->next = data;
+    in->end = data + len;
+    return 0;
+}
+
+static void find_ram(const void *fdt)
+{
+    uint64_t loader = (uintptr_t) heap_limit();
+
+    // Use the memory region with the loader in it
+    int node = fdt_node_offset_by_prop_value(fdt, -1, "device_type", "memory", sizeof("memory"));
+    while (node >= 0) {
+        uint64_t addr, size;
+        for (int i = 0; dt_get_reg(fdt, node, i, &addr, &size) == 0; i++) {
+            if (loader > addr && loader <= addr + size) {
+                ram_start = addr;
+                ram_end = addr + size;
+            }
+        }
+        node = fdt_node_offset_by_prop_value(fdt, node, "device_type", "memory", sizeof("memory"));
+    }
+    if (ram_end == 0)
+        fatal("Can't find the /memory node with the loader in it");
 
-    struct kernel_header *header = (struct kernel_header*) kernel_base;
+    qemu_dtb_start = (uintptr_t) fdt;
+    qemu_dtb_end = qemu_dtb_start + fdt_totalsize(fdt);
+}
+
+// Pick where the kernel goes from its header. Per booting.txt, the Image
+// goes `text_offset` bytes above a 2 MiB aligned base. When flags bit 3 is
+// set, the base can be anywhere in RAM, so the kernel goes as high as it can
+// with room for the DTB after it. Linux then doesn't need to move itself on
+// VMs with a lot of memory. Otherwise, the kernel goes as close to the start
+// of RAM as the loader allows.
+static uint8_t *place_kernel(uint64_t text_offset, uint64_t flags, uint64_t window)
+{
+    uint64_t low = (ram_start > (uintptr_t) heap_limit() ? ram_start : (uintptr_t) heap_limit());
+    uint64_t base = (low + KERNEL_ALIGN - 1) & ~(uint64_t) (KERNEL_ALIGN - 1);
+    uint64_t needed = text_offset + window + DTB_MAX_SIZE;
+
+    if (base + needed > ram_end)
+        fatal("%lu MiB kernel doesn't fit in RAM after the loader", window >> 20);
+
+    if (flags & KERNEL_FLAG_PHYS_ANYWHERE) {
+        uint64_t high = (ram_end - needed) & ~(uint64_t) (KERNEL_ALIGN - 1);
+
+        // Stay below QEMU's DTB if it's in the way since it's still needed
+        if (high < qemu_dtb_end && high + needed > qemu_dtb_start)
+            high = (qemu_dtb_start - needed) & ~(uint64_t) (KERNEL_ALIGN - 1);
+        if (high > base && high < ram_end)
+            base = high;
+    }
+    if (base < qemu_dtb_end && base + needed > qemu_dtb_start)
+        fatal("Kernel at 0x%lx would overwrite QEMU's DTB at 0x%lx", base + text_offset, qemu_dtb_start);
+
+    return (uint8_t *) (base + text_offset);
+}
+
+static void check_kernel_flags(uint64_t flags)
+{
+    if (flags & KERNEL_FLAG_BE)
+        fatal("Big endian kernels aren't supported");
+
+    // Catch kernels that can't run on this CPU's MMU now rather than having
+    // Linux hang without output
+    uint64_t mmfr0 = read_sysreg(id_aa64mmfr0_el1);
+    int page_kib = 0;
+    int supported = 1;
+    switch (KERNEL_FLAG_PAGE_SIZE(flags)) {
+    case 1:
+        page_kib = 4;
+        supported = ((mmfr0 >> 28) & 0xf) != 0xf;
+        break;
+    case 2:
+        page_kib = 16;
+        supported = ((mmfr0 >> 20) & 0xf) != 0;
+        break;
+    case 3:
+        page_kib = 64;
+        supported = ((mmfr0 >> 24) & 0xf) != 0xf;
+        break;
+    default:
+        break;
+    }
+    if (!supported)
+        fatal("Kernel uses %d KiB pages, but the CPU doesn't support them", page_kib);
+}
+
+static const struct kernel_header *check_kernel_header(const uint8_t *kernel_base, uint64_t *window)
+{
+    const struct kernel_header *header = (const struct kernel_header*) kernel_base;
     if (header->magic != 0x644d5241)
         fatal("Linux kernel header magic isn't ARM\\x64");
 
-    if (header->image_size > KERNEL_MAX_LENGTH)
-        fatal("Linux kernel header image size of %lu is larger than max support size of %lu", header->image_size, KERNEL_MAX_LENGTH);
+    // Kernels before Linux 3.17 leave image_size at 0, and then neither the
+    // window nor how much to read is known
+    if (header->image_size == 0)
+        fatal("Kernel image_size is 0. Kernels older than Linux 3.17 aren't supported");
+
+    check_kernel_flags(header->flags);
+
+    // Bigger kernels get a bigger window
+    *window = (header->image_size + KERNEL_ALIGN - 1) & ~(uint64_t) (KERNEL_ALIGN - 1);
+    if (*window < KERNEL_WINDOW_SIZE)
+        *window = KERNEL_WINDOW_SIZE;
+    return header;
+}
+
+static size_t load_compressed_kernel(uint64_t lba, uint8_t *kernel_base, enum decomp_format format)
+{
+    struct heap_mark mark = heap_mark();
+    struct virtio_blk_stream stream;
+    struct decomp_input in = {NULL, NULL, kernel_stream_refill, &stream};
+    uint8_t *staging = kernel_base + KERNEL_WINDOW_SIZE - KERNEL_STAGING_SIZE;
+    size_t len;
+
+    // The compressed length isn't known up front, so read ahead until the
+    // decompressor stops asking for more. Decompression overlaps the reads.
+    if (virtio_blk_stream_open(&stream, lba, KERNEL_WINDOW_SIZE / SECTOR_SIZE, staging) < 0)
+        fatal("Failed to read kernel at LBA %lu", lba);
+    int rc = decompress(format, &in, kernel_base, staging - kernel_base, &len);
+    virtio_blk_stream_close(&stream);
+    heap_release(mark);
 
-    int num_sectors = (int) ((header->image_size + SECTOR_SIZE - 1) / SECTOR_SIZE);
-    rc = virtio_blk_read(lba + 1, (num_sectors - 1) * SECTOR_SIZE, kernel_base + SECTOR_SIZE);
     if (rc < 0)
-        fatal("Failed to read kernel");
+        fatal("Failed to decompress %s kernel at LBA %lu", decomp_format_name(format), lba);
 
-    return header->image_size;
+    info("Decompressed %s kernel to %lu bytes", decomp_format_name(format), len);
+    return len;
 }
 
-static void fdt_add_bootargs(void *dtb, const char *bootargs)
+static void read_kernel(struct virtio_blk_stream *stream, size_t image_size)
 {
-    int ret;
-
-    if (!bootargs)
-        return;
-
-    // Validate the DTB
-    OK_OR_FATAL(fdt_check_header(dtb), "Invalid DTB header from QEMU?");
-
-    // Find or create /chosen node
-    int chosen_offset = fdt_path_offset(dtb, "/chosen");
-    if (chosen_offset == -FDT_ERR_NOTFOUND) {
-        chosen_offset = fdt_add_subnode(dtb, 0, "chosen");
-        if (chosen_offset < 0)
-            fatal("Failed to create /chosen node: %s", fdt_strerror(chosen_offset));
-    } else if (chosen_offset < 0) {
-        fatal("Error finding /chosen node: %s", fdt_strerror(chosen_offset));
+    const uint8_t *data;
+    int len;
+
+    virtio_blk_stream_set_length(stream, (image_size + SECTOR_SIZE - 1) / SECTOR_SIZE);
+    while ((len = virtio_blk_stream_next(stream, &data)) > 0)
+        ;
+    virtio_blk_stream_close(stream);
+    if (len < 0)
+        fatal("Failed to read kernel");
+}
+
+// Load the kernel to where its header says it should go and return its base
+static uint8_t *load_kernel(uint64_t lba, size_t *kernel_len)
+{
+    struct virtio_blk_stream stream;
+    const uint8_t *data;
+    uint64_t window;
+
+    // Start reading the whole kernel window before knowing how big the
+    // kernel is so that the header doesn't cost its own round trip. The
+    // read goes where current kernels want to be and gets cut down to the
+    // image size once the header arrives.
+    uint8_t *guess = place_kernel(0, KERNEL_FLAG_PHYS_ANYWHERE, KERNEL_WINDOW_SIZE);
+    if (virtio_blk_stream_open_direct(&stream, lba, KERNEL_WINDOW_SIZE / SECTOR_SIZE, guess) < 0)
+        fatal("Failed to read kernel header at LBA %lu", lba);
+    int len = virtio_blk_stream_next(&stream, &data);
+    if (len < SECTOR_SIZE)
+        fatal("Failed to read kernel header at LBA %lu", lba);
+
+    enum decomp_format format = decomp_detect(guess, len);
+    if (format != DECOMP_NONE) {
+        // The compressed data has to be staged elsewhere, so start over
+        virtio_blk_stream_close(&stream);
+        size_t decompressed_len = load_compressed_kernel(lba, guess, format);
+
+        const struct kernel_header *header = check_kernel_header(guess, &window);
+        size_t image_size = header->image_size;
+
+        // image_size includes the BSS, so the file should be smaller
+        if (decompressed_len > image_size)
+            fatal("Decompressed kernel is larger than its image size of %lu", image_size);
+
+        uint8_t *kernel_base = place_kernel(header->text_offset, header->flags, window);
+        if (kernel_base != guess) {
+            info("Moving kernel to 0x%lx", (uintptr_t) kernel_base);
+            memmove_(kernel_base, guess, decompressed_len);
+        }
+
+        // Don't leave old compressed data where the kernel's BSS goes
+        smp_memset(kernel_base + decompressed_len, 0, image_size - decompressed_len);
+        *kernel_len = image_size;
+        return kernel_base;
+    }
+
+    // The stream put its first blocks in the block cache, so this doesn't go
+    // back to the disk
+    struct kernel_header raw_header;
+    if (virtio_blk_read(lba, sizeof(raw_header), &raw_header) < 0)
+        fatal("Failed to read kernel header at LBA %lu", lba);
+
+    const struct kernel_header *header = check_kernel_header((const uint8_t *) &raw_header, &window);
+    size_t image_size = header->image_size;
+    uint8_t *kernel_base = place_kernel(header->text_offset, header->flags, window);
+    if (kernel_base != guess || image_size > KERNEL_WINDOW_SIZE) {
+        // Older kernels and big ones need a different spot, so start over
+        virtio_blk_stream_close(&stream);
+        info("Reading kernel to 0x%lx", (uintptr_t) kernel_base);
+        if (virtio_blk_stream_open_direct(&stream, lba, window / SECTOR_SIZE, kernel_base) < 0)
+            fatal("Failed to read kernel at LBA %lu", lba);
     }
+    read_kernel(&stream, image_size);
 
-    // Set or update bootargs property
-    ret = fdt_setprop(dtb, chosen_offset, "bootargs", bootargs, strlen_(bootargs) + 1);
-    if (ret < 0)
-        fatal("Failed to set bootargs property: %s", fdt_strerror(ret));
+    info("Read %lu byte kernel to 0x%lx", image_size, (uintptr_t) kernel_base);
+
+    *kernel_len = image_size;
+    return kernel_base;
 }
 
-void load_dtb(uint32_t *dtb_source, uint8_t *dtb_load_addr, const char *bootargs)
+static void load_dtb(const uint32_t *dtb_source, uint8_t *dtb_load_addr, struct fdt_fixup *fixup)
 {
     uint32_t magic = dtb_source[0];
     if (magic != 0xedfe0dd0)
         fatal("DTB address needs to be passed in x0, but magic number is 0x%08x", magic);
 
-    uint32_t len = be32_to_le32(dtb_source[1]);
-
-    uint32_t *dest = (uint32_t*) dtb_load_addr;
-
-    memcpy_(dest, dtb_source, len);
-    fdt_add_bootargs(dest, bootargs);
+    // Copy and edit the DTB in one pass
+    int rc = fdt_fixup_apply(fixup, dtb_source, dtb_load_addr, DTB_MAX_SIZE, DTB_HEADROOM);
+    if (rc < 0)
+        fatal("Failed to write DTB: %s", fdt_strerror(rc));
 }
 
 static void setup_el2()
@@ -187,8 +414,10 @@ static void setup_el2()
 }
 
 void rom_main(uint64_t dtb_source) {
+    bootstage_mark(BOOTSTAGE_START);
     util_init();
-    uart_init();
+    uart_init((const void *) dtb_source);
+    bootstage_mark(BOOTSTAGE_UART_INIT);
 
     // Use uart_puts directly to try to get something to the UART
     // with the minimum amount of code. The info() and fatal()
@@ -212,32 +441,58 @@ void rom_main(uint64_t dtb_source) {
             break;
     }
 
-    virtio_blk_init();
+    // Everything from here on benefits from running with caches enabled
+    mmu_init();
+    smp_init((const void *) dtb_source);
+
+    virtio_blk_init((const void *) dtb_source);
+    OK_OR_WARN(virtio_blk_enable_irq((const void *) dtb_source), "Falling back to polling for virtio completions");
+    bootstage_mark(BOOTSTAGE_VIRTIO_INIT);
+
+    // The kernel goes above the heap, so it can't grow into it
+    find_ram((const void *) dtb_source);
 
     uint64_t kernel_lba;
-    char *kernel_args;
 
-    process_uboot_env(&kernel_lba, &kernel_args);
-    size_t kernel_len = load_kernel(kernel_lba, (uint8_t*) KERNEL_LOAD_ADDR);
+    process_uboot_env(&kernel_lba, kernel_args);
+    bootstage_mark(BOOTSTAGE_UBOOT_ENV);
+
+    size_t kernel_len;
+    uint8_t *kernel_base = load_kernel(kernel_lba, &kernel_len);
+    bootstage_mark(BOOTSTAGE_LOAD_KERNEL);
+
+    // DTB edits are collected and then written with the DTB in one pass.
+    // The boot timing properties are filled in at handoff.
+    fdt_fixup_init(&dtb_fixup);
+    if (kernel_args[0])
+        OK_OR_FATAL(fdt_fixup_setprop_string(&dtb_fixup, "/chosen", "bootargs", kernel_args), "Failed to set bootargs");
+    int bootstage_rc = bootstage_fdt_fixup(&dtb_fixup);
+    OK_OR_WARN(bootstage_rc, "Failed to add boot timing to the DTB");
 
-    uint8_t *dtb_load_addr = (uint8_t*) (KERNEL_LOAD_ADDR + ((kernel_len + 7) & ~0x7));
-    load_dtb((uint32_t*) dtb_source, dtb_load_addr, kernel_args);
+    uint8_t *dtb_load_addr = kernel_base + ((kernel_len + 7) & ~0x7);
+    load_dtb((const uint32_t*) dtb_source, dtb_load_addr, &dtb_fixup);
+    bootstage_mark(BOOTSTAGE_LOAD_DTB);
 
-    if (kernel_args)
-        free_(kernel_args);
+    heap_report();
+    blk_cache_report();
+    bootstage_mark(BOOTSTAGE_HANDOFF);
+    if (bootstage_rc == 0)
+        OK_OR_WARN(bootstage_fdt_update(dtb_load_addr), "Failed to update boot timing in the DTB");
+    bootstage_report();
+
+    // Stop the disk so that Linux finds it reset
+    virtio_blk_shutdown();
+
+    // Linux starts the other CPUs itself and needs them off
+    smp_shutdown();
+    gic_shutdown();
 
     info("Starting Linux...");
-    asm volatile (
-        "mov x0, %0\n"              // dtb_addr → x0
-        "mov x1, xzr\n"
-        "mov x2, xzr\n"
-        "mov x3, xzr\n"
-        "br %1\n"
-        :
-        : "r"(dtb_load_addr), "r"(KERNEL_LOAD_ADDR)
-        : "x0", "x1", "x2", "x3"
-    );
 
-    // unreachable
-    fatal("");
+    // Push the kernel and DTB out of the D-cache so that they're visible
+    // once the MMU is turned off.
+    mmu_clean_inval_dcache_range(kernel_base, kernel_len);
+    mmu_clean_inval_dcache_range(dtb_load_addr, fdt_totalsize(dtb_load_addr));
+
+    boot_linux((uint64_t) dtb_load_addr, (uint64_t) kernel_base);
 }
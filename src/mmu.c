@@ -0,0 +1,166 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "mmu.h"
+#include "util.h"
+
+// Identity map the first 512 GiB with 1 GiB blocks from one level 1 table.
+// This follows the QEMU virt memory map:
+//
+//   0 - 1 GiB     Flash, GIC, UART, virtio-mmio, PCIe MMIO (device)
+//   1 - 256 GiB   RAM (normal, write-back)
+//   256 - 512 GiB High PCIe ECAM and MMIO (device)
+//
+// Running with caches on makes everything that touches memory (CRC32,
+// memcpy_, libfdt) much faster than the non-cacheable accesses that happen
+// with the MMU off.
+#define MMU_VA_BITS       39
+#define MMU_BLOCK_SHIFT   30
+#define MMU_NUM_ENTRIES   512
+#define MMU_RAM_START_GB  1
+#define MMU_RAM_END_GB    256
+
+// MAIR attribute indices
+#define MT_DEVICE_nGnRnE  0
+#define MT_NORMAL         1
+#define MAIR_VALUE        ((0x00UL << (8 * MT_DEVICE_nGnRnE)) | (0xffUL << (8 * MT_NORMAL)))
+
+// Block descriptor bits
+#define PTE_BLOCK         (1UL << 0)
+#define PTE_ATTRINDX(n)   ((uint64_t)(n) << 2)
+#define PTE_AP_EL2_RES1   (1UL << 6)
+#define PTE_SH_INNER      (3UL << 8)
+#define PTE_AF            (1UL << 10)
+#define PTE_PXN           (1UL << 53)
+#define PTE_XN            (1UL << 54)
+
+// Translation control bits common to TCR_EL1 and TCR_EL2
+#define TCR_T0SZ          (64 - MMU_VA_BITS)
+#define TCR_IRGN0_WBWA    (1UL << 8)
+#define TCR_ORGN0_WBWA    (1UL << 10)
+#define TCR_SH0_INNER     (3UL << 12)
+#define TCR_TG0_4K        (0UL << 14)
+#define TCR_EL1_EPD1      (1UL << 23)
+#define TCR_EL1_IPS_SHIFT 32
+#define TCR_EL2_RES1      ((1UL << 31) | (1UL << 23))
+#define TCR_EL2_PS_SHIFT  16
+
+#define SCTLR_M           (1UL << 0)
+#define SCTLR_C           (1UL << 2)
+#define SCTLR_I           (1UL << 12)
+
+static uint64_t level1_table[MMU_NUM_ENTRIES] __attribute__((aligned(4096)));
+static int enabled;
+
+// Defined in the linker script
+extern char _image_start[];
+extern char _stack_top[];
+
+static uint64_t dcache_line_size(void)
+{
+    // CTR_EL0.DminLine is log2 of the number of words in the smallest line
+    return 4UL << ((read_sysreg(ctr_el0) >> 16) & 0xf);
+}
+
+// Drop the range from the D-cache without writing anything back
+static void inval_dcache_range(const void *start, size_t len)
+{
+    uint64_t line_size = dcache_line_size();
+    uintptr_t addr = (uintptr_t) start & ~(line_size - 1);
+    uintptr_t end = (uintptr_t) start + len;
+
+    for (; addr < end; addr += line_size)
+        asm volatile ("dc ivac, %0" :: "r"(addr) : "memory");
+
+    asm volatile ("dsb sy" ::: "memory");
+}
+
+// Turn on the MMU with level1_table on the calling CPU
+static void mmu_enable(int el)
+{
+    // 52-bit PAs aren't reachable with a 4 KiB granule, so cap at 48 bits
+    uint64_t pa_range = read_sysreg(id_aa64mmfr0_el1) & 0xf;
+    if (pa_range > 5)
+        pa_range = 5;
+
+    uint64_t tcr = TCR_T0SZ | TCR_IRGN0_WBWA | TCR_ORGN0_WBWA | TCR_SH0_INNER | TCR_TG0_4K;
+
+    // Make sure that the page table writes are done before the walker uses it
+    asm volatile ("dsb ish" ::: "memory");
+    if (el == 2) {
+        write_sysreg(mair_el2, MAIR_VALUE);
+        write_sysreg(tcr_el2, tcr | TCR_EL2_RES1 | (pa_range << TCR_EL2_PS_SHIFT));
+        write_sysreg(ttbr0_el2, (uintptr_t) level1_table);
+        asm volatile ("isb; tlbi alle2; dsb ish; ic iallu; dsb ish; isb" ::: "memory");
+        write_sysreg(sctlr_el2, read_sysreg(sctlr_el2) | SCTLR_M | SCTLR_C | SCTLR_I);
+    } else {
+        write_sysreg(mair_el1, MAIR_VALUE);
+        write_sysreg(tcr_el1, tcr | TCR_EL1_EPD1 | (pa_range << TCR_EL1_IPS_SHIFT));
+        write_sysreg(ttbr0_el1, (uintptr_t) level1_table);
+        asm volatile ("isb; tlbi vmalle1; dsb ish; ic iallu; dsb ish; isb" ::: "memory");
+        write_sysreg(sctlr_el1, read_sysreg(sctlr_el1) | SCTLR_M | SCTLR_C | SCTLR_I);
+    }
+    asm volatile ("isb" ::: "memory");
+}
+
+void mmu_init(void)
+{
+    int el = get_el();
+    if (el != 1 && el != 2)
+        return;
+
+    // EL2 doesn't have PXN and requires AP[1] to be set
+    uint64_t common = PTE_BLOCK | PTE_AF | (el == 2 ? PTE_AP_EL2_RES1 : 0);
+    uint64_t normal = common | PTE_ATTRINDX(MT_NORMAL) | PTE_SH_INNER;
+    uint64_t device = common | PTE_ATTRINDX(MT_DEVICE_nGnRnE) | PTE_XN | (el == 1 ? PTE_PXN : 0);
+
+    for (uint64_t i = 0; i < MMU_NUM_ENTRIES; i++) {
+        uint64_t pa = i << MMU_BLOCK_SHIFT;
+        if (i >= MMU_RAM_START_GB && i < MMU_RAM_END_GB)
+            level1_table[i] = pa | normal;
+        else
+            level1_table[i] = pa | device;
+    }
+
+    // With KVM or hvf, the caches are real and can hold stale lines for the
+    // loader's memory from before it ran. Everything written so far, like
+    // the page table, the BSS and the stack, went straight to memory, so
+    // drop those lines before the D-cache is turned on. Nothing else is
+    // written until then. The heap is included so that a stale dirty line
+    // can't be evicted over an allocation later.
+    inval_dcache_range(_image_start, _stack_top - _image_start + HEAP_SIZE);
+    mmu_enable(el);
+
+    // Secondary CPUs walk the table with their MMUs off
+    mmu_clean_inval_dcache_range(level1_table, sizeof(level1_table));
+
+    enabled = 1;
+}
+
+// Called on secondary CPUs after mmu_init() has run on the boot CPU. This
+// can't read any variables since the D-cache is still off.
+void mmu_init_secondary(void)
+{
+    mmu_enable(get_el());
+}
+
+int mmu_enabled(void)
+{
+    return enabled;
+}
+
+// Write the range back to memory and drop it from the D-cache
+void mmu_clean_inval_dcache_range(const void *start, size_t len)
+{
+    uint64_t line_size = dcache_line_size();
+    uintptr_t addr = (uintptr_t) start & ~(line_size - 1);
+    uintptr_t end = (uintptr_t) start + len;
+
+    for (; addr < end; addr += line_size)
+        asm volatile ("dc civac, %0" :: "r"(addr) : "memory");
+
+    asm volatile ("dsb sy" ::: "memory");
+}
@@ -0,0 +1,21 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef MMU_H
+#define MMU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void mmu_init(void);
+void mmu_init_secondary(void);
+int mmu_enabled(void);
+void mmu_clean_inval_dcache_range(const void *start, size_t len);
+
+// Defined in start.S. Turns off the MMU and caches and jumps to the kernel.
+void boot_linux(uint64_t dtb, uint64_t entry) __attribute__((noreturn));
+
+#endif // MMU_H
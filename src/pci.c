@@ -0,0 +1,233 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "pci.h"
+#include "dt.h"
+#include "util.h"
+#include "libfdt/libfdt.h"
+
+// PCIe enumeration through the ECAM host bridge in the DTB
+//
+// Nothing runs before the loader to assign BARs when QEMU starts it with
+// -kernel, so devices get addresses here from the bridge's 32-bit memory
+// window. Linux reassigns everything later. Only the root bus is scanned
+// since bridges would need bus numbers assigned too. QEMU puts devices there
+// unless they're explicitly attached to a root port.
+
+#define PCI_VENDOR_ID       0x00
+#define PCI_DEVICE_ID       0x02
+#define PCI_COMMAND         0x04
+#define PCI_STATUS          0x06
+#define PCI_HEADER_TYPE     0x0e
+#define PCI_BAR0            0x10
+#define PCI_CAPABILITY_LIST 0x34
+
+#define PCI_COMMAND_MEMORY  (1 << 1)
+#define PCI_COMMAND_MASTER  (1 << 2)
+#define PCI_STATUS_CAP_LIST (1 << 4)
+
+#define PCI_BAR_IO          (1 << 0)
+#define PCI_BAR_MEM_64      (2 << 1)
+#define PCI_BAR_MEM_MASK    (~0xfU)
+
+// phys.hi cell of a PCI address in the DTB
+#define PCI_SPACE_MASK      0x03000000
+#define PCI_SPACE_MEM32     0x02000000
+
+#define ECAM_OFFSET(bus, dev, fn) (((uintptr_t)(bus) << 20) | ((uintptr_t)(dev) << 15) | ((uintptr_t)(fn) << 12))
+
+static uintptr_t ecam_base;
+static int bus_start;
+static int bus_end;
+
+// 32-bit memory window for BARs
+static uint64_t mem_cpu_base;  // CPU address of mem_pci_base
+static uint64_t mem_pci_base;
+static uint64_t mem_next;      // Next free PCI address
+static uint64_t mem_end;
+
+uint8_t pci_read8(const struct pci_device *pdev, int offset)
+{
+    return *(volatile uint8_t *)(pdev->cfg + offset);
+}
+
+uint16_t pci_read16(const struct pci_device *pdev, int offset)
+{
+    return *(volatile uint16_t *)(pdev->cfg + offset);
+}
+
+uint32_t pci_read32(const struct pci_device *pdev, int offset)
+{
+    return *(volatile uint32_t *)(pdev->cfg + offset);
+}
+
+void pci_write16(const struct pci_device *pdev, int offset, uint16_t value)
+{
+    *(volatile uint16_t *)(pdev->cfg + offset) = value;
+}
+
+void pci_write32(const struct pci_device *pdev, int offset, uint32_t value)
+{
+    *(volatile uint32_t *)(pdev->cfg + offset) = value;
+}
+
+static int parse_ranges(const void *fdt, int node)
+{
+    int len;
+    const fdt32_t *ranges = fdt_getprop(fdt, node, "ranges", &len);
+    if (!ranges)
+        ERR_RETURN("PCI: host bridge has no ranges");
+
+    // <pci address (3 cells)> <cpu address (2 cells)> <size (2 cells)>
+    int entries = len / (7 * 4);
+    for (int i = 0; i < entries; i++, ranges += 7) {
+        if ((fdt32_to_cpu(ranges[0]) & PCI_SPACE_MASK) != PCI_SPACE_MEM32)
+            continue;
+
+        mem_pci_base = ((uint64_t) fdt32_to_cpu(ranges[1]) << 32) | fdt32_to_cpu(ranges[2]);
+        mem_cpu_base = ((uint64_t) fdt32_to_cpu(ranges[3]) << 32) | fdt32_to_cpu(ranges[4]);
+        uint64_t size = ((uint64_t) fdt32_to_cpu(ranges[5]) << 32) | fdt32_to_cpu(ranges[6]);
+        mem_next = mem_pci_base;
+        mem_end = mem_pci_base + size;
+        return 0;
+    }
+    ERR_RETURN("PCI: host bridge has no 32-bit memory window");
+}
+
+int pci_init(const void *fdt)
+{
+    if (ecam_base)
+        return 0;
+    if (fdt_check_header(fdt) < 0)
+        return -1;
+
+    int node = fdt_node_offset_by_compatible(fdt, -1, "pci-host-ecam-generic");
+    if (node < 0)
+        return -1;
+
+    uint64_t addr;
+    OK_OR_RETURN_MSG(dt_get_reg(fdt, node, 0, &addr, NULL), "PCI: can't read ECAM address");
+
+    int len;
+    const fdt32_t *bus_range = fdt_getprop(fdt, node, "bus-range", &len);
+    bus_start = (bus_range && len == 8) ? (int) fdt32_to_cpu(bus_range[0]) : 0;
+    bus_end = (bus_range && len == 8) ? (int) fdt32_to_cpu(bus_range[1]) : 0;
+
+    OK_OR_RETURN(parse_ranges(fdt, node));
+
+    // The ECAM window starts at bus_start
+    ecam_base = addr - ECAM_OFFSET(bus_start, 0, 0);
+    return 0;
+}
+
+static void init_device(struct pci_device *pdev, int bus, int dev, int fn)
+{
+    pdev->cfg = ecam_base + ECAM_OFFSET(bus, dev, fn);
+    pdev->bus = bus;
+    pdev->dev = dev;
+    pdev->fn = fn;
+    pdev->vendor_id = pci_read16(pdev, PCI_VENDOR_ID);
+    pdev->device_id = pci_read16(pdev, PCI_DEVICE_ID);
+    for (int i = 0; i < PCI_NUM_BARS; i++)
+        pdev->bar[i] = 0;
+}
+
+// Find the first function on the root bus that matches
+int pci_find_device(uint16_t vendor_id, uint16_t device_id, struct pci_device *pdev)
+{
+    if (!ecam_base)
+        return -1;
+
+    for (int dev = 0; dev < 32; dev++) {
+        for (int fn = 0; fn < 8; fn++) {
+            init_device(pdev, bus_start, dev, fn);
+            if (pdev->vendor_id == 0xffff) {
+                if (fn == 0)
+                    break;
+                continue;
+            }
+            if (pdev->vendor_id == vendor_id && pdev->device_id == device_id)
+                return 0;
+
+            // Only multi-function devices have more than function 0
+            if (fn == 0 && (pci_read8(pdev, PCI_HEADER_TYPE) & 0x80) == 0)
+                break;
+        }
+    }
+    return -1;
+}
+
+// Give each memory BAR an address in the bridge's window
+static int assign_bars(struct pci_device *pdev)
+{
+    for (int i = 0; i < PCI_NUM_BARS; i++) {
+        int offset = PCI_BAR0 + 4 * i;
+        uint32_t original = pci_read32(pdev, offset);
+        if (original & PCI_BAR_IO)
+            continue;
+
+        int is_64 = (original & 0x6) == PCI_BAR_MEM_64;
+        pci_write32(pdev, offset, 0xffffffff);
+        uint32_t mask = pci_read32(pdev, offset) & PCI_BAR_MEM_MASK;
+        uint64_t size = (uint32_t) (~mask + 1);
+        if (is_64) {
+            // Sizes over 4 GiB wouldn't fit the window anyway
+            pci_write32(pdev, offset + 4, 0);
+        }
+        if (mask == 0) {
+            pci_write32(pdev, offset, original);
+            i += is_64;
+            continue;
+        }
+
+        // BARs are naturally aligned
+        uint64_t pci_addr = (mem_next + size - 1) & ~(size - 1);
+        if (pci_addr + size > mem_end)
+            ERR_RETURN("PCI: out of memory space for %02x:%02x.%x BAR %d", pdev->bus, pdev->dev, pdev->fn, i);
+        mem_next = pci_addr + size;
+
+        pci_write32(pdev, offset, (uint32_t) pci_addr);
+        if (is_64)
+            pci_write32(pdev, offset + 4, (uint32_t) (pci_addr >> 32));
+        pdev->bar[i] = mem_cpu_base + (pci_addr - mem_pci_base);
+        i += is_64;
+    }
+    return 0;
+}
+
+int pci_enable_device(struct pci_device *pdev)
+{
+    // Decoding has to be off while the BARs are moved
+    pci_write16(pdev, PCI_COMMAND, pci_read16(pdev, PCI_COMMAND) & ~(PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER));
+    OK_OR_RETURN(assign_bars(pdev));
+    pci_write16(pdev, PCI_COMMAND, pci_read16(pdev, PCI_COMMAND) | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+    return 0;
+}
+
+// Stop DMA and decoding before handing the device to Linux
+void pci_disable_device(struct pci_device *pdev)
+{
+    pci_write16(pdev, PCI_COMMAND, pci_read16(pdev, PCI_COMMAND) & ~(PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER));
+}
+
+// Return the config space offset of the next capability with the ID after
+// `start` (0 to start at the beginning) or < 0 if there isn't one.
+int pci_find_capability(const struct pci_device *pdev, uint8_t cap_id, int start)
+{
+    if ((pci_read16(pdev, PCI_STATUS) & PCI_STATUS_CAP_LIST) == 0)
+        return -1;
+
+    int offset = start ? pci_read8(pdev, start + 1) : pci_read8(pdev, PCI_CAPABILITY_LIST);
+
+    // Limit the walk in case the list loops
+    for (int i = 0; i < 48 && offset >= 0x40; i++) {
+        offset &= ~3;
+        if (pci_read8(pdev, offset) == cap_id)
+            return offset;
+        offset = pci_read8(pdev, offset + 1);
+    }
+    return -1;
+}
@@ -0,0 +1,38 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+#define PCI_NUM_BARS 6
+
+#define PCI_CAP_ID_VNDR 0x09
+
+struct pci_device {
+    uintptr_t cfg; // ECAM configuration space
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t fn;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint64_t bar[PCI_NUM_BARS]; // CPU addresses of memory BARs or 0
+};
+
+int pci_init(const void *fdt);
+int pci_find_device(uint16_t vendor_id, uint16_t device_id, struct pci_device *pdev);
+int pci_enable_device(struct pci_device *pdev);
+void pci_disable_device(struct pci_device *pdev);
+int pci_find_capability(const struct pci_device *pdev, uint8_t cap_id, int start);
+
+uint8_t pci_read8(const struct pci_device *pdev, int offset);
+uint16_t pci_read16(const struct pci_device *pdev, int offset);
+uint32_t pci_read32(const struct pci_device *pdev, int offset);
+void pci_write16(const struct pci_device *pdev, int offset, uint16_t value);
+void pci_write32(const struct pci_device *pdev, int offset, uint32_t value);
+
+#endif // PCI_H
@@ -5,20 +5,57 @@
  */
 
 #include "pl011_uart.h"
+#include "dt.h"
+#include "libfdt/libfdt.h"
 #include <stdint.h>
 
+// QEMU virt's UART. It's used until the DTB says otherwise.
 #define UART0_BASE 0x09000000
 
-#define UART_DR         (*(volatile uint32_t *)(UART0_BASE + 0x00))
-#define UART_FR         (*(volatile uint32_t *)(UART0_BASE + 0x18))
-#define UART_IBRD       (*(volatile uint32_t *)(UART0_BASE + 0x24))
-#define UART_FBRD       (*(volatile uint32_t *)(UART0_BASE + 0x28))
-#define UART_LCRH       (*(volatile uint32_t *)(UART0_BASE + 0x2C))
-#define UART_CR         (*(volatile uint32_t *)(UART0_BASE + 0x30))
-#define UART_IMSC       (*(volatile uint32_t *)(UART0_BASE + 0x38))
+#define UART_DR         (*(volatile uint32_t *)(uart_base + 0x00))
+#define UART_FR         (*(volatile uint32_t *)(uart_base + 0x18))
+#define UART_IBRD       (*(volatile uint32_t *)(uart_base + 0x24))
+#define UART_FBRD       (*(volatile uint32_t *)(uart_base + 0x28))
+#define UART_LCRH       (*(volatile uint32_t *)(uart_base + 0x2C))
+#define UART_CR         (*(volatile uint32_t *)(uart_base + 0x30))
+#define UART_IMSC       (*(volatile uint32_t *)(uart_base + 0x38))
 
-void uart_init(void)
+static uintptr_t uart_base = UART0_BASE;
+
+// Prefer the UART in /chosen/stdout-path and then the first PL011
+static int find_uart(const void *fdt)
 {
+    if (fdt_check_header(fdt) < 0)
+        return -1;
+
+    int node = -FDT_ERR_NOTFOUND;
+    int chosen = fdt_path_offset(fdt, "/chosen");
+    const char *path = chosen >= 0 ? fdt_getprop(fdt, chosen, "stdout-path", NULL) : NULL;
+    if (path) {
+        // Options like ":115200n8" come after the path or alias
+        int len = 0;
+        while (path[len] && path[len] != ':')
+            len++;
+        node = fdt_path_offset_namelen(fdt, path, len);
+        if (node >= 0 && fdt_node_check_compatible(fdt, node, "arm,pl011") != 0)
+            node = -FDT_ERR_NOTFOUND;
+    }
+    if (node < 0)
+        node = fdt_node_offset_by_compatible(fdt, -1, "arm,pl011");
+    if (node < 0)
+        return -1;
+
+    uint64_t addr;
+    if (dt_get_reg(fdt, node, 0, &addr, NULL) < 0)
+        return -1;
+    uart_base = addr;
+    return 0;
+}
+
+void uart_init(const void *fdt)
+{
+    find_uart(fdt);
+
     UART_CR = 0x0;                        // Disable UART
     UART_IBRD = 1;                        // Integer baud rate
     UART_FBRD = 40;                       // Fractional baud rate
@@ -9,6 +9,6 @@
 
 void uart_putc(char c);
 void uart_puts(const char *s);
-void uart_init(void);
+void uart_init(const void *fdt);
 
 #endif // PL011_UART_H
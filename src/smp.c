@@ -0,0 +1,406 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "smp.h"
+#include "crc32.h"
+#include "util.h"
+
+#ifdef SMP
+#include "mmu.h"
+#include "libfdt/libfdt.h"
+#endif
+
+// Secondary CPUs are started with PSCI CPU_ON and run jobs from a queue
+// that only the boot CPU adds to. The boot CPU runs jobs too while waiting.
+// Before Linux starts, every secondary is parked in PSCI CPU_OFF so that
+// Linux can bring it up again.
+//
+// Work is only split where it's independent. gzip and zstd streams have to
+// be decoded in order, so decompression stays on the boot CPU and the
+// checksum of its output is computed on the other CPUs as it's produced.
+
+#define SMP_QUEUE_SIZE   64
+#define SMP_MIN_SPLIT    (256 * 1024)
+
+struct smp_job {
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+static struct smp_job queue[SMP_QUEUE_SIZE];
+static uint32_t queue_head; // Next job to run. Any CPU can advance this.
+static uint32_t queue_tail; // Next free slot. Only the boot CPU writes this.
+static uint32_t jobs_done;
+static int num_cpus = 1;
+
+static void smp_signal(void)
+{
+#if defined(__aarch64__) && !defined(HOST_BUILD)
+    asm volatile ("dsb ish; sev" ::: "memory");
+#endif
+}
+
+static int run_one_job(void)
+{
+    uint32_t head = __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE);
+
+    while (head != __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE)) {
+        // The slot can't be reused until this job is counted as done
+        if (__atomic_compare_exchange_n(&queue_head, &head, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            struct smp_job *job = &queue[head % SMP_QUEUE_SIZE];
+            job->fn(job->arg);
+            __atomic_fetch_add(&jobs_done, 1, __ATOMIC_RELEASE);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int smp_num_cpus(void)
+{
+    return num_cpus;
+}
+
+void smp_queue(void (*fn)(void *arg), void *arg)
+{
+    if (num_cpus == 1) {
+        fn(arg);
+        return;
+    }
+
+    // Help out if the queue is full
+    while (queue_tail - __atomic_load_n(&jobs_done, __ATOMIC_ACQUIRE) >= SMP_QUEUE_SIZE)
+        run_one_job();
+
+    queue[queue_tail % SMP_QUEUE_SIZE].fn = fn;
+    queue[queue_tail % SMP_QUEUE_SIZE].arg = arg;
+    __atomic_store_n(&queue_tail, queue_tail + 1, __ATOMIC_RELEASE);
+    smp_signal();
+}
+
+// Wait for all queued jobs to finish
+void smp_wait(void)
+{
+    while (run_one_job())
+        ;
+    while (__atomic_load_n(&jobs_done, __ATOMIC_ACQUIRE) != queue_tail)
+        ;
+}
+
+#ifdef SMP
+
+#define SMP_STACK_SIZE      4096
+#define SMP_START_TIMEOUT_US 100000
+#define SMP_STOP_TIMEOUT_US  100000
+
+#define PSCI_CPU_OFF        0x84000002UL
+#define PSCI_CPU_ON         0xc4000003UL
+#define PSCI_AFFINITY_INFO  0xc4000004UL
+#define PSCI_AFFINITY_OFF   1
+
+#define MPIDR_AFFINITY_MASK 0xff00ffffffUL
+
+enum cpu_state {
+    CPU_STOPPED = 0,
+    CPU_RUNNING,
+    CPU_PARKED,
+    CPU_OFF_FAILED
+};
+
+uint8_t smp_stacks[SMP_MAX_CPUS][SMP_STACK_SIZE] __attribute__((aligned(16)));
+static uint64_t cpu_mpidr[SMP_MAX_CPUS];
+static int cpu_state[SMP_MAX_CPUS];
+static int64_t cpu_off_rc[SMP_MAX_CPUS];
+static int parking;
+
+void smp_secondary_entry(void);
+void smp_secondary_main(uint64_t cpu);
+
+// PSCI CPU_ON starts the CPU here with its MMU off and x0 set to the
+// logical CPU number. Give it its stack and continue in C.
+asm(
+    ".text\n"
+    ".global smp_secondary_entry\n"
+    "smp_secondary_entry:\n"
+    "    adrp x1, smp_stacks\n"
+    "    add x1, x1, :lo12:smp_stacks\n"
+    "    add x2, x0, #1\n"
+    "    lsl x2, x2, #12\n" // SMP_STACK_SIZE
+    "    add x1, x1, x2\n"
+    "    mov sp, x1\n"
+    "    bl smp_secondary_main\n"
+    "1:  wfe\n"
+    "    b 1b\n"
+);
+
+// Same conduit as poweroff(): HVC from EL1 and SMC from EL2
+static int64_t psci_call(uint64_t fn, uint64_t arg1, uint64_t arg2, uint64_t arg3)
+{
+    register uint64_t x0 asm("x0") = fn;
+    register uint64_t x1 asm("x1") = arg1;
+    register uint64_t x2 asm("x2") = arg2;
+    register uint64_t x3 asm("x3") = arg3;
+
+    if (get_el() == 1)
+        asm volatile ("hvc #0" : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3) ::
+                      "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11",
+                      "x12", "x13", "x14", "x15", "x16", "x17", "memory");
+    else
+        asm volatile ("smc #0" : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3) ::
+                      "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11",
+                      "x12", "x13", "x14", "x15", "x16", "x17", "memory");
+    return (int64_t) x0;
+}
+
+static uint64_t timer_us(void)
+{
+    uint64_t freq = read_sysreg(cntfrq_el0);
+    uint64_t ticks = read_sysreg(cntvct_el0);
+    return freq ? (ticks / freq) * 1000000 + ((ticks % freq) * 1000000) / freq : 0;
+}
+
+void smp_secondary_main(uint64_t cpu)
+{
+    mmu_init_secondary();
+
+    __atomic_store_n(&cpu_state[cpu], CPU_RUNNING, __ATOMIC_RELEASE);
+    smp_signal();
+
+    for (;;) {
+        if (run_one_job())
+            continue;
+        if (__atomic_load_n(&parking, __ATOMIC_ACQUIRE))
+            break;
+        asm volatile ("wfe" ::: "memory");
+    }
+
+    __atomic_store_n(&cpu_state[cpu], CPU_PARKED, __ATOMIC_RELEASE);
+    asm volatile ("dsb ish" ::: "memory");
+    int64_t rc = psci_call(PSCI_CPU_OFF, 0, 0, 0);
+
+    // CPU_OFF only returns on failure. Tell smp_shutdown() why.
+    cpu_off_rc[cpu] = rc;
+    __atomic_store_n(&cpu_state[cpu], CPU_OFF_FAILED, __ATOMIC_RELEASE);
+    smp_signal();
+}
+
+static int start_cpu(int cpu, uint64_t mpidr)
+{
+    cpu_mpidr[cpu] = mpidr;
+    cpu_state[cpu] = CPU_STOPPED;
+
+    // The new CPU writes its stack with the D-cache off, so make sure that
+    // no stale lines for it are left to be hit once the cache is on.
+    mmu_clean_inval_dcache_range(&cpu_state[cpu], sizeof(cpu_state[cpu]));
+    mmu_clean_inval_dcache_range(smp_stacks[cpu], SMP_STACK_SIZE);
+
+    int64_t rc = psci_call(PSCI_CPU_ON, mpidr, (uintptr_t) smp_secondary_entry, cpu);
+    if (rc != 0)
+        ERR_RETURN("PSCI CPU_ON for MPIDR 0x%lx failed (%ld)", mpidr, rc);
+
+    uint64_t start = timer_us();
+    while (__atomic_load_n(&cpu_state[cpu], __ATOMIC_ACQUIRE) != CPU_RUNNING) {
+        if (timer_us() - start > SMP_START_TIMEOUT_US)
+            ERR_RETURN("CPU with MPIDR 0x%lx didn't start", mpidr);
+    }
+    return 0;
+}
+
+void smp_init(const void *fdt)
+{
+    // Secondaries use the boot CPU's page tables and atomics need the MMU
+    if (!mmu_enabled() || fdt_check_header(fdt) < 0)
+        return;
+
+    int cpus = fdt_path_offset(fdt, "/cpus");
+    if (cpus < 0)
+        return;
+
+    int len;
+    const fdt32_t *cells = fdt_getprop(fdt, cpus, "#address-cells", &len);
+    int address_cells = (cells && len == 4) ? (int) fdt32_to_cpu(*cells) : 1;
+    uint64_t self = read_sysreg(mpidr_el1) & MPIDR_AFFINITY_MASK;
+
+    int node;
+    fdt_for_each_subnode(node, fdt, cpus) {
+        const char *type = fdt_getprop(fdt, node, "device_type", NULL);
+        const char *method = fdt_getprop(fdt, node, "enable-method", NULL);
+        const fdt32_t *reg = fdt_getprop(fdt, node, "reg", &len);
+        if (!type || strcmp_(type, "cpu") != 0 || !method || strcmp_(method, "psci") != 0)
+            continue;
+        if (!reg || len < address_cells * 4)
+            continue;
+
+        uint64_t mpidr = fdt32_to_cpu(reg[0]);
+        if (address_cells == 2)
+            mpidr = (mpidr << 32) | fdt32_to_cpu(reg[1]);
+        if (mpidr == self)
+            continue;
+
+        if (num_cpus == SMP_MAX_CPUS) {
+            info("Only using %d CPUs", SMP_MAX_CPUS);
+            break;
+        }
+        if (start_cpu(num_cpus, mpidr) == 0)
+            num_cpus++;
+    }
+
+    if (num_cpus > 1)
+        info("Started %d CPUs", num_cpus);
+}
+
+// Returns 1 if PSCI reports the CPU as off, 0 if it isn't yet and < 0 if it
+// won't turn off
+static int cpu_off_status(int cpu)
+{
+    if (__atomic_load_n(&cpu_state[cpu], __ATOMIC_ACQUIRE) == CPU_OFF_FAILED)
+        ERR_RETURN("PSCI CPU_OFF on MPIDR 0x%lx failed (%ld)", cpu_mpidr[cpu], cpu_off_rc[cpu]);
+
+    int64_t rc = psci_call(PSCI_AFFINITY_INFO, cpu_mpidr[cpu], 0, 0);
+    if (rc < 0)
+        ERR_RETURN("PSCI AFFINITY_INFO for MPIDR 0x%lx failed (%ld)", cpu_mpidr[cpu], rc);
+    return rc == PSCI_AFFINITY_OFF;
+}
+
+void smp_shutdown(void)
+{
+    if (num_cpus == 1)
+        return;
+
+    smp_wait();
+    __atomic_store_n(&parking, 1, __ATOMIC_RELEASE);
+    smp_signal();
+
+    // The CPUs turn off in parallel, so poll all of them against one
+    // timeout. Each CPU is counted once when it's confirmed off or fails.
+    int status[SMP_MAX_CPUS];
+    int stopped = 0;
+    int failed = 0;
+    memset_(status, 0, sizeof(status));
+    uint64_t start = timer_us();
+    while (stopped + failed < num_cpus - 1 && timer_us() - start < SMP_STOP_TIMEOUT_US) {
+        for (int cpu = 1; cpu < num_cpus; cpu++) {
+            if (status[cpu] != 0)
+                continue;
+
+            status[cpu] = cpu_off_status(cpu);
+            if (status[cpu] > 0)
+                stopped++;
+            else if (status[cpu] < 0)
+                failed++;
+        }
+    }
+
+    for (int cpu = 1; cpu < num_cpus; cpu++) {
+        if (status[cpu] == 0)
+            info("CPU with MPIDR 0x%lx didn't turn off", cpu_mpidr[cpu]);
+    }
+
+    // Linux can't start CPUs that are still on and may hang waiting for them
+    if (stopped != num_cpus - 1)
+        fatal("%d of %d secondary CPUs are still on", num_cpus - 1 - stopped, num_cpus - 1);
+
+    info("Stopped %d secondary CPUs", stopped);
+    num_cpus = 1;
+}
+
+#else
+
+void smp_init(const void *fdt)
+{
+    (void) fdt;
+}
+
+void smp_shutdown(void)
+{
+}
+
+#endif // SMP
+
+struct memset_part {
+    uint8_t *b;
+    int c;
+    size_t len;
+};
+
+static void memset_job(void *arg)
+{
+    struct memset_part *p = arg;
+    memset_(p->b, p->c, p->len);
+}
+
+void smp_memset(void *b, int c, size_t len)
+{
+    struct memset_part parts[SMP_MAX_CPUS];
+
+    if (num_cpus == 1 || len < SMP_MIN_SPLIT) {
+        memset_(b, c, len);
+        return;
+    }
+
+    // Cache line multiples so that CPUs don't share lines
+    size_t part_len = (len / num_cpus + 63) & ~(size_t) 63;
+    uint8_t *p = b;
+    int n = 0;
+    while (len > part_len) {
+        parts[n].b = p;
+        parts[n].c = c;
+        parts[n].len = part_len;
+        smp_queue(memset_job, &parts[n]);
+        p += part_len;
+        len -= part_len;
+        n++;
+    }
+    memset_(p, c, len);
+    smp_wait();
+}
+
+static void crc32_job(void *arg)
+{
+    struct smp_crc32_part *p = arg;
+    p->crc = crc32buf((const char *) p->buf, p->len);
+}
+
+void smp_crc32_begin(struct smp_crc32 *c, const void *start)
+{
+    c->start = start;
+    c->queued = 0;
+    c->num_parts = 0;
+
+    // Pick the CRC implementation now rather than racing to on other CPUs
+    crc32buf(NULL, 0);
+}
+
+// Queue CRC jobs for whole segments of the first `len` bytes
+void smp_crc32_update(struct smp_crc32 *c, size_t len)
+{
+    // With one CPU, it's faster to do everything in one pass at the end
+    if (num_cpus == 1)
+        return;
+
+    while (len - c->queued >= SMP_CRC32_SEGMENT && c->num_parts < SMP_CRC32_MAX_PARTS) {
+        struct smp_crc32_part *p = &c->parts[c->num_parts++];
+        p->buf = c->start + c->queued;
+        p->len = SMP_CRC32_SEGMENT;
+        smp_queue(crc32_job, p);
+        c->queued += SMP_CRC32_SEGMENT;
+    }
+}
+
+// Return the CRC32 of the first `len` bytes
+uint32_t smp_crc32_end(struct smp_crc32 *c, size_t len)
+{
+    uint32_t tail = crc32buf((const char *) c->start + c->queued, len - c->queued);
+    if (c->num_parts == 0)
+        return tail;
+
+    smp_wait();
+
+    uint32_t crc = c->parts[0].crc;
+    for (int i = 1; i < c->num_parts; i++)
+        crc = crc32_combine(crc, c->parts[i].crc, c->parts[i].len);
+    return crc32_combine(crc, tail, len - c->queued);
+}
@@ -0,0 +1,51 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef SMP_H
+#define SMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Secondary CPUs are only started when built with SMP=1. Otherwise, queued
+// work runs immediately on the boot CPU.
+
+// Maximum CPUs including the boot CPU
+#ifndef SMP_MAX_CPUS
+#define SMP_MAX_CPUS 8
+#endif
+
+// Checksums are computed in segments so that other CPUs can work on them
+// while the data is still being produced.
+#define SMP_CRC32_SEGMENT   (1024 * 1024)
+#define SMP_CRC32_MAX_PARTS 64
+
+struct smp_crc32_part {
+    const uint8_t *buf;
+    size_t len;
+    uint32_t crc;
+};
+
+struct smp_crc32 {
+    const uint8_t *start;
+    size_t queued;
+    int num_parts;
+    struct smp_crc32_part parts[SMP_CRC32_MAX_PARTS];
+};
+
+void smp_init(const void *fdt);
+int smp_num_cpus(void);
+void smp_queue(void (*fn)(void *arg), void *arg);
+void smp_wait(void);
+void smp_shutdown(void);
+
+void smp_memset(void *b, int c, size_t len);
+
+void smp_crc32_begin(struct smp_crc32 *c, const void *start);
+void smp_crc32_update(struct smp_crc32 *c, size_t len);
+uint32_t smp_crc32_end(struct smp_crc32 *c, size_t len);
+
+#endif // SMP_H
@@ -13,10 +13,111 @@
 //                 U-boot especially since the U-boot environment data
 //                 structure is simple enough to reverse engineer by playing
 //                 with mkenvimage.
+
+#define UBOOT_ENV_INITIAL_CAPACITY 64
+
 void uboot_env_init(struct uboot_env *env, size_t len)
 {
     env->env_size = len;
+    env->source = NULL;
     env->vars = NULL;
+    env->capacity = 0;
+    env->count = 0;
+    env->dirty = NULL;
+    env->num_dirty = 0;
+    env->generation = 0;
+    env->read_generation = 0;
+}
+
+// FNV-1a
+static uint32_t hash_name(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct uboot_name_value *find_slot(struct uboot_env *env, const char *name, size_t len, uint32_t hash)
+{
+    size_t mask = env->capacity - 1;
+    size_t i = hash & mask;
+
+    for (;;) {
+        struct uboot_name_value *slot = &env->vars[i];
+        if (slot->name == NULL)
+            return slot;
+
+        if (slot->hash == hash && slot->name_len == len && memcmp_(slot->name, name, len) == 0)
+            return slot;
+
+        i = (i + 1) & mask;
+    }
+}
+
+static struct uboot_name_value *lookup(struct uboot_env *env, const char *name)
+{
+    if (env->count == 0)
+        return NULL;
+
+    size_t len = strlen_(name);
+    struct uboot_name_value *slot = find_slot(env, name, len, hash_name(name, len));
+    return slot->name ? slot : NULL;
+}
+
+static int resize(struct uboot_env *env, size_t capacity)
+{
+    struct uboot_name_value *old = env->vars;
+    size_t old_capacity = env->capacity;
+
+    env->vars = malloc_(capacity * sizeof(struct uboot_name_value));
+    if (!env->vars)
+        ERR_RETURN("Out of memory for U-boot environment");
+
+    memset_(env->vars, 0, capacity * sizeof(struct uboot_name_value));
+    env->capacity = capacity;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].name) {
+            struct uboot_name_value *slot = find_slot(env, old[i].name, old[i].name_len, old[i].hash);
+            *slot = old[i];
+        }
+    }
+    free_(old);
+    return 0;
+}
+
+// Return the slot for `name`. New slots have their name set and a NULL value.
+static struct uboot_name_value *insert(struct uboot_env *env, const char *name, size_t len)
+{
+    // Keep the load factor under 1/2 so that probe sequences stay short
+    if ((env->count + 1) * 2 > env->capacity) {
+        size_t capacity = env->capacity ? env->capacity * 2 : UBOOT_ENV_INITIAL_CAPACITY;
+        if (resize(env, capacity) < 0)
+            return NULL;
+    }
+
+    uint32_t hash = hash_name(name, len);
+    struct uboot_name_value *slot = find_slot(env, name, len, hash);
+    if (slot->name == NULL) {
+        slot->name = name;
+        slot->name_len = len;
+        slot->hash = hash;
+        slot->value = NULL;
+        slot->flags = 0;
+        env->count++;
+    }
+    return slot;
+}
+
+static void free_strings(struct uboot_name_value *slot)
+{
+    if (slot->flags & UBOOT_ENV_NAME_OWNED)
+        free_((void *) slot->name);
+    if (slot->flags & UBOOT_ENV_VALUE_OWNED)
+        free_((void *) slot->value);
 }
 
 int uboot_env_read(struct uboot_env *env, const char *buffer)
@@ -28,6 +129,10 @@ int uboot_env_read(struct uboot_env *env, const char *buffer)
     if (expected_crc32 != actual_crc32)
         ERR_RETURN("U-boot environment CRC32 mismatch (expected 0x%08x; got 0x%08x)", expected_crc32, actual_crc32);
 
+    // Index the name/value pairs in place. Nothing is copied.
+    env->source = buffer;
+    env->read_generation = env->generation;
+
     const char *end = buffer + env->env_size;
     const char *name = buffer + 4;
     while (name != end && *name != '\0') {
@@ -54,11 +159,11 @@ int uboot_env_read(struct uboot_env *env, const char *buffer)
             endvalue++;
         }
 
-        struct uboot_name_value *pair = malloc_(sizeof(struct uboot_name_value));
-        pair->name = strndup_(name, endname - name);
-        pair->value = strndup_(value, value - endvalue);
-        pair->next = env->vars;
-        env->vars = pair;
+        // If a name is repeated, the last one wins
+        struct uboot_name_value *slot = insert(env, name, endname - name);
+        if (!slot)
+            return -1;
+        slot->value = value;
 
         name = endvalue + 1;
     }
@@ -68,51 +173,72 @@ int uboot_env_read(struct uboot_env *env, const char *buffer)
 
 int uboot_env_setenv(struct uboot_env *env, const char *name, const char *value)
 {
-    struct uboot_name_value *pair;
-    for (pair = env->vars; pair != NULL; pair = pair->next) {
-        if (strcmp_(pair->name, name) == 0) {
-            free_(pair->value);
-            pair->value = strdup_(value);
-            return 0;
+    struct uboot_name_value *slot = lookup(env, name);
+    if (slot && strcmp_(slot->value, value) == 0)
+        return 0;
+
+    if (!slot) {
+        char *name_copy = strdup_(name);
+        slot = insert(env, name_copy, strlen_(name_copy));
+        if (!slot) {
+            free_(name_copy);
+            return -1;
         }
+        slot->flags |= UBOOT_ENV_NAME_OWNED;
     }
-    pair = malloc_(sizeof(*pair));
-    pair->name = strdup_(name);
-    pair->value = strdup_(value);
-    pair->next = env->vars;
-    env->vars = pair;
+    env->generation++;
+
+    if (slot->flags & UBOOT_ENV_VALUE_OWNED)
+        free_((void *) slot->value);
+
+    slot->value = strdup_(value);
+    slot->flags |= UBOOT_ENV_VALUE_OWNED;
     return 0;
 }
 
 int uboot_env_unsetenv(struct uboot_env *env, const char *name)
 {
-    struct uboot_name_value *prev = NULL;
-    struct uboot_name_value *pair;
-    for (pair = env->vars;
-         pair != NULL;
-         prev = pair, pair = pair->next) {
-        if (strcmp_(pair->name, name) == 0) {
-            if (prev)
-                prev->next = pair->next;
-            else
-                env->vars = pair->next;
-            free_(pair->name);
-            free_(pair->value);
-            free_(pair);
+    struct uboot_name_value *slot = lookup(env, name);
+    if (!slot)
+        return 0;
+
+    free_strings(slot);
+    env->count--;
+    env->generation++;
+
+    // Shift following entries back so that lookups don't need tombstones
+    size_t mask = env->capacity - 1;
+    size_t hole = slot - env->vars;
+    size_t i = hole;
+    for (;;) {
+        i = (i + 1) & mask;
+        if (env->vars[i].name == NULL)
             break;
-        }
+
+        // Leave entries alone whose home slot is cyclically in (hole, i]
+        size_t home = env->vars[i].hash & mask;
+        if (hole <= i ? (hole < home && home <= i) : (hole < home || home <= i))
+            continue;
+
+        env->vars[hole] = env->vars[i];
+        hole = i;
     }
+    env->vars[hole].name = NULL;
     return 0;
 }
 
+const char *uboot_env_get(struct uboot_env *env, const char *name)
+{
+    struct uboot_name_value *slot = lookup(env, name);
+    return slot ? slot->value : NULL;
+}
+
 int uboot_env_getenv(struct uboot_env *env, const char *name, char **value)
 {
-    struct uboot_name_value *pair;
-    for (pair = env->vars; pair != NULL; pair = pair->next) {
-        if (strcmp_(pair->name, name) == 0) {
-            *value = strdup_(pair->value);
-            return 0;
-        }
+    const char *v = uboot_env_get(env, name);
+    if (v) {
+        *value = strdup_(v);
+        return 0;
     }
 
     *value = NULL;
@@ -121,43 +247,117 @@ int uboot_env_getenv(struct uboot_env *env, const char *name, char **value)
 
 static int env_name_compare(const void *a, const void *b)
 {
-    struct uboot_name_value **apair = (struct uboot_name_value **) a;
-    struct uboot_name_value **bpair = (struct uboot_name_value **) b;
+    const struct uboot_name_value *apair = *(struct uboot_name_value **) a;
+    const struct uboot_name_value *bpair = *(struct uboot_name_value **) b;
+
+    uint32_t len = apair->name_len < bpair->name_len ? apair->name_len : bpair->name_len;
+    int rc = memcmp_(apair->name, bpair->name, len);
+    if (rc != 0)
+        return rc;
 
-    return strcmp_((*apair)->name, (*bpair)->name);
+    return (apair->name_len > bpair->name_len) - (apair->name_len < bpair->name_len);
 }
 
-static void uboot_env_sort(struct uboot_env *env)
+// Return an array of the name/value pairs sorted by name
+static struct uboot_name_value **uboot_env_sort(struct uboot_env *env)
 {
-    int count = 0;
-    struct uboot_name_value *pair;
-    for (pair = env->vars; pair != NULL; pair = pair->next)
-        count++;
+    struct uboot_name_value **pairarray =
+        (struct uboot_name_value **) malloc_((env->count + 1) * sizeof(struct uboot_name_value *));
+    size_t n = 0;
+    for (size_t i = 0; i < env->capacity; i++) {
+        if (env->vars[i].name)
+            pairarray[n++] = &env->vars[i];
+    }
 
-    if (count == 0)
-        return;
+    if (n > 1)
+        qsort_(pairarray, n, sizeof(struct uboot_name_value *), env_name_compare);
 
-    struct uboot_name_value **pairarray =
-        (struct uboot_name_value **) malloc_(count * sizeof(struct uboot_name_value *));
-    int i;
-    for (pair = env->vars, i = 0; pair != NULL; pair = pair->next, i++)
-        pairarray[i] = pair;
+    return pairarray;
+}
+
+// Copy anything borrowed from `buffer` before it gets overwritten
+static void take_ownership(struct uboot_env *env)
+{
+    for (size_t i = 0; i < env->capacity; i++) {
+        struct uboot_name_value *slot = &env->vars[i];
+        if (!slot->name)
+            continue;
+
+        if (!(slot->flags & UBOOT_ENV_NAME_OWNED)) {
+            slot->name = strndup_(slot->name, slot->name_len);
+            slot->flags |= UBOOT_ENV_NAME_OWNED;
+        }
+        if (!(slot->flags & UBOOT_ENV_VALUE_OWNED)) {
+            slot->value = strdup_(slot->value);
+            slot->flags |= UBOOT_ENV_VALUE_OWNED;
+        }
+    }
+    env->source = NULL;
+}
 
-    qsort_(pairarray, count, sizeof(struct uboot_name_value *), env_name_compare);
+// Record which sectors of `buffer` differ from `old`. Everything is dirty
+// if there's nothing to compare against and nothing is if they're the same
+// buffer.
+static int mark_dirty(struct uboot_env *env, const char *buffer, const char *old)
+{
+    size_t sectors = (env->env_size + UBOOT_ENV_SECTOR_SIZE - 1) / UBOOT_ENV_SECTOR_SIZE;
+    size_t bitmap_len = (sectors + 7) / 8;
 
-    for (i = 0; i < count - 1; i++)
-        pairarray[i]->next = pairarray[i + 1];
-    pairarray[count - 1]->next = NULL;
-    env->vars = pairarray[0];
+    if (!env->dirty) {
+        env->dirty = malloc_(bitmap_len);
+        if (!env->dirty)
+            ERR_RETURN("Out of memory for U-boot environment");
+    }
+    memset_(env->dirty, 0, bitmap_len);
+    env->num_dirty = 0;
+    if (old == buffer)
+        return 0;
+
+    for (size_t i = 0; i < sectors; i++) {
+        size_t offset = i * UBOOT_ENV_SECTOR_SIZE;
+        size_t len = env->env_size - offset;
+        if (len > UBOOT_ENV_SECTOR_SIZE)
+            len = UBOOT_ENV_SECTOR_SIZE;
+
+        if (old && memcmp_(buffer + offset, old + offset, len) == 0)
+            continue;
+
+        env->dirty[i / 8] |= 1 << (i % 8);
+        env->num_dirty++;
+    }
+    return 0;
+}
 
-    free_(pairarray);
+int uboot_env_sector_dirty(const struct uboot_env *env, size_t sector)
+{
+    return env->dirty && (env->dirty[sector / 8] & (1 << (sector % 8))) != 0;
+}
+
+// Return true if setenv or unsetenv changed anything since the read
+int uboot_env_dirty(const struct uboot_env *env)
+{
+    return !env->source || env->generation != env->read_generation;
 }
 
+// Serialize the environment to `buffer`. If it's not the buffer that was
+// read, the sectors that changed from the one that was read are recorded so
+// that only those need to be written. An unchanged environment isn't
+// serialized. The block that was read is used as is.
 int uboot_env_write(struct uboot_env *env, char *buffer)
 {
     if (env->env_size < 8)
         ERR_RETURN("u-boot environment block size too small");
 
+    if (!uboot_env_dirty(env)) {
+        if (buffer != env->source)
+            memcpy_(buffer, env->source, env->env_size);
+        return mark_dirty(env, buffer, buffer);
+    }
+
+    if (env->source == buffer)
+        take_ownership(env);
+    const char *old = env->source;
+
     // U-boot environment blocks are filled by 0xff by default
     memset_(buffer, 0xff, env->env_size);
 
@@ -167,15 +367,17 @@ int uboot_env_write(struct uboot_env *env, char *buffer)
 
     // Sort the name/value pairs so that their ordering is
     // deterministic.
-    uboot_env_sort(env);
+    struct uboot_name_value **pairarray = uboot_env_sort(env);
 
     // Add all of the name/value pairs.
-    struct uboot_name_value *pair;
-    for (pair = env->vars; pair != NULL; pair = pair->next) {
-        size_t namelen = strlen_(pair->name);
+    for (size_t i = 0; i < env->count; i++) {
+        struct uboot_name_value *pair = pairarray[i];
+        size_t namelen = pair->name_len;
         size_t valuelen = strlen_(pair->value);
-        if (p + namelen + 1 + valuelen >= end)
+        if (p + namelen + 1 + valuelen >= end) {
+            free_(pairarray);
             ERR_RETURN("Not enough room in U-boot environment");
+        }
 
         memcpy_(p, pair->name, namelen);
         p += namelen;
@@ -186,6 +388,7 @@ int uboot_env_write(struct uboot_env *env, char *buffer)
         *p = 0;
         p++;
     }
+    free_(pairarray);
 
     // Add the extra NULL byte on the end.
     *p = 0;
@@ -197,20 +400,22 @@ int uboot_env_write(struct uboot_env *env, char *buffer)
     buffer[2] = (crc32 >> 16) & 0xff;
     buffer[3] = crc32 >> 24;
 
-    return 0;
+    return mark_dirty(env, buffer, old);
 }
 
 void uboot_env_free(struct uboot_env *env)
 {
-    struct uboot_name_value *pair = env->vars;
-    while (pair != NULL) {
-        free_(pair->name);
-        free_(pair->value);
-
-        struct uboot_name_value *next = pair->next;
-        free_(pair);
-        pair = next;
+    for (size_t i = 0; i < env->capacity; i++) {
+        if (env->vars[i].name)
+            free_strings(&env->vars[i]);
     }
+    free_(env->vars);
+    free_(env->dirty);
 
+    env->source = NULL;
+    env->dirty = NULL;
+    env->num_dirty = 0;
     env->vars = NULL;
+    env->capacity = 0;
+    env->count = 0;
 }
@@ -10,24 +10,58 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#define UBOOT_ENV_NAME_OWNED  0x1
+#define UBOOT_ENV_VALUE_OWNED 0x2
+
+// Granularity of the changes reported by uboot_env_write()
+#define UBOOT_ENV_SECTOR_SIZE 512
+
+// Names and values point into the buffer passed to uboot_env_read() until
+// they're changed. Borrowed names aren't NUL-terminated, so always use
+// name_len.
 struct uboot_name_value {
-    char *name;
-    char *value;
-    struct uboot_name_value *next;
+    const char *name;
+    const char *value;
+    uint32_t name_len;
+    uint32_t hash;
+    uint32_t flags;
 };
 
 struct uboot_env {
     size_t env_size;
 
+    // Buffer that borrowed names and values point into
+    const char *source;
+
+    // Open addressing hash table with linear probing. Empty slots have a
+    // NULL name.
     struct uboot_name_value *vars;
+    size_t capacity;
+    size_t count;
+
+    // Bumped by each setenv or unsetenv that changes something. The
+    // environment is dirty when it doesn't match what was read. Variables
+    // don't need their own generation since a dirty environment is always
+    // serialized whole, and the sector diff against the block that was read
+    // picks what gets written.
+    uint32_t generation;
+    uint32_t read_generation;
+
+    // Sectors that the last uboot_env_write() changed compared to `source`.
+    // One bit per sector.
+    uint8_t *dirty;
+    size_t num_dirty;
 };
 
 void uboot_env_init(struct uboot_env *env, size_t len);
 int uboot_env_read(struct uboot_env *env, const char *buffer);
 int uboot_env_setenv(struct uboot_env *env, const char *name, const char *value);
 int uboot_env_unsetenv(struct uboot_env *env, const char *name);
+const char *uboot_env_get(struct uboot_env *env, const char *name);
 int uboot_env_getenv(struct uboot_env *env, const char *name, char **value);
 int uboot_env_write(struct uboot_env *env, char *buffer);
+int uboot_env_sector_dirty(const struct uboot_env *env, size_t sector);
+int uboot_env_dirty(const struct uboot_env *env);
 void uboot_env_free(struct uboot_env *env);
 
 #endif // UBOOT_ENV_H
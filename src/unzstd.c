@@ -0,0 +1,927 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Zstandard (RFC 8878) decoder
+//
+// Only what's needed to boot a kernel compressed by the zstd CLI is
+// supported: one frame, no dictionaries. Like gunzip, the whole output stays
+// in memory and serves as the window. Each compressed block is copied to a
+// small buffer first since its bitstreams are read backwards from the end.
+//
+// Bitstreams are read with unaligned 64-bit loads, so this needs the MMU on
+// when running on the target.
+
+#include "decompress.h"
+#include "util.h"
+
+#define ZSTD_MAGIC           0xfd2fb528
+#define ZSTD_BLOCK_MAX       (128 * 1024)
+#define ZSTD_BUFFER_SLACK    8 // Bitstream reads may load up to 7 bytes past the end
+
+#define BLOCK_RAW        0
+#define BLOCK_RLE        1
+#define BLOCK_COMPRESSED 2
+
+#define LITERALS_RAW        0
+#define LITERALS_RLE        1
+#define LITERALS_COMPRESSED 2
+#define LITERALS_TREELESS   3
+
+#define MODE_PREDEFINED 0
+#define MODE_RLE        1
+#define MODE_FSE        2
+#define MODE_REPEAT     3
+
+#define FSE_MAX_LOG     9
+#define FSE_MAX_SYMBOLS 64
+#define MAX_LL_CODE     35
+#define MAX_ML_CODE     52
+#define MAX_OF_CODE     31
+#define LL_MAX_LOG      9
+#define ML_MAX_LOG      9
+#define OF_MAX_LOG      8
+
+#define HUF_MAX_BITS    11
+#define HUF_WEIGHTS_MAX_LOG 6
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) u64_unaligned;
+typedef uint32_t __attribute__((may_alias, aligned(1))) u32_unaligned;
+
+struct fse_table {
+    int accuracy_log; // < 0 until the table has been set
+    uint8_t symbol[1 << FSE_MAX_LOG];
+    uint8_t num_bits[1 << FSE_MAX_LOG];
+    uint16_t base[1 << FSE_MAX_LOG];
+};
+
+struct huf_table {
+    int max_bits; // 0 until the table has been set
+    uint8_t symbol[1 << HUF_MAX_BITS];
+    uint8_t num_bits[1 << HUF_MAX_BITS];
+};
+
+struct zstd_state {
+    struct decomp_input *in;
+    uint8_t *out_start;
+    uint8_t *out;
+    uint8_t *out_end;
+
+    uint8_t *block;
+    uint8_t *literals;
+
+    // Carried between blocks in a frame
+    uint32_t rep[3];
+    struct huf_table huf;
+    struct fse_table ll;
+    struct fse_table of;
+    struct fse_table ml;
+
+    struct fse_table scratch; // Huffman weight decoding
+};
+
+// Default distributions from RFC 8878 section 3.1.1.3.2.2
+static const int16_t ll_default[MAX_LL_CODE + 1] = {
+    4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+    -1, -1, -1, -1
+};
+static const int16_t ml_default[MAX_ML_CODE + 1] = {
+    1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+    -1, -1, -1, -1, -1
+};
+static const int16_t of_default[29] = {
+    1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+static const uint32_t ll_base[MAX_LL_CODE + 1] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+    8192, 16384, 32768, 65536
+};
+static const uint8_t ll_bits[MAX_LL_CODE + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+    13, 14, 15, 16
+};
+static const uint32_t ml_base[MAX_ML_CODE + 1] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+    19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+    35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+    4099, 8195, 16387, 32771, 65539
+};
+static const uint8_t ml_bits[MAX_ML_CODE + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+    12, 13, 14, 15, 16
+};
+
+static int highest_bit(uint32_t v)
+{
+    return 31 - __builtin_clz(v);
+}
+
+static uint32_t load_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// Read `n` (<= 56) bits starting at bit `offset`
+static uint64_t load_bits(const uint8_t *src, size_t offset, int n)
+{
+    uint64_t v = *(const u64_unaligned *) (src + (offset >> 3));
+    return (v >> (offset & 7)) & ((1ULL << n) - 1);
+}
+
+// Forward bitstream used for FSE table descriptions
+struct fwd_bits {
+    const uint8_t *src;
+    size_t len;
+    size_t pos;
+};
+
+static uint32_t fwd_read(struct fwd_bits *b, int n)
+{
+    uint32_t v = (uint32_t) load_bits(b->src, b->pos, n);
+    b->pos += n;
+    return v;
+}
+
+// Backward bitstream used for Huffman and FSE coded data. Reading starts
+// just below the highest set bit of the last byte and moves towards the
+// start. Reading past the start returns zeros.
+struct rev_bits {
+    const uint8_t *src;
+    int64_t pos;
+};
+
+static int rev_init(struct rev_bits *b, const uint8_t *src, size_t len)
+{
+    if (len == 0 || src[len - 1] == 0)
+        ERR_RETURN("zstd: bad bitstream padding");
+
+    b->src = src;
+    b->pos = (int64_t) (len - 1) * 8 + highest_bit(src[len - 1]);
+    return 0;
+}
+
+static uint32_t rev_read(struct rev_bits *b, int n)
+{
+    if (n == 0)
+        return 0;
+
+    b->pos -= n;
+    if (b->pos >= 0)
+        return (uint32_t) load_bits(b->src, b->pos, n);
+    if (b->pos > -n)
+        return (uint32_t) (load_bits(b->src, 0, n + b->pos) << -b->pos);
+    return 0;
+}
+
+static int fse_build(struct fse_table *t, const int16_t *freq, int num_symbols, int accuracy_log)
+{
+    int size = 1 << accuracy_log;
+    int high = size;
+    uint16_t state_desc[FSE_MAX_SYMBOLS];
+
+    // "Less than 1" probabilities each get one cell at the end of the table
+    for (int s = 0; s < num_symbols; s++) {
+        if (freq[s] == -1) {
+            t->symbol[--high] = s;
+            state_desc[s] = 1;
+        }
+    }
+
+    // Everything else is spread across the remaining cells
+    int step = (size >> 1) + (size >> 3) + 3;
+    int mask = size - 1;
+    int pos = 0;
+    for (int s = 0; s < num_symbols; s++) {
+        if (freq[s] <= 0)
+            continue;
+        state_desc[s] = freq[s];
+        for (int i = 0; i < freq[s]; i++) {
+            t->symbol[pos] = s;
+            do {
+                pos = (pos + step) & mask;
+            } while (pos >= high);
+        }
+    }
+    if (pos != 0)
+        ERR_RETURN("zstd: bad FSE distribution");
+
+    for (int i = 0; i < size; i++) {
+        uint16_t next = state_desc[t->symbol[i]]++;
+        t->num_bits[i] = accuracy_log - highest_bit(next);
+        t->base[i] = (next << t->num_bits[i]) - size;
+    }
+    t->accuracy_log = accuracy_log;
+    return 0;
+}
+
+static void fse_rle(struct fse_table *t, uint8_t symbol)
+{
+    t->accuracy_log = 0;
+    t->symbol[0] = symbol;
+    t->num_bits[0] = 0;
+    t->base[0] = 0;
+}
+
+// Parse an FSE table description and return the number of bytes it used
+static int fse_read(struct fse_table *t, const uint8_t *src, size_t len, int max_log, int max_symbol)
+{
+    struct fwd_bits b = {src, len, 0};
+    int16_t freq[FSE_MAX_SYMBOLS];
+    int num_symbols = 0;
+
+    if (len < 1)
+        ERR_RETURN("zstd: truncated FSE table");
+
+    int accuracy_log = 5 + fwd_read(&b, 4);
+    if (accuracy_log > max_log)
+        ERR_RETURN("zstd: FSE accuracy log too large");
+
+    int remaining = 1 << accuracy_log;
+    while (remaining > 0 && num_symbols <= max_symbol) {
+        int bits = highest_bit(remaining + 1) + 1;
+        uint32_t value = fwd_read(&b, bits);
+        uint32_t lower_mask = (1U << (bits - 1)) - 1;
+        uint32_t threshold = (1U << bits) - 1 - (remaining + 1);
+
+        // Small values are stored with one less bit
+        if ((value & lower_mask) < threshold) {
+            b.pos--;
+            value &= lower_mask;
+        } else if (value > lower_mask) {
+            value -= threshold;
+        }
+
+        int probability = (int) value - 1;
+        remaining -= probability < 0 ? -probability : probability;
+        freq[num_symbols++] = probability;
+
+        if (probability == 0) {
+            int repeat;
+            do {
+                repeat = fwd_read(&b, 2);
+                for (int i = 0; i < repeat && num_symbols <= max_symbol; i++)
+                    freq[num_symbols++] = 0;
+            } while (repeat == 3);
+        }
+    }
+
+    size_t used = (b.pos + 7) / 8;
+    if (remaining != 0 || used > len)
+        ERR_RETURN("zstd: bad FSE table");
+
+    OK_OR_RETURN(fse_build(t, freq, num_symbols, accuracy_log));
+    return (int) used;
+}
+
+static int huf_build(struct huf_table *t, uint8_t *weights, int num_weights)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < num_weights; i++) {
+        if (weights[i] > HUF_MAX_BITS)
+            ERR_RETURN("zstd: bad Huffman weight");
+        if (weights[i])
+            sum += 1 << (weights[i] - 1);
+    }
+    if (sum == 0)
+        ERR_RETURN("zstd: empty Huffman table");
+
+    // The last weight is implied by completing the next power of 2
+    int max_bits = highest_bit(sum) + 1;
+    uint32_t left = (1U << max_bits) - sum;
+    if (max_bits > HUF_MAX_BITS || (left & (left - 1)) != 0)
+        ERR_RETURN("zstd: bad Huffman weights");
+    weights[num_weights++] = highest_bit(left) + 1;
+
+    // Longer codes get the lowest table entries. Within a length, symbols
+    // are in order.
+    uint32_t rank_count[HUF_MAX_BITS + 1];
+    uint32_t rank_start[HUF_MAX_BITS + 1];
+    memset_(rank_count, 0, sizeof(rank_count));
+    for (int i = 0; i < num_weights; i++) {
+        if (weights[i])
+            rank_count[max_bits + 1 - weights[i]]++;
+    }
+
+    uint32_t start = 0;
+    for (int bits = max_bits; bits >= 1; bits--) {
+        uint32_t end = start + (rank_count[bits] << (max_bits - bits));
+        rank_start[bits] = start;
+        memset_(&t->num_bits[start], bits, end - start);
+        start = end;
+    }
+    if (start != (1U << max_bits))
+        ERR_RETURN("zstd: bad Huffman table");
+
+    for (int i = 0; i < num_weights; i++) {
+        if (!weights[i])
+            continue;
+        int bits = max_bits + 1 - weights[i];
+        uint32_t len = 1U << (max_bits - bits);
+        memset_(&t->symbol[rank_start[bits]], i, len);
+        rank_start[bits] += len;
+    }
+    t->max_bits = max_bits;
+    return 0;
+}
+
+// Parse a Huffman tree description and return the number of bytes it used
+static int huf_read(struct zstd_state *z, const uint8_t *src, size_t len)
+{
+    uint8_t weights[256];
+    int num_weights = 0;
+    size_t used;
+
+    if (len < 1)
+        ERR_RETURN("zstd: truncated Huffman table");
+
+    int header = src[0];
+    if (header >= 128) {
+        // Weights stored directly as 4-bit values
+        num_weights = header - 127;
+        used = 1 + (num_weights + 1) / 2;
+        if (used > len)
+            ERR_RETURN("zstd: truncated Huffman table");
+        for (int i = 0; i < num_weights; i++) {
+            uint8_t b = src[1 + i / 2];
+            weights[i] = (i & 1) ? (b & 0xf) : (b >> 4);
+        }
+    } else {
+        // FSE compressed weights decoded by two interleaved states
+        used = 1 + header;
+        if (used > len)
+            ERR_RETURN("zstd: truncated Huffman table");
+
+        struct fse_table *t = &z->scratch;
+        int n = fse_read(t, src + 1, header, HUF_WEIGHTS_MAX_LOG, HUF_MAX_BITS);
+        OK_OR_RETURN(n);
+
+        struct rev_bits b;
+        OK_OR_RETURN(rev_init(&b, src + 1 + n, header - n));
+
+        uint32_t state1 = rev_read(&b, t->accuracy_log);
+        uint32_t state2 = rev_read(&b, t->accuracy_log);
+        for (;;) {
+            if (num_weights >= 254)
+                ERR_RETURN("zstd: too many Huffman weights");
+
+            weights[num_weights++] = t->symbol[state1];
+            state1 = t->base[state1] + rev_read(&b, t->num_bits[state1]);
+            if (b.pos < 0) {
+                weights[num_weights++] = t->symbol[state2];
+                break;
+            }
+
+            weights[num_weights++] = t->symbol[state2];
+            state2 = t->base[state2] + rev_read(&b, t->num_bits[state2]);
+            if (b.pos < 0) {
+                weights[num_weights++] = t->symbol[state1];
+                break;
+            }
+        }
+    }
+
+    OK_OR_RETURN(huf_build(&z->huf, weights, num_weights));
+    return (int) used;
+}
+
+static int huf_decode_stream(const struct huf_table *t, const uint8_t *src, size_t len, uint8_t *out, size_t count)
+{
+    struct rev_bits b;
+    OK_OR_RETURN(rev_init(&b, src, len));
+
+    uint32_t mask = (1U << t->max_bits) - 1;
+    uint32_t state = rev_read(&b, t->max_bits);
+    for (size_t i = 0; i < count; i++) {
+        int bits = t->num_bits[state];
+        out[i] = t->symbol[state];
+        state = ((state << bits) | rev_read(&b, bits)) & mask;
+    }
+
+    // The final state shouldn't contain any bits from the stream
+    if (b.pos != -t->max_bits)
+        ERR_RETURN("zstd: Huffman stream is corrupt");
+    return 0;
+}
+
+static int huf_decode(const struct huf_table *t, const uint8_t *src, size_t len, uint8_t *out, size_t count, int four_streams)
+{
+    if (!four_streams)
+        return huf_decode_stream(t, src, len, out, count);
+
+    if (len < 6)
+        ERR_RETURN("zstd: truncated jump table");
+
+    size_t sizes[4];
+    sizes[0] = src[0] | (src[1] << 8);
+    sizes[1] = src[2] | (src[3] << 8);
+    sizes[2] = src[4] | (src[5] << 8);
+    if (sizes[0] + sizes[1] + sizes[2] + 6 > len)
+        ERR_RETURN("zstd: bad jump table");
+    sizes[3] = len - 6 - sizes[0] - sizes[1] - sizes[2];
+
+    size_t segment = (count + 3) / 4;
+    if (segment * 3 > count)
+        ERR_RETURN("zstd: too few literals for four streams");
+
+    src += 6;
+    for (int i = 0; i < 4; i++) {
+        size_t n = (i < 3) ? segment : count - 3 * segment;
+        OK_OR_RETURN(huf_decode_stream(t, src, sizes[i], out, n));
+        src += sizes[i];
+        out += n;
+    }
+    return 0;
+}
+
+// Decode the literals section and return the number of bytes it used
+static int decode_literals(struct zstd_state *z, const uint8_t *src, size_t len, const uint8_t **literals, size_t *num_literals)
+{
+    if (len < 1)
+        ERR_RETURN("zstd: truncated literals section");
+
+    int type = src[0] & 3;
+    int size_format = (src[0] >> 2) & 3;
+    size_t header_size;
+    size_t regenerated;
+
+    if (type == LITERALS_RAW || type == LITERALS_RLE) {
+        switch (size_format) {
+        case 1:
+            header_size = 2;
+            break;
+        case 3:
+            header_size = 3;
+            break;
+        default:
+            header_size = 1;
+            break;
+        }
+        if (header_size > len)
+            ERR_RETURN("zstd: truncated literals section");
+
+        if (header_size == 1)
+            regenerated = src[0] >> 3;
+        else if (header_size == 2)
+            regenerated = (src[0] >> 4) + (src[1] << 4);
+        else
+            regenerated = (src[0] >> 4) + (src[1] << 4) + (src[2] << 12);
+        if (regenerated > ZSTD_BLOCK_MAX)
+            ERR_RETURN("zstd: too many literals");
+
+        *num_literals = regenerated;
+        if (type == LITERALS_RAW) {
+            if (header_size + regenerated > len)
+                ERR_RETURN("zstd: truncated literals");
+            *literals = src + header_size;
+            return (int) (header_size + regenerated);
+        } else {
+            if (header_size + 1 > len)
+                ERR_RETURN("zstd: truncated literals");
+            memset_(z->literals, src[header_size], regenerated);
+            *literals = z->literals;
+            return (int) (header_size + 1);
+        }
+    }
+
+    int size_bits;
+    switch (size_format) {
+    case 2:
+        header_size = 4;
+        size_bits = 14;
+        break;
+    case 3:
+        header_size = 5;
+        size_bits = 18;
+        break;
+    default:
+        header_size = 3;
+        size_bits = 10;
+        break;
+    }
+    if (header_size > len)
+        ERR_RETURN("zstd: truncated literals section");
+
+    uint64_t header = 0;
+    for (size_t i = 0; i < header_size; i++)
+        header |= (uint64_t) src[i] << (8 * i);
+    regenerated = (header >> 4) & ((1U << size_bits) - 1);
+    size_t compressed = (header >> (4 + size_bits)) & ((1U << size_bits) - 1);
+
+    if (regenerated > ZSTD_BLOCK_MAX)
+        ERR_RETURN("zstd: too many literals");
+    if (header_size + compressed > len)
+        ERR_RETURN("zstd: truncated literals");
+
+    const uint8_t *p = src + header_size;
+    if (type == LITERALS_COMPRESSED) {
+        int n = huf_read(z, p, compressed);
+        OK_OR_RETURN(n);
+        p += n;
+        compressed -= n;
+    } else if (z->huf.max_bits == 0) {
+        ERR_RETURN("zstd: treeless literals without a previous Huffman table");
+    }
+
+    OK_OR_RETURN(huf_decode(&z->huf, p, compressed, z->literals, regenerated, size_format != 0));
+    *literals = z->literals;
+    *num_literals = regenerated;
+    return (int) (p + compressed - src);
+}
+
+// Set up one of the sequence decoding tables and return the bytes used
+static int setup_table(struct fse_table *t, int mode, const uint8_t *src, size_t len,
+                       const int16_t *defaults, int num_defaults, int default_log,
+                       int max_log, int max_symbol)
+{
+    switch (mode) {
+    case MODE_PREDEFINED:
+        OK_OR_RETURN(fse_build(t, defaults, num_defaults, default_log));
+        return 0;
+    case MODE_RLE:
+        if (len < 1 || src[0] > max_symbol)
+            ERR_RETURN("zstd: bad RLE sequence symbol");
+        fse_rle(t, src[0]);
+        return 1;
+    case MODE_FSE:
+        return fse_read(t, src, len, max_log, max_symbol);
+    default:
+        if (t->accuracy_log < 0)
+            ERR_RETURN("zstd: repeat mode without a previous table");
+        return 0;
+    }
+}
+
+// Copy 8 bytes at a time, possibly writing up to 7 bytes past `d + len`.
+// Most literal runs and matches are short, so this beats calling memcpy_.
+static void wild_copy(uint8_t *d, const uint8_t *s, size_t len)
+{
+    uint8_t *end = d + len;
+    do {
+        *(u64_unaligned *) d = *(const u64_unaligned *) s;
+        d += 8;
+        s += 8;
+    } while (d < end);
+}
+
+static int copy_match(struct zstd_state *z, size_t offset, size_t len)
+{
+    if (offset == 0 || offset > (size_t) (z->out - z->out_start))
+        ERR_RETURN("zstd: offset too far back");
+    if (len > (size_t) (z->out_end - z->out))
+        ERR_RETURN("zstd: output too large");
+
+    const uint8_t *src = z->out - offset;
+    if (offset >= 8 && len + 8 <= (size_t) (z->out_end - z->out)) {
+        wild_copy(z->out, src, len);
+        z->out += len;
+    } else if (offset >= len) {
+        memcpy_(z->out, src, len);
+        z->out += len;
+    } else {
+        while (len--)
+            *z->out++ = *src++;
+    }
+    return 0;
+}
+
+// The literals always have ZSTD_BUFFER_SLACK readable bytes after them
+static int copy_literals(struct zstd_state *z, const uint8_t *literals, size_t len)
+{
+    if (len > (size_t) (z->out_end - z->out))
+        ERR_RETURN("zstd: output too large");
+    if (len <= 32 && len + 8 <= (size_t) (z->out_end - z->out))
+        wild_copy(z->out, literals, len);
+    else
+        memcpy_(z->out, literals, len);
+    z->out += len;
+    return 0;
+}
+
+static int decode_sequences(struct zstd_state *z, const uint8_t *src, size_t len, const uint8_t *literals, size_t num_literals)
+{
+    const uint8_t *end = src + len;
+    const uint8_t *literals_end = literals + num_literals;
+
+    if (len < 1)
+        ERR_RETURN("zstd: truncated sequences section");
+
+    uint32_t num_sequences = src[0];
+    if (num_sequences == 0)
+        return copy_literals(z, literals, num_literals);
+    if (num_sequences < 128) {
+        src += 1;
+    } else if (num_sequences < 255) {
+        if (len < 2)
+            ERR_RETURN("zstd: truncated sequences section");
+        num_sequences = ((num_sequences - 128) << 8) + src[1];
+        src += 2;
+    } else {
+        if (len < 3)
+            ERR_RETURN("zstd: truncated sequences section");
+        num_sequences = src[1] + (src[2] << 8) + 0x7f00;
+        src += 3;
+    }
+
+    if (src >= end)
+        ERR_RETURN("zstd: truncated sequences section");
+    int modes = *src++;
+    if (modes & 3)
+        ERR_RETURN("zstd: reserved sequence mode bits set");
+
+    int n;
+    n = setup_table(&z->ll, (modes >> 6) & 3, src, end - src, ll_default, MAX_LL_CODE + 1, 6, LL_MAX_LOG, MAX_LL_CODE);
+    OK_OR_RETURN(n);
+    src += n;
+    n = setup_table(&z->of, (modes >> 4) & 3, src, end - src, of_default, 29, 5, OF_MAX_LOG, MAX_OF_CODE);
+    OK_OR_RETURN(n);
+    src += n;
+    n = setup_table(&z->ml, (modes >> 2) & 3, src, end - src, ml_default, MAX_ML_CODE + 1, 6, ML_MAX_LOG, MAX_ML_CODE);
+    OK_OR_RETURN(n);
+    src += n;
+
+    struct rev_bits b;
+    OK_OR_RETURN(rev_init(&b, src, end - src));
+
+    uint32_t ll_state = rev_read(&b, z->ll.accuracy_log);
+    uint32_t of_state = rev_read(&b, z->of.accuracy_log);
+    uint32_t ml_state = rev_read(&b, z->ml.accuracy_log);
+
+    for (uint32_t i = 0; i < num_sequences; i++) {
+        int ll_code = z->ll.symbol[ll_state];
+        int of_code = z->of.symbol[of_state];
+        int ml_code = z->ml.symbol[ml_state];
+        if (ll_code > MAX_LL_CODE || ml_code > MAX_ML_CODE || of_code > MAX_OF_CODE)
+            ERR_RETURN("zstd: bad sequence code");
+
+        uint32_t offset_value = (1U << of_code) + rev_read(&b, of_code);
+        size_t match_len = ml_base[ml_code] + rev_read(&b, ml_bits[ml_code]);
+        size_t literal_len = ll_base[ll_code] + rev_read(&b, ll_bits[ll_code]);
+
+        uint32_t offset;
+        if (offset_value > 3) {
+            offset = offset_value - 3;
+            z->rep[2] = z->rep[1];
+            z->rep[1] = z->rep[0];
+            z->rep[0] = offset;
+        } else {
+            // Repeat offsets shift by one when there are no literals
+            int index = offset_value - 1 + (literal_len == 0);
+            if (index == 0) {
+                offset = z->rep[0];
+            } else {
+                offset = (index == 3) ? z->rep[0] - 1 : z->rep[index];
+                if (index != 1)
+                    z->rep[2] = z->rep[1];
+                z->rep[1] = z->rep[0];
+                z->rep[0] = offset;
+            }
+        }
+
+        if (literal_len > (size_t) (literals_end - literals))
+            ERR_RETURN("zstd: not enough literals");
+        OK_OR_RETURN(copy_literals(z, literals, literal_len));
+        literals += literal_len;
+        OK_OR_RETURN(copy_match(z, offset, match_len));
+
+        if (i + 1 < num_sequences) {
+            ll_state = z->ll.base[ll_state] + rev_read(&b, z->ll.num_bits[ll_state]);
+            ml_state = z->ml.base[ml_state] + rev_read(&b, z->ml.num_bits[ml_state]);
+            of_state = z->of.base[of_state] + rev_read(&b, z->of.num_bits[of_state]);
+        }
+    }
+
+    if (b.pos != 0)
+        ERR_RETURN("zstd: sequence bitstream is corrupt");
+
+    return copy_literals(z, literals, literals_end - literals);
+}
+
+static int decode_block(struct zstd_state *z, size_t len)
+{
+    const uint8_t *literals;
+    size_t num_literals;
+
+    OK_OR_RETURN_MSG(decomp_read(z->in, z->block, len), "zstd: compressed data is truncated");
+
+    int n = decode_literals(z, z->block, len, &literals, &num_literals);
+    OK_OR_RETURN(n);
+
+    return decode_sequences(z, z->block + n, len - n, literals, num_literals);
+}
+
+#define XXH_PRIME64_1 0x9e3779b185ebca87ULL
+#define XXH_PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME64_3 0x165667b19e3779f9ULL
+#define XXH_PRIME64_4 0x85ebca77c2b2ae63ULL
+#define XXH_PRIME64_5 0x27d4eb2f165667c5ULL
+
+static uint64_t rotl64(uint64_t v, int n)
+{
+    return (v << n) | (v >> (64 - n));
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input * XXH_PRIME64_2, 31) * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t v)
+{
+    return (acc ^ xxh64_round(0, v)) * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// XXH64 with a seed of 0 for the frame checksum
+static uint64_t xxh64(const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = XXH_PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -XXH_PRIME64_1;
+
+        while (end - p >= 32) {
+            v1 = xxh64_round(v1, *(const u64_unaligned *) p);
+            v2 = xxh64_round(v2, *(const u64_unaligned *) (p + 8));
+            v3 = xxh64_round(v3, *(const u64_unaligned *) (p + 16));
+            v4 = xxh64_round(v4, *(const u64_unaligned *) (p + 24));
+            p += 32;
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = XXH_PRIME64_5;
+    }
+    h += len;
+
+    while (end - p >= 8) {
+        h ^= xxh64_round(0, *(const u64_unaligned *) p);
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t) *(const u32_unaligned *) p * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p++ * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static int unzstd_frame(struct zstd_state *z)
+{
+    static const uint8_t dict_id_sizes[4] = {0, 1, 2, 4};
+    uint8_t buf[8];
+
+    OK_OR_RETURN_MSG(decomp_read(z->in, buf, 5), "zstd: compressed data is truncated");
+    if (load_le32(buf) != ZSTD_MAGIC)
+        ERR_RETURN("zstd: bad magic");
+
+    int descriptor = buf[4];
+    int fcs_flag = descriptor >> 6;
+    int single_segment = (descriptor >> 5) & 1;
+    int has_checksum = (descriptor >> 2) & 1;
+    int dict_id_size = dict_id_sizes[descriptor & 3];
+    if (descriptor & 0x08)
+        ERR_RETURN("zstd: reserved frame header bit set");
+
+    // The window size doesn't matter since all output stays in memory
+    if (!single_segment)
+        OK_OR_RETURN_MSG(decomp_skip(z->in, 1), "zstd: compressed data is truncated");
+
+    if (dict_id_size) {
+        memset_(buf, 0, sizeof(buf));
+        OK_OR_RETURN_MSG(decomp_read(z->in, buf, dict_id_size), "zstd: compressed data is truncated");
+        if (load_le32(buf) != 0)
+            ERR_RETURN("zstd: dictionaries aren't supported");
+    }
+
+    int fcs_size = (fcs_flag == 0) ? single_segment : (1 << fcs_flag);
+    uint64_t content_size = 0;
+    if (fcs_size) {
+        memset_(buf, 0, sizeof(buf));
+        OK_OR_RETURN_MSG(decomp_read(z->in, buf, fcs_size), "zstd: compressed data is truncated");
+        for (int i = fcs_size - 1; i >= 0; i--)
+            content_size = (content_size << 8) | buf[i];
+        if (fcs_size == 2)
+            content_size += 256;
+        if (content_size > (uint64_t) (z->out_end - z->out))
+            ERR_RETURN("zstd: content size of %lu is too large", content_size);
+    }
+
+    z->rep[0] = 1;
+    z->rep[1] = 4;
+    z->rep[2] = 8;
+    z->huf.max_bits = 0;
+    z->ll.accuracy_log = -1;
+    z->of.accuracy_log = -1;
+    z->ml.accuracy_log = -1;
+
+    int last;
+    do {
+        OK_OR_RETURN_MSG(decomp_read(z->in, buf, 3), "zstd: compressed data is truncated");
+        uint32_t header = buf[0] | (buf[1] << 8) | (buf[2] << 16);
+        size_t size = header >> 3;
+        last = header & 1;
+
+        switch ((header >> 1) & 3) {
+        case BLOCK_RAW:
+            if (size > (size_t) (z->out_end - z->out))
+                ERR_RETURN("zstd: output too large");
+            OK_OR_RETURN_MSG(decomp_read(z->in, z->out, size), "zstd: compressed data is truncated");
+            z->out += size;
+            break;
+
+        case BLOCK_RLE: {
+            int c = decomp_read_byte(z->in);
+            if (c < 0)
+                ERR_RETURN("zstd: compressed data is truncated");
+            if (size > (size_t) (z->out_end - z->out))
+                ERR_RETURN("zstd: output too large");
+            memset_(z->out, c, size);
+            z->out += size;
+            break;
+        }
+
+        case BLOCK_COMPRESSED:
+            if (size > ZSTD_BLOCK_MAX)
+                ERR_RETURN("zstd: block too large");
+            OK_OR_RETURN(decode_block(z, size));
+            break;
+
+        default:
+            ERR_RETURN("zstd: reserved block type");
+        }
+    } while (!last);
+
+    size_t len = z->out - z->out_start;
+    if (fcs_size && content_size != len)
+        ERR_RETURN("zstd: size mismatch (expected %lu; got %lu)", content_size, len);
+
+    if (has_checksum) {
+        OK_OR_RETURN_MSG(decomp_read(z->in, buf, 4), "zstd: compressed data is truncated");
+        uint32_t expected = load_le32(buf);
+        uint32_t actual = (uint32_t) xxh64(z->out_start, len);
+        if (expected != actual)
+            ERR_RETURN("zstd: checksum mismatch (expected 0x%08x; got 0x%08x)", expected, actual);
+    }
+    return 0;
+}
+
+int unzstd(struct decomp_input *in, uint8_t *out, size_t out_max, size_t *out_len)
+{
+    struct zstd_state *z = malloc_(sizeof(struct zstd_state));
+    uint8_t *block = malloc_(ZSTD_BLOCK_MAX + ZSTD_BUFFER_SLACK);
+    uint8_t *literals = malloc_(ZSTD_BLOCK_MAX + ZSTD_BUFFER_SLACK);
+    int rc = 0;
+
+    *out_len = 0;
+    if (!z || !block || !literals)
+        ERR_CLEANUP_MSG("zstd: out of memory");
+
+    memset_(z, 0, sizeof(*z));
+    memset_(block + ZSTD_BLOCK_MAX, 0, ZSTD_BUFFER_SLACK);
+    z->in = in;
+    z->out_start = out;
+    z->out = out;
+    z->out_end = out + out_max;
+    z->block = block;
+    z->literals = literals;
+
+    // Only the first frame is decoded. What follows is whatever was on the
+    // disk before.
+    rc = unzstd_frame(z);
+
+    *out_len = z->out - z->out_start;
+
+cleanup:
+    free_(literals);
+    free_(block);
+    free_(z);
+    return rc;
+}
@@ -5,6 +5,7 @@
  */
 
 #include "util.h"
+#include "mmu.h"
 #include "pl011_uart.h"
 
 // Nanoprintf support
@@ -20,14 +21,73 @@
 #define NANOPRINTF_IMPLEMENTATION
 #include "nanoprintf.h"
 
+#ifdef HOST_BUILD
+// Host builds for benchmarks and unit tests supply a heap and power off by
+// exiting. Tests that check the loader's heap use set HOST_HEAP_SIZE to
+// HEAP_SIZE.
+#ifndef HOST_HEAP_SIZE
+#define HOST_HEAP_SIZE (64 * 1024 * 1024)
+#endif
+static char host_heap[HOST_HEAP_SIZE] __attribute__((aligned(16)));
+#define HEAP_START host_heap
+#define HEAP_LIMIT (host_heap + HOST_HEAP_SIZE)
+
+void host_poweroff(void) __attribute__((noreturn));
+#define poweroff host_poweroff
+#else
 extern char _stack_top; // Defined in linker script
+#define HEAP_START (&_stack_top)
+#define HEAP_LIMIT (&_stack_top + HEAP_SIZE)
+#endif
+
+// Heap allocator
+//
+// Blocks are carved off the top of the heap and never given back to it.
+// Each block has a header with its payload size. Payloads up to
+// HEAP_LARGE_SIZE are rounded up to a power of two and freed blocks go on a
+// per-class free list for reuse by the next allocation of that class. Larger
+// requests are only rounded to 16 bytes so that big buffers don't waste up
+// to half their size. Freed large blocks are reused by the smallest one that
+// fits.
+//
+// heap_mark()/heap_release() drop everything allocated since the mark for
+// scoped work like processing the U-Boot environment. Blocks are stamped
+// with the generation they were allocated in so that heap_release() can
+// also find blocks below the mark that were freed and then reused after it.
+#define HEAP_MIN_CLASS   4  // 16 bytes
+#define HEAP_MAX_CLASS   16 // 64 KiB
+#define HEAP_LARGE_SIZE  ((size_t) 1 << HEAP_MAX_CLASS)
+#define HEAP_ALIGN       16
+#define HEAP_MAGIC       0x68656170
+
+struct heap_header {
+    size_t size;
+    uint32_t generation;
+    uint32_t magic;
+};
+
+struct free_block {
+    struct free_block *next;
+};
+
 static char *heap;
+static struct free_block *free_lists[HEAP_MAX_CLASS + 1];
+static struct free_block *large_free_list;
+static uint32_t heap_generation;
+static size_t heap_in_use;
+static size_t heap_peak;
 
 void util_init(void)
 {
-    heap = (char *) &_stack_top;
+    heap = HEAP_START;
+    memset_(free_lists, 0, sizeof(free_lists));
+    large_free_list = NULL;
+    heap_generation = 0;
+    heap_in_use = 0;
+    heap_peak = 0;
 }
 
+#ifndef HOST_BUILD
 static void poweroff(void)
 {
     switch (get_el()) {
@@ -69,6 +129,7 @@ int get_el(void)
     asm volatile ("mrs %0, CurrentEL" : "=r"(el));
     return (el >> 2);
 }
+#endif
 
 static void nano_putc(int c, void *ctx)
 {
@@ -122,18 +183,107 @@ const void *memchr_(const void *s, int c, size_t n)
     return NULL;
 }
 
+// Word-wide accesses go through these so that they don't break strict
+// aliasing. The unaligned version is only safe once memory is mapped as
+// normal memory. With the MMU off, all data accesses are treated as
+// device accesses and unaligned ones fault.
+typedef uint64_t __attribute__((may_alias)) u64_alias;
+typedef uint64_t __attribute__((may_alias, aligned(1))) u64_unaligned;
+
+static int can_copy_words(const void *d, const void *s)
+{
+    return (((uintptr_t) d ^ (uintptr_t) s) & 7) == 0 || mmu_enabled();
+}
+
 void *memcpy_(void *dst, const void *src, size_t n)
 {
     unsigned char *d = dst;
     const unsigned char *s = src;
+
+    if (n >= 16 && can_copy_words(d, s)) {
+        // Align the destination and then copy 16 bytes at a time. The
+        // compiler turns each iteration into an ldp/stp pair.
+        while ((uintptr_t) d & 7) {
+            *d++ = *s++;
+            n--;
+        }
+        while (n >= 16) {
+            uint64_t a = ((const u64_unaligned *) s)[0];
+            uint64_t b = ((const u64_unaligned *) s)[1];
+            ((u64_alias *) d)[0] = a;
+            ((u64_alias *) d)[1] = b;
+            d += 16;
+            s += 16;
+            n -= 16;
+        }
+    }
+
     while (n--)
         *d++ = *s++;
     return dst;
 }
 
+// Returns the DC ZVA block size in bytes or 0 if it can't be used
+static size_t dc_zva_block_size(void)
+{
+#if defined(__aarch64__) && !defined(HOST_BUILD)
+    static size_t block_size = 1;
+
+    // DC ZVA only works on normal memory
+    if (!mmu_enabled())
+        return 0;
+
+    if (block_size == 1) {
+        // DCZID_EL0.DZP is bit 4 and BS is log2 of the size in words
+        uint64_t dczid = read_sysreg(dczid_el0);
+        block_size = (dczid & 0x10) ? 0 : (4UL << (dczid & 0xf));
+    }
+    return block_size;
+#else
+    return 0;
+#endif
+}
+
 void *memset_(void *b, int c, size_t len)
 {
     unsigned char *p = b;
+
+    if (len >= 16) {
+        uint64_t pattern = (unsigned char) c;
+        pattern |= pattern << 8;
+        pattern |= pattern << 16;
+        pattern |= pattern << 32;
+
+        while ((uintptr_t) p & 7) {
+            *p++ = c;
+            len--;
+        }
+
+        // Zero whole cache lines at a time for large zero fills
+        size_t zva = (c == 0 && len >= 1024) ? dc_zva_block_size() : 0;
+        if (zva && len >= 2 * zva) {
+            while ((uintptr_t) p & (zva - 1)) {
+                *(u64_alias *) p = 0;
+                p += 8;
+                len -= 8;
+            }
+            while (len >= zva) {
+#if defined(__aarch64__) && !defined(HOST_BUILD)
+                asm volatile ("dc zva, %0" :: "r"(p) : "memory");
+#endif
+                p += zva;
+                len -= zva;
+            }
+        }
+
+        while (len >= 16) {
+            ((u64_alias *) p)[0] = pattern;
+            ((u64_alias *) p)[1] = pattern;
+            p += 16;
+            len -= 16;
+        }
+    }
+
     while (len--)
         *p++ = c;
 
@@ -145,15 +295,31 @@ void *memmove_(void *dest, const void *src, size_t n)
     unsigned char *d = dest;
     const unsigned char *s = src;
 
-    if (d < s) {
-        while (n--)
-            *d++ = *s++;
-    } else {
-        d += n;
-        s += n;
-        while (n--)
+    // Copying forward is safe when the destination is below the source
+    // since each block is read before it's written.
+    if (d <= s || d >= s + n)
+        return memcpy_(dest, src, n);
+
+    d += n;
+    s += n;
+    if (n >= 16 && can_copy_words(d, s)) {
+        while ((uintptr_t) d & 7) {
             *(--d) = *(--s);
+            n--;
+        }
+        while (n >= 16) {
+            d -= 16;
+            s -= 16;
+            uint64_t a = ((const u64_unaligned *) s)[0];
+            uint64_t b = ((const u64_unaligned *) s)[1];
+            ((u64_alias *) d)[0] = a;
+            ((u64_alias *) d)[1] = b;
+            n -= 16;
+        }
     }
+
+    while (n--)
+        *(--d) = *(--s);
     return dest;
 }
 
@@ -172,21 +338,140 @@ int memcmp_(const void *s1, const void *s2, size_t n)
     return 0;
 }
 
-void qsort_(void *base, size_t nel, size_t width, int (*compar)(const void *, const void *))
+// Introsort: quicksort that switches to heapsort if partitioning goes badly
+// and to insertion sort for short ranges. Recursion is only on the smaller
+// partition, so the stack use is O(log n).
+#define QSORT_INSERTION_SORT_MAX 16
+
+struct sort_context {
+    size_t width;
+    int (*compar)(const void *, const void *);
+    int word_swap; // Elements are pointer-aligned and a multiple of the pointer size
+};
+
+static void sort_swap(const struct sort_context *ctx, char *a, char *b)
 {
-    // Bubble sort
-    char *arr = (char *)base;
-    for (size_t i = 0; i < nel - 1; i++) {
-        for (size_t j = 0; j < nel - i - 1; j++) {
-            if (compar(arr + j * width, arr + (j + 1) * width) > 0) {
-                // Swap elements
-                char temp[width];
-                memcpy_(temp, arr + j * width, width);
-                memcpy_(arr + j * width, arr + (j + 1) * width, width);
-                memcpy_(arr + (j + 1) * width, temp, width);
-            }
+    if (ctx->word_swap) {
+        uintptr_t *x = (uintptr_t *) a;
+        uintptr_t *y = (uintptr_t *) b;
+        for (size_t i = 0; i < ctx->width / sizeof(uintptr_t); i++) {
+            uintptr_t tmp = x[i];
+            x[i] = y[i];
+            y[i] = tmp;
+        }
+    } else {
+        for (size_t i = 0; i < ctx->width; i++) {
+            char tmp = a[i];
+            a[i] = b[i];
+            b[i] = tmp;
+        }
+    }
+}
+
+static void insertion_sort(const struct sort_context *ctx, char *arr, size_t nel)
+{
+    for (size_t i = 1; i < nel; i++) {
+        for (char *p = arr + i * ctx->width; p > arr && ctx->compar(p - ctx->width, p) > 0; p -= ctx->width)
+            sort_swap(ctx, p - ctx->width, p);
+    }
+}
+
+static void sift_down(const struct sort_context *ctx, char *arr, size_t root, size_t nel)
+{
+    size_t child;
+    while ((child = 2 * root + 1) < nel) {
+        if (child + 1 < nel && ctx->compar(arr + child * ctx->width, arr + (child + 1) * ctx->width) < 0)
+            child++;
+        if (ctx->compar(arr + root * ctx->width, arr + child * ctx->width) >= 0)
+            return;
+        sort_swap(ctx, arr + root * ctx->width, arr + child * ctx->width);
+        root = child;
+    }
+}
+
+static void heap_sort(const struct sort_context *ctx, char *arr, size_t nel)
+{
+    for (size_t i = nel / 2; i-- > 0;)
+        sift_down(ctx, arr, i, nel);
+    for (size_t end = nel - 1; end > 0; end--) {
+        sort_swap(ctx, arr, arr + end * ctx->width);
+        sift_down(ctx, arr, 0, end);
+    }
+}
+
+static void intro_sort(const struct sort_context *ctx, char *arr, size_t nel, int depth)
+{
+    size_t width = ctx->width;
+
+    while (nel > QSORT_INSERTION_SORT_MAX) {
+        if (depth-- == 0) {
+            heap_sort(ctx, arr, nel);
+            return;
+        }
+
+        // Move the median of the first, middle and last elements to the
+        // front to use as the pivot
+        char *lo = arr;
+        char *mid = arr + (nel / 2) * width;
+        char *hi = arr + (nel - 1) * width;
+        if (ctx->compar(mid, lo) < 0)
+            sort_swap(ctx, mid, lo);
+        if (ctx->compar(hi, mid) < 0) {
+            sort_swap(ctx, hi, mid);
+            if (ctx->compar(mid, lo) < 0)
+                sort_swap(ctx, mid, lo);
+        }
+        sort_swap(ctx, lo, mid);
+
+        // Hoare partition. Stopping on elements equal to the pivot keeps
+        // runs of duplicates from unbalancing the partitions.
+        size_t i = 0;
+        size_t j = nel;
+        for (;;) {
+            do
+                i++;
+            while (i < nel && ctx->compar(arr + i * width, arr) < 0);
+            do
+                j--;
+            while (ctx->compar(arr + j * width, arr) > 0);
+            if (i >= j)
+                break;
+            sort_swap(ctx, arr + i * width, arr + j * width);
+        }
+        sort_swap(ctx, arr, arr + j * width);
+
+        // Elements [0, j) are <= the pivot and (j, nel) are >= it
+        size_t left = j;
+        size_t right = nel - j - 1;
+        if (left < right) {
+            intro_sort(ctx, arr, left, depth);
+            arr += (j + 1) * width;
+            nel = right;
+        } else {
+            intro_sort(ctx, arr + (j + 1) * width, right, depth);
+            nel = left;
         }
     }
+    insertion_sort(ctx, arr, nel);
+}
+
+void qsort_(void *base, size_t nel, size_t width, int (*compar)(const void *, const void *))
+{
+    if (nel < 2 || width == 0)
+        return;
+
+    struct sort_context ctx = {
+        width,
+        compar,
+        ((uintptr_t) base % sizeof(uintptr_t)) == 0 && (width % sizeof(uintptr_t)) == 0
+    };
+
+    // Fall back to heapsort after 2 * log2(nel) levels of bad pivots
+    int depth = 0;
+    for (size_t n = nel; n > 1; n >>= 1)
+        depth += 2;
+
+    intro_sort(&ctx, base, nel, depth);
 }
 
 char *strrchr_(const char *s, int c)
@@ -261,16 +546,156 @@ void putchar_(char c)
     uart_putc(c);
 }
 
+static int size_class(size_t size)
+{
+    int c = HEAP_MIN_CLASS;
+    while (((size_t) 1 << c) < size)
+        c++;
+    return c;
+}
+
+static struct heap_header *take_large_block(size_t size)
+{
+    struct free_block **best = NULL;
+    size_t best_size = 0;
+
+    for (struct free_block **block = &large_free_list; *block; block = &(*block)->next) {
+        size_t block_size = ((struct heap_header *) *block - 1)->size;
+        if (block_size >= size && (!best || block_size < best_size)) {
+            best = block;
+            best_size = block_size;
+        }
+    }
+    if (!best)
+        return NULL;
+
+    struct heap_header *header = (struct heap_header *) *best - 1;
+    *best = (*best)->next;
+    return header;
+}
+
+static void put_free_block(struct heap_header *header)
+{
+    struct free_block *block = (struct free_block *) (header + 1);
+    struct free_block **list;
+
+    if (header->size > HEAP_LARGE_SIZE)
+        list = &large_free_list;
+    else
+        list = &free_lists[size_class(header->size)];
+
+    block->next = *list;
+    *list = block;
+}
+
 void *malloc_(size_t size)
 {
-    char *ptr = heap;
-    heap += (size + 7) & ~0x7; // Align to 8 bytes
-    return (void*) ptr;
+    struct heap_header *header = NULL;
+    size_t block_size;
+
+    if (size > HEAP_LARGE_SIZE) {
+        if (size > (size_t) (HEAP_LIMIT - HEAP_START))
+            fatal("malloc_(%lu) is too big", size);
+
+        block_size = (size + HEAP_ALIGN - 1) & ~(size_t) (HEAP_ALIGN - 1);
+        header = take_large_block(block_size);
+    } else {
+        int c = size_class(size);
+        block_size = (size_t) 1 << c;
+        if (free_lists[c]) {
+            header = (struct heap_header *) free_lists[c] - 1;
+            free_lists[c] = free_lists[c]->next;
+        }
+    }
+
+    if (header) {
+        block_size = header->size;
+    } else {
+        if (sizeof(struct heap_header) + block_size > (size_t) (HEAP_LIMIT - heap))
+            fatal("Out of memory allocating %lu bytes (%lu of %lu bytes in use)",
+                  size, heap_in_use, (size_t) (HEAP_LIMIT - HEAP_START));
+
+        header = (struct heap_header *) heap;
+        header->size = block_size;
+        heap += sizeof(struct heap_header) + block_size;
+    }
+
+    header->generation = heap_generation;
+    header->magic = HEAP_MAGIC;
+
+    heap_in_use += block_size;
+    if (heap_in_use > heap_peak)
+        heap_peak = heap_in_use;
+
+    return header + 1;
 }
 
 void free_(void *ptr)
 {
-    (void)ptr;
+    if (!ptr)
+        return;
+
+    struct heap_header *header = (struct heap_header *) ptr - 1;
+    if (header->magic != HEAP_MAGIC)
+        fatal("free_() of invalid pointer %p", ptr);
+
+    header->magic = 0;
+    heap_in_use -= header->size;
+    put_free_block(header);
+}
+
+struct heap_mark heap_mark(void)
+{
+    struct heap_mark mark = {heap, ++heap_generation};
+    return mark;
+}
+
+static void drop_free_blocks_above(struct free_block **block, char *top)
+{
+    while (*block) {
+        if ((char *) *block >= top)
+            *block = (*block)->next;
+        else
+            block = &(*block)->next;
+    }
+}
+
+void heap_release(struct heap_mark mark)
+{
+    // Forget about free blocks that were carved out after the mark
+    for (int c = HEAP_MIN_CLASS; c <= HEAP_MAX_CLASS; c++)
+        drop_free_blocks_above(&free_lists[c], mark.top);
+    drop_free_blocks_above(&large_free_list, mark.top);
+
+    // Blocks below the mark may have been freed and reused since then. Walk
+    // them to put those back on their free lists and to recount what's
+    // still in use.
+    heap_in_use = 0;
+    for (char *p = HEAP_START; p < mark.top;) {
+        struct heap_header *header = (struct heap_header *) p;
+        if (header->magic == HEAP_MAGIC) {
+            if (header->generation >= mark.generation) {
+                header->magic = 0;
+                put_free_block(header);
+            } else {
+                heap_in_use += header->size;
+            }
+        }
+        p += sizeof(struct heap_header) + header->size;
+    }
+
+    heap = mark.top;
+}
+
+void *heap_limit(void)
+{
+    return HEAP_LIMIT;
+}
+
+void heap_report(void)
+{
+    info("Heap: %lu bytes peak, %lu bytes in use, %lu bytes carved of %lu",
+         heap_peak, heap_in_use, (size_t) (heap - HEAP_START), (size_t) (HEAP_LIMIT - HEAP_START));
 }
 
 static int char_to_digit(char c)
@@ -8,6 +8,7 @@
 #define UTIL_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define PROGRAM_NAME "little_loader"
 
@@ -48,6 +49,20 @@ void fatal(const char *fmt, ...);
 #define assert(CONDITION)
 #endif
 
+#define read_sysreg(REG) ({ uint64_t _val; asm volatile ("mrs %0, " #REG : "=r"(_val)); _val; })
+#define write_sysreg(REG, VAL) asm volatile ("msr " #REG ", %0" :: "r"((uint64_t) (VAL)))
+
+// Maximum heap size. The heap starts after the loader's stack and must end
+// before anything gets loaded.
+#ifndef HEAP_SIZE
+#define HEAP_SIZE (1024 * 1024)
+#endif
+
+struct heap_mark {
+    char *top;
+    uint32_t generation;
+};
+
 void util_init(void);
 int get_el(void);
 
@@ -68,6 +83,10 @@ size_t strlen_(const char *s);
 void putchar_(char c);
 void *malloc_(size_t size);
 void free_(void *ptr);
+struct heap_mark heap_mark(void);
+void heap_release(struct heap_mark mark);
+void *heap_limit(void);
+void heap_report(void);
 unsigned long long strtoull_(const char * str, char ** endptr, int base);
 
 #endif // UTIL_H
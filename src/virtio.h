@@ -13,45 +13,44 @@
 // Significant portions of this file come from the virtio specification
 // at https://docs.oasis-open.org/virtio/virtio/v1.3/virtio-v1.3.pdf
 
-// HACK: It could be anywhere from 0x0a000000UL to 0xa003e00 according to the dtb. I found it manually.
-//#define VIRTIO_BLK_MMIO_BASE 0xa003e00UL
-#define VIRTIO_BLK_MMIO_BASE 0xa000000UL
-
-#define REG(offset) (*(volatile uint32_t *)(VIRTIO_BLK_MMIO_BASE + (offset)))
-
-// Common MMIO header
-#define VIRT_MMIO_MAGIC         REG(0x000)
-#define VIRT_MMIO_VERSION       REG(0x004)
-#define VIRT_MMIO_DEVICE_ID     REG(0x008)
-#define VIRT_MMIO_VENDOR_ID     REG(0x00C)
-
-// Feature negotiation
-#define VIRT_MMIO_DEVICE_FEATURES     REG(0x010)
-#define VIRT_MMIO_DEVICE_FEATURES_SEL REG(0x014)
-#define VIRT_MMIO_DRIVER_FEATURES     REG(0x020)
-#define VIRT_MMIO_DRIVER_FEATURES_SEL REG(0x024)
-
-// Queue configuration
-#define VIRT_MMIO_QUEUE_SEL           REG(0x030)
-#define VIRT_MMIO_QUEUE_NUM_MAX       REG(0x034)
-#define VIRT_MMIO_QUEUE_NUM           REG(0x038)
-
-#define VIRT_MMIO_QUEUE_READY         REG(0x044)
-#define VIRT_MMIO_QUEUE_NOTIFY        REG(0x050)
-
-#define VIRT_MMIO_INTERRUPT_STATUS    REG(0x060)
-#define VIRT_MMIO_INTERRUPT_ACK       REG(0x064)
-
-#define VIRT_MMIO_STATUS              REG(0x070)
-
-#define VIRT_MMIO_QUEUE_DESC_LOW      REG(0x080)
-#define VIRT_MMIO_QUEUE_DESC_HIGH     REG(0x084)
-#define VIRT_MMIO_QUEUE_DRIVER_LOW    REG(0x090)
-#define VIRT_MMIO_QUEUE_DRIVER_HIGH   REG(0x094)
-#define VIRT_MMIO_QUEUE_DEVICE_LOW    REG(0x0A0)
-#define VIRT_MMIO_QUEUE_DEVICE_HIGH   REG(0x0A4)
-
-#define VIRT_MMIO_CONFIG_GENERATION   REG(0x0FC)
+#define VIRTIO_ID_BLOCK 2
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER      2
+#define VIRTIO_STATUS_DRIVER_OK   4
+#define VIRTIO_STATUS_FEATURES_OK 8
+
+// virtio-blk device configuration (struct virtio_blk_config). Only the
+// 32-bit aligned fields that are used are listed.
+#define VIRTIO_BLK_CONFIG_CAPACITY_LOW  0x00
+#define VIRTIO_BLK_CONFIG_CAPACITY_HIGH 0x04
+#define VIRTIO_BLK_CONFIG_SIZE_MAX      0x08
+#define VIRTIO_BLK_CONFIG_SEG_MAX       0x0C
+#define VIRTIO_BLK_CONFIG_BLK_SIZE      0x14
+#define VIRTIO_BLK_CONFIG_OPT_IO_SIZE   0x1C
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES    0x20 // Upper 16 bits
+
+// The parts of talking to a device that differ between virtio-mmio and
+// virtio-pci. Feature words are selected 32 bits at a time.
+struct virtio_transport {
+    const char *name;
+    uint32_t (*get_features)(uint32_t sel);
+    void (*set_features)(uint32_t sel, uint32_t features);
+    uint8_t (*get_status)(void);
+    void (*set_status)(uint8_t status);
+    uint32_t (*config_generation)(void);
+    uint32_t (*read_config)(uint32_t offset);
+    uint16_t (*max_queue_size)(uint16_t queue); // 0 if there's no such queue
+    void (*setup_queue)(uint16_t queue, uint16_t size, uintptr_t desc, uintptr_t driver, uintptr_t device);
+    void (*notify)(uint16_t queue);
+    void (*ack_interrupt)(void);
+    int (*find_irq)(const void *fdt); // GIC interrupt ID or < 0 if unknown
+    void (*shutdown)(void);
+};
+
+const struct virtio_transport *virtio_mmio_probe(const void *fdt, uint32_t device_id);
+const struct virtio_transport *virtio_pci_probe(const void *fdt, uint32_t device_id);
 
 #define SECTOR_SIZE          512
 
@@ -64,14 +63,40 @@
 #define VIRTIO_BLK_T_WRITE_ZEROES 13
 #define VIRTIO_BLK_T_SECURE_ERASE 14
 
-#define VIRTQ_DESC_F_NEXT  1
-#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_DESC_F_NEXT     1
+#define VIRTQ_DESC_F_WRITE    2
+#define VIRTQ_DESC_F_INDIRECT 4
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+// Packed ring descriptor flags. The driver marks a descriptor available by
+// setting AVAIL to its wrap counter and USED to the inverse. The device sets
+// both to its wrap counter when it's done.
+#define VIRTQ_DESC_F_AVAIL    (1 << 7)
+#define VIRTQ_DESC_F_USED     (1 << 15)
+
+#define RING_EVENT_FLAGS_ENABLE  0
+#define RING_EVENT_FLAGS_DISABLE 1
+#define RING_EVENT_FLAGS_DESC    2
 
 #define VIRTIO_BLK_S_OK 0
 #define VIRTIO_BLK_S_IOERR 1
 #define VIRTIO_BLK_S_UNSUPP 2
 
-#define QUEUE_SIZE 8
+#define QUEUE_SIZE 64
+
+// Maximum virtqueues used with VIRTIO_BLK_F_MQ. Each one is a QUEUE_SIZE ring.
+#define VIRTIO_BLK_MAX_QUEUES 4
+
+// Large transfers are split into chunks so that the device can work on
+// several of them at once. Without indirect descriptors, each chunk takes 3
+// descriptors, so VIRTIO_BLK_MAX_INFLIGHT * 3 must fit in QUEUE_SIZE.
+#define VIRTIO_BLK_CHUNK_SIZE   (512 * 1024)
+#define VIRTIO_BLK_MAX_INFLIGHT 16
+
+// Maximum number of data buffers in one request. With indirect descriptors,
+// the whole request only takes one descriptor in the ring.
+#define VIRTIO_BLK_MAX_SG       16
 
 struct virtq_desc {
     uint64_t addr;
@@ -99,14 +124,81 @@ struct virtq_used {
     uint16_t avail_event; /* Only if VIRTIO_F_EVENT_IDX */
 } __attribute__((packed));
 
+struct pvirtq_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} __attribute__((packed));
+
+struct pvirtq_event_suppress {
+    uint16_t off_wrap; // Descriptor offset in bits 0-14 and wrap counter in bit 15
+    uint16_t flags;
+} __attribute__((packed));
+
 struct virtio_blk_req {
     uint32_t type;
     uint32_t reserved;
     uint64_t sector;
 } __attribute__((packed));
 
-void virtio_blk_init(void);
+// One piece of a scatter-gather list
+struct virtio_blk_sg {
+    void *buffer;
+    uint32_t len_bytes;
+};
+
+// Asynchronous request. The caller owns this struct and must keep it around
+// until virtio_blk_wait() returns or `done` is set.
+//
+// Data goes to or from `buffer` unless `num_sg` is nonzero. Then it's
+// spread across the `sg` list in order and `len_bytes` is the total.
+struct virtio_blk_request {
+    uint32_t type;
+    uint64_t lba;
+    uint32_t len_bytes;
+    void *buffer;
+    const struct virtio_blk_sg *sg;
+    int num_sg;
+
+    // Filled in by the driver on completion
+    volatile int done;
+    int result;
+};
+
+// Sequential read-ahead over a range of the disk. Data is read into
+// `VIRTIO_BLK_STREAM_DEPTH` staging chunks that are handed out in order and
+// resubmitted for later data as soon as the consumer moves on.
+//
+// Direct streams read the range straight into its final location instead,
+// and the range can be changed while the stream is open.
+#define VIRTIO_BLK_STREAM_DEPTH 8
+
+struct virtio_blk_stream {
+    uint8_t *staging;
+    uint8_t *dest;       // Direct streams only
+    uint64_t start_lba;
+    uint64_t next_lba;
+    uint64_t end_lba;
+    int current;
+    struct virtio_blk_request requests[VIRTIO_BLK_STREAM_DEPTH];
+};
+
+void virtio_blk_init(const void *fdt);
+uint64_t virtio_blk_capacity(void);
+int virtio_blk_enable_irq(const void *fdt);
+void virtio_blk_shutdown(void);
+void virtio_blk_submit(struct virtio_blk_request *r);
+int virtio_blk_poll(void);
+int virtio_blk_wait(struct virtio_blk_request *r);
 int virtio_blk_read(uint64_t lba, uint32_t len_bytes, void *buffer);
 int virtio_blk_write(uint64_t lba, uint32_t len_bytes, const void *buffer);
+int virtio_blk_read_sg(uint64_t lba, const struct virtio_blk_sg *sg, int num_sg);
+
+int virtio_blk_stream_open(struct virtio_blk_stream *s, uint64_t lba, uint64_t num_sectors, uint8_t *staging);
+int virtio_blk_stream_open_direct(struct virtio_blk_stream *s, uint64_t lba, uint64_t num_sectors, uint8_t *dest);
+void virtio_blk_stream_set_length(struct virtio_blk_stream *s, uint64_t num_sectors);
+int virtio_blk_stream_next(struct virtio_blk_stream *s, const uint8_t **data);
+void virtio_blk_stream_close(struct virtio_blk_stream *s);
 
 #endif // VIRTIO_H
\ No newline at end of file
@@ -5,159 +5,998 @@
  */
 
 #include "virtio.h"
+#include "blk_cache.h"
+#include "gic.h"
 #include "util.h"
 
 #include <stdint.h>
 
-struct virtq {
-    struct virtq_desc desc[QUEUE_SIZE];
-    struct virtq_avail avail;
-    uint8_t padding[4096 - sizeof(struct virtq_desc[QUEUE_SIZE]) - sizeof(struct virtq_avail)];
-    struct virtq_used used;
-} __attribute__((aligned(16)));
-
-static volatile struct virtq_desc desc[QUEUE_SIZE] __attribute__((aligned(16)));
-static volatile struct virtq_avail avail __attribute__((aligned(2)));
-static volatile struct virtq_used used __attribute__((aligned(4)));
-static volatile struct virtio_blk_req req __attribute__((aligned(16)));
-
-static volatile uint8_t status;
+union indirect_table {
+    struct virtq_desc split[VIRTIO_BLK_MAX_SG + 2];
+    struct pvirtq_desc packed[VIRTIO_BLK_MAX_SG + 2];
+};
+
+// Everything for one virtqueue. With VIRTIO_BLK_F_MQ, requests are spread
+// round-robin across the queues so that devices with a host thread per
+// queue work on them in parallel.
+struct vq {
+    uint16_t index;
+
+    // Split ring
+    volatile struct virtq_desc desc[QUEUE_SIZE] __attribute__((aligned(16)));
+    volatile struct virtq_avail avail __attribute__((aligned(2)));
+    volatile struct virtq_used used __attribute__((aligned(4)));
+
+    // Packed ring (VIRTIO_F_RING_PACKED). Descriptors and completions share
+    // one ring that both sides walk in order, tracking laps with wrap
+    // counters.
+    volatile struct pvirtq_desc packed_ring[QUEUE_SIZE] __attribute__((aligned(16)));
+    volatile struct pvirtq_event_suppress driver_event __attribute__((aligned(4)));
+    volatile struct pvirtq_event_suppress device_event __attribute__((aligned(4)));
+
+    // Per-request state is indexed by the request's ID. That's the head
+    // descriptor with the split ring and the buffer ID with the packed ring.
+    volatile struct virtio_blk_req req_hdr[QUEUE_SIZE] __attribute__((aligned(16)));
+    volatile uint8_t req_status[QUEUE_SIZE];
+    struct virtio_blk_request *req_owner[QUEUE_SIZE];
+
+    // Indirect descriptor tables are also indexed by request ID. Each one
+    // holds the header, the data buffers and the status byte.
+    volatile union indirect_table indirect[QUEUE_SIZE] __attribute__((aligned(16)));
+
+    // Split ring: unused descriptors are linked together through their
+    // `next` fields
+    uint16_t free_head;
+    uint16_t last_used_idx;
+    uint16_t avail_shadow; // avail.idx after the next publish
+
+    // Packed ring: positions, wrap counters and IDs that aren't in use
+    uint16_t next_avail;
+    uint16_t next_used;
+    int avail_wrap;
+    int used_wrap;
+    uint16_t num_added; // Descriptors made available since the last notify
+    uint16_t chain_len[QUEUE_SIZE];
+    uint16_t free_ids[QUEUE_SIZE];
+    int num_free_ids;
+
+    uint16_t num_free;
+    int num_inflight;
+
+    // Held while changing the queue so that completions can be reaped from
+    // any CPU
+    uint8_t lock;
+};
+
+static struct vq queues[VIRTIO_BLK_MAX_QUEUES] __attribute__((aligned(16)));
+static int num_queues;
+static unsigned int next_queue;
+
+static int use_indirect;
+static int use_event_idx;
+static int use_packed;
+
+// Waits poll for up to poll_budget tries before sleeping until the device
+// interrupts. The budget shrinks when waits end up sleeping anyway and grows
+// when completions come in shortly before it runs out.
+#define POLL_BUDGET_MIN 64
+#define POLL_BUDGET_MAX 65536
+static int irq_enabled;
+static int poll_budget = POLL_BUDGET_MAX;
+
+// Limits from the device configuration
+static uint64_t capacity;          // In 512-byte sectors
+static uint32_t size_max;          // Max bytes in one buffer
+static int max_segments;           // Max buffers in one request
+static uint32_t max_request_bytes; // Max bytes in one request
+static uint32_t io_align;          // Preferred request boundaries in bytes
+
+// Chunks used by virtio_blk_read() and virtio_blk_write()
+static struct virtio_blk_request chunks[VIRTIO_BLK_MAX_INFLIGHT];
+
+static const struct virtio_transport *transport;
 
 void uart_puts(const char *s);
 
 // device feature bits
+#define VIRTIO_BLK_F_SIZE_MAX        1	/* Max size of any single segment is in size_max */
+#define VIRTIO_BLK_F_SEG_MAX         2	/* Max number of segments in a request is in seg_max */
 #define VIRTIO_BLK_F_RO              5	/* Disk is read-only */
+#define VIRTIO_BLK_F_BLK_SIZE        6	/* Block size of disk is in blk_size */
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
+#define VIRTIO_BLK_F_TOPOLOGY       10	/* Topology information is available */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
 #define VIRTIO_BLK_F_MQ             12	/* support more than one vq */
 #define VIRTIO_F_ANY_LAYOUT         27
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 #define VIRTIO_BLK_F_VERSION_1      32
+#define VIRTIO_F_RING_PACKED        34
+
+static int vq_trylock(struct vq *q)
+{
+    return !__atomic_test_and_set(&q->lock, __ATOMIC_ACQUIRE);
+}
+
+static void vq_lock(struct vq *q)
+{
+    while (!vq_trylock(q))
+        ;
+}
+
+static void vq_unlock(struct vq *q)
+{
+    __atomic_clear(&q->lock, __ATOMIC_RELEASE);
+}
+
+// Ask the device not to interrupt. Interrupts aren't used while polling.
+static void suppress_interrupts(struct vq *q)
+{
+    if (use_packed)
+        q->driver_event.flags = RING_EVENT_FLAGS_DISABLE;
+    else if (use_event_idx)
+        q->avail.used_event = q->last_used_idx + 0x8000;
+    else
+        q->avail.flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    __sync_synchronize();
+}
+
+// Ask for an interrupt on the next completion
+static void request_interrupt(struct vq *q)
+{
+    if (use_packed)
+        q->driver_event.flags = RING_EVENT_FLAGS_ENABLE;
+    else if (use_event_idx)
+        q->avail.used_event = q->last_used_idx;
+    else
+        q->avail.flags = 0;
+    __sync_synchronize();
+}
+
+// Read the config space limits. The generation counter changes if the
+// device updates the config while it's being read, so retry until it's
+// stable.
+static void read_config(uint32_t features)
+{
+    uint32_t generation;
+    uint32_t seg_max;
+    uint32_t blk_size;
+    uint32_t opt_io_size;
+    uint32_t mq_queues;
+
+    do {
+        generation = transport->config_generation();
+        capacity = transport->read_config(VIRTIO_BLK_CONFIG_CAPACITY_LOW) |
+                   ((uint64_t) transport->read_config(VIRTIO_BLK_CONFIG_CAPACITY_HIGH) << 32);
+        size_max = (features & (1 << VIRTIO_BLK_F_SIZE_MAX)) ? transport->read_config(VIRTIO_BLK_CONFIG_SIZE_MAX) : 0;
+        seg_max = (features & (1 << VIRTIO_BLK_F_SEG_MAX)) ? transport->read_config(VIRTIO_BLK_CONFIG_SEG_MAX) : 0;
+        blk_size = (features & (1 << VIRTIO_BLK_F_BLK_SIZE)) ? transport->read_config(VIRTIO_BLK_CONFIG_BLK_SIZE) : 0;
+        opt_io_size = (features & (1 << VIRTIO_BLK_F_TOPOLOGY)) ? transport->read_config(VIRTIO_BLK_CONFIG_OPT_IO_SIZE) : 0;
+        mq_queues = (features & (1 << VIRTIO_BLK_F_MQ)) ? transport->read_config(VIRTIO_BLK_CONFIG_NUM_QUEUES) >> 16 : 1;
+    } while (generation != transport->config_generation());
+
+    if (mq_queues == 0)
+        mq_queues = 1;
+    num_queues = mq_queues > VIRTIO_BLK_MAX_QUEUES ? VIRTIO_BLK_MAX_QUEUES : (int) mq_queues;
+
+    if (size_max == 0 || size_max > VIRTIO_BLK_CHUNK_SIZE)
+        size_max = VIRTIO_BLK_CHUNK_SIZE;
+    max_segments = (seg_max == 0 || seg_max > VIRTIO_BLK_MAX_SG) ? VIRTIO_BLK_MAX_SG : (int) seg_max;
+
+    uint64_t max_bytes = (uint64_t) size_max * max_segments;
+    if (max_bytes > VIRTIO_BLK_CHUNK_SIZE)
+        max_bytes = VIRTIO_BLK_CHUNK_SIZE;
+    max_request_bytes = max_bytes & ~(uint64_t) (SECTOR_SIZE - 1);
+    if (max_request_bytes == 0)
+        fatal("virtio_blk: device can't transfer a sector (size_max=%u, seg_max=%u)", size_max, seg_max);
+
+    // opt_io_size is in logical blocks. Only use it if requests can be that big.
+    if (blk_size < SECTOR_SIZE || (blk_size & (blk_size - 1)) != 0)
+        blk_size = SECTOR_SIZE;
+    io_align = blk_size;
+    if (opt_io_size && (uint64_t) opt_io_size * blk_size <= max_request_bytes)
+        io_align = opt_io_size * blk_size;
+}
+
+uint64_t virtio_blk_capacity(void)
+{
+    return capacity;
+}
 
-void virtio_blk_init(void) {
-    // This section is a bit of a hack and really should scan for device 2.
-    if (VIRT_MMIO_MAGIC != 0x74726976 ||
-        VIRT_MMIO_VERSION != 2 ||
-        VIRT_MMIO_DEVICE_ID != 2 ||
-        VIRT_MMIO_VENDOR_ID != 0x554d4551)
+static void init_queue(struct vq *q, uint16_t index)
+{
+    memset_(q, 0, sizeof(*q));
+    q->index = index;
+    q->num_free = QUEUE_SIZE;
+
+    uintptr_t ring_desc, ring_driver, ring_device;
+    if (use_packed) {
+        for (int i = 0; i < QUEUE_SIZE; i++)
+            q->free_ids[i] = QUEUE_SIZE - 1 - i;
+        q->num_free_ids = QUEUE_SIZE;
+        q->avail_wrap = 1;
+        q->used_wrap = 1;
+
+        ring_desc = (uintptr_t)&q->packed_ring;
+        ring_driver = (uintptr_t)&q->driver_event;
+        ring_device = (uintptr_t)&q->device_event;
+    } else {
+        for (int i = 0; i < QUEUE_SIZE - 1; i++)
+            q->desc[i].next = i + 1;
+
+        ring_desc = (uintptr_t)&q->desc;
+        ring_driver = (uintptr_t)&q->avail;
+        ring_device = (uintptr_t)&q->used;
+    }
+    suppress_interrupts(q);
+    transport->setup_queue(index, QUEUE_SIZE, ring_desc, ring_driver, ring_device);
+}
+
+static int read_cache_blocks(uint64_t lba, const struct virtio_blk_sg *sg, int num_sg);
+
+void virtio_blk_init(const void *fdt) {
+    // Prefer PCIe when both kinds of device are present
+    transport = virtio_pci_probe(fdt, VIRTIO_ID_BLOCK);
+    if (!transport)
+        transport = virtio_mmio_probe(fdt, VIRTIO_ID_BLOCK);
+    if (!transport)
         fatal("Couldn't find a virtio blk device.\n\n"
             "Check the QEMU command line for the following:\n"
             "\n"
             "    -global virtio-mmio.force-legacy=false\n"
             "    -drive if=none,file=disk.img,format=raw,id=vdisk\n"
-            "    -device virtio-blk-device,drive=vdisk,bus=virtio-mmio-bus.0\n");
+            "    -device virtio-blk-device,drive=vdisk\n"
+            "\n"
+            "or for PCIe:\n"
+            "\n"
+            "    -device virtio-blk-pci,drive=vdisk\n");
 
-    uint32_t mmio_status = 0;
-    VIRT_MMIO_STATUS = mmio_status; // RESET
+    uint8_t status = 0;
+    transport->set_status(status); // RESET
 
-    mmio_status |= 1; // ACKNOWLEDGE
-    VIRT_MMIO_STATUS = mmio_status;
+    status |= VIRTIO_STATUS_ACKNOWLEDGE;
+    transport->set_status(status);
 
-    mmio_status |= 2; // DRIVER
-    VIRT_MMIO_STATUS = mmio_status;
+    status |= VIRTIO_STATUS_DRIVER;
+    transport->set_status(status);
 
     // Read and mask unsupported features
-    VIRT_MMIO_DEVICE_FEATURES_SEL = 0;
-    uint32_t features = VIRT_MMIO_DEVICE_FEATURES;
+    uint32_t features = transport->get_features(0);
     features &= ~(1 << VIRTIO_BLK_F_RO);
     features &= ~(1 << VIRTIO_BLK_F_SCSI);
     features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-    features &= ~(1 << VIRTIO_BLK_F_MQ);
     features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-    features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-    features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
-    VIRT_MMIO_DRIVER_FEATURES_SEL = 0;
-    VIRT_MMIO_DRIVER_FEATURES = features;
+    transport->set_features(0, features);
+    use_indirect = (features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+    use_event_idx = (features & (1 << VIRTIO_RING_F_EVENT_IDX)) != 0;
+    read_config(features);
 
-    VIRT_MMIO_DEVICE_FEATURES_SEL = 1;
-    features = VIRT_MMIO_DEVICE_FEATURES;
-    features &= (1 << (VIRTIO_BLK_F_VERSION_1 - 32));
-    VIRT_MMIO_DRIVER_FEATURES_SEL = 1;
-    VIRT_MMIO_DRIVER_FEATURES = features;
+    features = transport->get_features(1);
+    features &= (1 << (VIRTIO_BLK_F_VERSION_1 - 32)) | (1 << (VIRTIO_F_RING_PACKED - 32));
+    transport->set_features(1, features);
+    use_packed = (features & (1 << (VIRTIO_F_RING_PACKED - 32))) != 0;
 
-    mmio_status |= 8; // FEATURES_OK
-    VIRT_MMIO_STATUS = mmio_status;
+    status |= VIRTIO_STATUS_FEATURES_OK;
+    transport->set_status(status);
 
-    if (VIRT_MMIO_STATUS & 8 == 0)
+    if ((transport->get_status() & VIRTIO_STATUS_FEATURES_OK) == 0)
         fatal("virtio disk didn't like our feature selection?\n");
 
-    VIRT_MMIO_QUEUE_SEL = 0;
-    if (VIRT_MMIO_QUEUE_READY != 0)
-        fatal("virtio disk queue in use?\n");
-
-    if (VIRT_MMIO_QUEUE_NUM_MAX < QUEUE_SIZE)
+    if (transport->max_queue_size(0) < QUEUE_SIZE)
         fatal("virtio disk queue num max too low?\n");
 
-    VIRT_MMIO_QUEUE_NUM = QUEUE_SIZE;
+    // Extra queues that are too small are left unused
+    for (int i = 1; i < num_queues; i++) {
+        if (transport->max_queue_size(i) < QUEUE_SIZE) {
+            num_queues = i;
+            break;
+        }
+    }
 
-    memset_((void*) &desc, 0, sizeof(desc));
-    memset_((void*) &avail, 0, sizeof(avail));
-    memset_((void*) &used, 0, sizeof(used));
-    memset_((void*) &req, 0, sizeof(req));
+    for (int i = 0; i < num_queues; i++)
+        init_queue(&queues[i], i);
+    next_queue = 0;
 
-    VIRT_MMIO_QUEUE_DESC_LOW  = (uintptr_t)&desc >> 0;
-    VIRT_MMIO_QUEUE_DESC_HIGH = (uintptr_t)&desc >> 32;
+    // Cache misses are one request, so each block has to fit in whole
+    // segments
+    int segments_per_block = (BLK_CACHE_BLOCK_SIZE + size_max - 1) / size_max;
+    blk_cache_init(capacity, max_segments / segments_per_block, read_cache_blocks);
 
-    VIRT_MMIO_QUEUE_DRIVER_LOW  = (uintptr_t)&avail >> 0;
-    VIRT_MMIO_QUEUE_DRIVER_HIGH = (uintptr_t)&avail >> 32;
+    status |= VIRTIO_STATUS_DRIVER_OK;
+    transport->set_status(status);
+}
 
-    VIRT_MMIO_QUEUE_DEVICE_LOW   = (uintptr_t)&used >> 0;
-    VIRT_MMIO_QUEUE_DEVICE_HIGH  = (uintptr_t)&used >> 32;
+// Reset the device so that nothing is left running for Linux
+void virtio_blk_shutdown(void)
+{
+    if (transport)
+        transport->shutdown();
+}
 
-    VIRT_MMIO_QUEUE_READY = 1;
-    mmio_status |= 4; // DRIVER_OK
-    VIRT_MMIO_STATUS = mmio_status;
+static uint16_t alloc_desc(struct vq *q)
+{
+    uint16_t d = q->free_head;
+    q->free_head = q->desc[d].next;
+    q->num_free--;
+    return d;
 }
 
-static int do_virtio_blk_io(uint32_t type, uint64_t lba, uint32_t len_bytes, void *buffer) {
-    req.type = type;
-    req.reserved = 0;
-    req.sector = lba;
-
-    desc[0].addr = (uintptr_t)&req;
-    desc[0].len = sizeof(req);
-    desc[0].flags = VIRTQ_DESC_F_NEXT;
-    desc[0].next = 1;
-
-    desc[1].addr = (uintptr_t)buffer;
-    desc[1].len = len_bytes;
-    if (type == VIRTIO_BLK_T_IN) {
-        desc[1].flags = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
+static void free_desc_chain(struct vq *q, uint16_t head)
+{
+    uint16_t d = head;
+    q->num_free++;
+    while (q->desc[d].flags & VIRTQ_DESC_F_NEXT) {
+        d = q->desc[d].next;
+        q->num_free++;
+    }
+    q->desc[d].next = q->free_head;
+    q->free_head = head;
+}
+
+// One descriptor's worth of a request before it's written to a ring
+struct desc_seg {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+};
+
+// Describe the request header, the data buffers split at size_max and the
+// status byte. NEXT flags are added when the descriptors are written out.
+static int build_segments(struct vq *q, const struct virtio_blk_request *r, uint16_t id, struct desc_seg *segs)
+{
+    const struct virtio_blk_sg one = {r->buffer, r->len_bytes};
+    const struct virtio_blk_sg *sg = r->num_sg ? r->sg : &one;
+    int num_sg = r->num_sg ? r->num_sg : 1;
+    uint16_t data_flags = (r->type == VIRTIO_BLK_T_IN) ? VIRTQ_DESC_F_WRITE : 0;
+    int n = 0;
+
+    segs[n].addr = (uintptr_t)&q->req_hdr[id];
+    segs[n].len = sizeof(struct virtio_blk_req);
+    segs[n].flags = 0;
+    n++;
+
+    for (int j = 0; j < num_sg; j++) {
+        uint8_t *p = sg[j].buffer;
+        uint32_t left = sg[j].len_bytes;
+        do {
+            uint32_t len = left < size_max ? left : size_max;
+            segs[n].addr = (uintptr_t)p;
+            segs[n].len = len;
+            segs[n].flags = data_flags;
+            n++;
+            p += len;
+            left -= len;
+        } while (left);
+    }
+
+    segs[n].addr = (uintptr_t)&q->req_status[id];
+    segs[n].len = 1;
+    segs[n].flags = VIRTQ_DESC_F_WRITE;
+    return n + 1;
+}
+
+static void write_split(struct vq *q, uint16_t head, const struct desc_seg *segs, int n)
+{
+    if (use_indirect) {
+        volatile struct virtq_desc *t = q->indirect[head].split;
+        for (int i = 0; i < n; i++) {
+            t[i].addr = segs[i].addr;
+            t[i].len = segs[i].len;
+            t[i].flags = segs[i].flags | (i + 1 < n ? VIRTQ_DESC_F_NEXT : 0);
+            t[i].next = i + 1;
+        }
+
+        q->desc[head].addr = (uintptr_t)t;
+        q->desc[head].len = n * sizeof(struct virtq_desc);
+        q->desc[head].flags = VIRTQ_DESC_F_INDIRECT;
     } else {
-        desc[1].flags = VIRTQ_DESC_F_NEXT;
+        uint16_t d = head;
+        for (int i = 0; i < n; i++) {
+            q->desc[d].addr = segs[i].addr;
+            q->desc[d].len = segs[i].len;
+            q->desc[d].flags = segs[i].flags;
+            if (i + 1 < n) {
+                uint16_t next = alloc_desc(q);
+                q->desc[d].flags |= VIRTQ_DESC_F_NEXT;
+                q->desc[d].next = next;
+                d = next;
+            }
+        }
+    }
+
+    // The device doesn't see this until notify_queue() publishes it
+    q->avail.ring[q->avail_shadow & (QUEUE_SIZE - 1)] = head;
+    q->avail_shadow++;
+}
+
+// Packed ring descriptors become visible to the device as soon as the head's
+// flags are written, so those are written last.
+static void write_packed_ring(struct vq *q, uint16_t id, const struct desc_seg *segs, int n)
+{
+    uint16_t head = q->next_avail;
+    uint16_t head_flags = 0;
+
+    for (int i = 0; i < n; i++) {
+        uint16_t flags = segs[i].flags | (i + 1 < n ? VIRTQ_DESC_F_NEXT : 0) |
+                         (q->avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED);
+        q->packed_ring[q->next_avail].addr = segs[i].addr;
+        q->packed_ring[q->next_avail].len = segs[i].len;
+        q->packed_ring[q->next_avail].id = id;
+        if (i == 0)
+            head_flags = flags;
+        else
+            q->packed_ring[q->next_avail].flags = flags;
+
+        if (++q->next_avail == QUEUE_SIZE) {
+            q->next_avail = 0;
+            q->avail_wrap ^= 1;
+        }
+    }
+
+    __sync_synchronize();
+    q->packed_ring[head].flags = head_flags;
+    q->chain_len[id] = n;
+    q->num_added += n;
+}
+
+static void write_packed(struct vq *q, uint16_t id, const struct desc_seg *segs, int n)
+{
+    if (use_indirect) {
+        // Indirect tables are read in order, so NEXT isn't used
+        volatile struct pvirtq_desc *t = q->indirect[id].packed;
+        for (int i = 0; i < n; i++) {
+            t[i].addr = segs[i].addr;
+            t[i].len = segs[i].len;
+            t[i].id = 0;
+            t[i].flags = segs[i].flags;
+        }
+
+        struct desc_seg table = {(uintptr_t)t, n * sizeof(struct pvirtq_desc), VIRTQ_DESC_F_INDIRECT};
+        write_packed_ring(q, id, &table, 1);
+    } else {
+        write_packed_ring(q, id, segs, n);
+    }
+}
+
+// Number of data descriptors after splitting buffers at size_max
+static int count_segments(const struct virtio_blk_request *r)
+{
+    if (r->num_sg == 0)
+        return r->len_bytes ? (r->len_bytes + size_max - 1) / size_max : 1;
+
+    int count = 0;
+    for (int i = 0; i < r->num_sg; i++)
+        count += r->sg[i].len_bytes ? (r->sg[i].len_bytes + size_max - 1) / size_max : 1;
+    return count;
+}
+
+// From the virtio spec: true if `event_idx` is in [old_idx, new_idx)
+static int need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t) (new_idx - event_idx - 1) < (uint16_t) (new_idx - old_idx);
+}
+
+// Publish everything queued since the last call with one avail.idx update
+// and notify the device. With EVENT_IDX, the device says which index it
+// wants to hear about, so the MMIO write (a VM exit) is skipped while the
+// device is still working through the ring.
+static void notify_split(struct vq *q)
+{
+    uint16_t old_idx = q->avail.idx;
+    if (old_idx == q->avail_shadow)
+        return;
+
+    // The descriptors need to be visible before the index update and the
+    // index update needs to be visible before checking avail_event.
+    __sync_synchronize();
+    q->avail.idx = q->avail_shadow;
+    __sync_synchronize();
+
+    if (!use_event_idx || need_event(q->used.avail_event, q->avail_shadow, old_idx))
+        transport->notify(q->index);
+}
+
+// The packed ring equivalent. The device's event suppression structure can
+// turn notifications off or ask for one at a particular descriptor.
+static void notify_packed(struct vq *q)
+{
+    if (q->num_added == 0)
+        return;
+
+    uint16_t old_idx = q->next_avail - q->num_added;
+    q->num_added = 0;
+
+    // The descriptors need to be visible before checking the device's request
+    __sync_synchronize();
+    uint16_t flags = q->device_event.flags;
+    uint16_t off_wrap = q->device_event.off_wrap;
+
+    if (flags == RING_EVENT_FLAGS_DISABLE)
+        return;
+    if (flags == RING_EVENT_FLAGS_DESC) {
+        uint16_t event_idx = off_wrap & 0x7fff;
+        if ((off_wrap >> 15) != q->avail_wrap)
+            event_idx -= QUEUE_SIZE;
+        if (!need_event(event_idx, q->next_avail, old_idx))
+            return;
     }
-    desc[1].next = 2;
+    transport->notify(q->index);
+}
+
+static void notify_queue(struct vq *q)
+{
+    if (use_packed)
+        notify_packed(q);
+    else
+        notify_split(q);
+}
+
+static void notify_device(void)
+{
+    for (int i = 0; i < num_queues; i++) {
+        vq_lock(&queues[i]);
+        notify_queue(&queues[i]);
+        vq_unlock(&queues[i]);
+    }
+}
+
+// Take the next completed request off the used ring. Returns 0 if there
+// isn't one.
+static int next_used_split(struct vq *q, uint16_t *id)
+{
+    if (q->last_used_idx == q->used.idx)
+        return 0;
+
+    // Don't read the ring entry until after seeing the index update
+    __sync_synchronize();
+
+    *id = q->used.ring[q->last_used_idx & (QUEUE_SIZE - 1)].id;
+    free_desc_chain(q, *id);
+    q->last_used_idx++;
+    return 1;
+}
+
+static int packed_used_pending(struct vq *q)
+{
+    uint16_t flags = q->packed_ring[q->next_used].flags;
+    int avail_bit = (flags & VIRTQ_DESC_F_AVAIL) != 0;
+    int used_bit = (flags & VIRTQ_DESC_F_USED) != 0;
+    return avail_bit == used_bit && used_bit == q->used_wrap;
+}
+
+static int used_pending(struct vq *q)
+{
+    return use_packed ? packed_used_pending(q) : q->used.idx != q->last_used_idx;
+}
 
-    status = 0xff; // device writes 0 on success
-    desc[2].addr = (uintptr_t)&status;
-    desc[2].len = 1;
-    desc[2].flags = VIRTQ_DESC_F_WRITE;
-    desc[2].next = 0;
+// The device writes one used descriptor per request at the position of the
+// request's first descriptor, so skip over the rest of its chain.
+static int next_used_packed(struct vq *q, uint16_t *id)
+{
+    if (!packed_used_pending(q))
+        return 0;
 
-    uint16_t idx = avail.idx & (QUEUE_SIZE-1);
-    avail.ring[idx] = 0;
-    avail.idx++;
-    used.idx = 0;
-    used.flags = 0;
+    // Don't read the ID until after seeing the flags update
+    __sync_synchronize();
 
-    VIRT_MMIO_QUEUE_NOTIFY = 0;
+    *id = q->packed_ring[q->next_used].id;
+    q->next_used += q->chain_len[*id];
+    if (q->next_used >= QUEUE_SIZE) {
+        q->next_used -= QUEUE_SIZE;
+        q->used_wrap ^= 1;
+    }
+    q->num_free += q->chain_len[*id];
+    q->free_ids[q->num_free_ids++] = *id;
+    return 1;
+}
+
+// Complete everything on the queue's used ring. The queue must be locked.
+static int reap_queue(struct vq *q)
+{
+    int completed = 0;
 
     __sync_synchronize();
-    while (status == 0xff) {
-      __sync_synchronize();
+    uint16_t id;
+    while (use_packed ? next_used_packed(q, &id) : next_used_split(q, &id)) {
+        struct virtio_blk_request *r = q->req_owner[id];
+        uint8_t status = q->req_status[id];
+
+        q->req_owner[id] = NULL;
+        q->num_inflight--;
+        completed++;
+
+        if (r) {
+            r->result = (status == VIRTIO_BLK_S_OK) ? (int) r->len_bytes : -status;
+
+            // The waiter may be on another CPU
+            __sync_synchronize();
+            r->done = 1;
+        }
+    }
+    return completed;
+}
+
+// Add a request to the next queue's available ring without telling the device
+static void queue_request(struct virtio_blk_request *r)
+{
+    int num_sg = count_segments(r);
+    if (num_sg > max_segments)
+        fatal("virtio_blk: too many buffers in request (%d > %d)", num_sg, max_segments);
+
+    struct vq *q = &queues[__atomic_fetch_add(&next_queue, 1, __ATOMIC_RELAXED) % num_queues];
+    vq_lock(q);
+
+    // Reap completed requests until there are enough descriptors
+    int needed = use_indirect ? 1 : num_sg + 2;
+    while (q->num_free < needed) {
+        if (q->num_inflight == 0)
+            fatal("virtio descriptor leak");
+        notify_queue(q);
+        reap_queue(q);
+    }
+
+    uint16_t id;
+    if (use_packed) {
+        id = q->free_ids[--q->num_free_ids];
+        q->num_free -= needed;
+    } else {
+        id = alloc_desc(q);
     }
 
-    if (status == VIRTIO_BLK_S_OK)
+    q->req_hdr[id].type = r->type;
+    q->req_hdr[id].reserved = 0;
+    q->req_hdr[id].sector = r->lba;
+    q->req_status[id] = 0xff; // device writes 0 on success
+    q->req_owner[id] = r;
+    r->done = 0;
+    r->result = 0;
+
+    struct desc_seg segs[VIRTIO_BLK_MAX_SG + 2];
+    int n = build_segments(q, r, id, segs);
+    if (use_packed)
+        write_packed(q, id, segs, n);
+    else
+        write_split(q, id, segs, n);
+    q->num_inflight++;
+
+    vq_unlock(q);
+}
+
+void virtio_blk_submit(struct virtio_blk_request *r)
+{
+    queue_request(r);
+    notify_device();
+}
+
+// Complete whatever the device has finished. This can be called from any
+// CPU. Queues that another CPU is working on are skipped.
+//
+// Only the boot CPU calls this, though. Secondary CPUs sleep in `wfe`
+// between SMP jobs, and a completion doesn't wake them, so reaping there
+// would mean spinning on the used rings and keeping a host CPU busy. Reaping
+// is only a few loads and stores per request, and the boot CPU is the one
+// waiting for the data anyway.
+int virtio_blk_poll(void)
+{
+    int completed = 0;
+
+    for (int i = 0; i < num_queues; i++) {
+        struct vq *q = &queues[i];
+        if (!vq_trylock(q))
+            continue;
+
+        // Make sure that the device knows about what's being waited on
+        notify_queue(q);
+        completed += reap_queue(q);
+        vq_unlock(q);
+    }
+    return completed;
+}
+
+// Sleep until the device interrupts and then clear its interrupt. All
+// queues share the interrupt.
+static void wait_for_irq(void)
+{
+    int pending = 0;
+
+    // If a completion slipped in before the interrupt request was visible,
+    // there won't be an interrupt for it.
+    for (int i = 0; i < num_queues; i++) {
+        vq_lock(&queues[i]);
+        request_interrupt(&queues[i]);
+        pending |= used_pending(&queues[i]);
+        vq_unlock(&queues[i]);
+    }
+    int intid = pending ? -1 : gic_wait();
+    transport->ack_interrupt();
+    if (intid >= 0)
+        gic_eoi(intid);
+
+    for (int i = 0; i < num_queues; i++) {
+        vq_lock(&queues[i]);
+        suppress_interrupts(&queues[i]);
+        vq_unlock(&queues[i]);
+    }
+}
+
+int virtio_blk_wait(struct virtio_blk_request *r)
+{
+    int spins = 0;
+    int slept = 0;
+
+    while (!r->done) {
+        if (virtio_blk_poll() || !irq_enabled)
+            continue;
+
+        if (++spins > poll_budget) {
+            wait_for_irq();
+            slept = 1;
+        }
+    }
+
+    if (slept) {
+        if (poll_budget > POLL_BUDGET_MIN)
+            poll_budget /= 2;
+    } else if (spins > poll_budget / 2 && poll_budget < POLL_BUDGET_MAX) {
+        poll_budget *= 2;
+    }
+
+    return r->result;
+}
+
+// Switch from busy polling to sleeping on the device's interrupt when
+// waits take a while. This only does something when built with VIRTIO_IRQ=1.
+int virtio_blk_enable_irq(const void *fdt)
+{
+#ifdef VIRTIO_IRQ
+    OK_OR_RETURN(gic_init(fdt));
+
+    int intid = transport->find_irq(fdt);
+    if (intid < 0)
+        ERR_RETURN("virtio_blk: can't find %s interrupt in DTB", transport->name);
+    OK_OR_RETURN_MSG(gic_enable_spi(intid), "virtio_blk: can't enable interrupt %d", intid);
+
+    // Clear anything left from before
+    transport->ack_interrupt();
+    irq_enabled = 1;
+    info("virtio_blk: sleeping on interrupt %d", intid);
+#else
+    (void) fdt;
+#endif
+    return 0;
+}
+
+// Size the next request starting at `lba`. Requests that aren't the last
+// one end on an io_align boundary so that later ones start aligned.
+static uint32_t request_len(uint64_t lba, uint64_t remaining)
+{
+    if (remaining <= max_request_bytes)
+        return remaining;
+
+    uint64_t start = lba * SECTOR_SIZE;
+    uint64_t end = (start + max_request_bytes) / io_align * io_align;
+    return end > start ? end - start : max_request_bytes;
+}
+
+static int check_range(uint64_t lba, uint64_t len_bytes)
+{
+    uint64_t sectors = (len_bytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (lba > capacity || sectors > capacity - lba)
+        ERR_RETURN("virtio_blk: access to LBA %lu+%lu is past the end of the disk (%lu sectors)", lba, sectors, capacity);
+    return 0;
+}
+
+static int do_virtio_blk_io(uint32_t type, uint64_t lba, uint32_t len_bytes, void *buffer) {
+    uint8_t *p = buffer;
+    uint32_t offset = 0;
+    int submitted = 0;
+    int rc = 0;
+
+    OK_OR_RETURN(check_range(lba, len_bytes));
+
+    // Keep up to VIRTIO_BLK_MAX_INFLIGHT chunks queued. Chunks are reused
+    // round-robin, so wait on the oldest one before resubmitting it. The
+    // device is notified once for each batch when the wait polls.
+    while (offset < len_bytes) {
+        struct virtio_blk_request *r = &chunks[submitted % VIRTIO_BLK_MAX_INFLIGHT];
+        if (submitted >= VIRTIO_BLK_MAX_INFLIGHT) {
+            int result = virtio_blk_wait(r);
+            if (result < 0) {
+                rc = result;
+                break;
+            }
+        }
+
+        uint32_t len = request_len(lba + offset / SECTOR_SIZE, len_bytes - offset);
+
+        r->type = type;
+        r->lba = lba + offset / SECTOR_SIZE;
+        r->len_bytes = len;
+        r->buffer = p + offset;
+        r->num_sg = 0;
+        queue_request(r);
+
+        submitted++;
+        offset += len;
+    }
+
+    // Wait for everything outstanding even on error since the device still
+    // owns those buffers.
+    int first = submitted > VIRTIO_BLK_MAX_INFLIGHT ? submitted - VIRTIO_BLK_MAX_INFLIGHT : 0;
+    for (int i = first; i < submitted; i++) {
+        int result = virtio_blk_wait(&chunks[i % VIRTIO_BLK_MAX_INFLIGHT]);
+        if (result < 0 && rc == 0)
+            rc = result;
+    }
+
+    if (rc < 0)
+        return rc;
+    else
         return len_bytes;
+}
+
+// Cache misses read all their blocks with one scatter-gather request. A
+// single block may need to be split if the device's limits are small.
+static int read_cache_blocks(uint64_t lba, const struct virtio_blk_sg *sg, int num_sg)
+{
+    if (num_sg == 1)
+        return do_virtio_blk_io(VIRTIO_BLK_T_IN, lba, sg[0].len_bytes, sg[0].buffer);
     else
-        return -status;
+        return virtio_blk_read_sg(lba, sg, num_sg);
 }
 
+// Small reads go through the block cache. Large ones use whatever leading
+// blocks are cached and read the rest from the disk directly.
 int virtio_blk_read(uint64_t lba, uint32_t len_bytes, void *buffer) {
-    return do_virtio_blk_io(VIRTIO_BLK_T_IN, lba, len_bytes, buffer);
+    uint8_t *p = buffer;
+
+    OK_OR_RETURN(check_range(lba, len_bytes));
+
+    int offset = blk_cache_read(lba, len_bytes, buffer);
+    if (offset < 0)
+        return offset;
+    if ((uint32_t) offset < len_bytes) {
+        int rc = do_virtio_blk_io(VIRTIO_BLK_T_IN, lba + offset / SECTOR_SIZE, len_bytes - offset, p + offset);
+        if (rc < 0)
+            return rc;
+    }
+    return len_bytes;
 }
 
 int virtio_blk_write(uint64_t lba, uint32_t len_bytes, const void *buffer) {
+    blk_cache_invalidate(lba, len_bytes);
     return do_virtio_blk_io(VIRTIO_BLK_T_OUT, lba, len_bytes, (void *)buffer);
 }
+
+// Read consecutive sectors into several buffers with one request. Each
+// buffer should be a multiple of SECTOR_SIZE.
+int virtio_blk_read_sg(uint64_t lba, const struct virtio_blk_sg *sg, int num_sg)
+{
+    struct virtio_blk_request r;
+
+    r.type = VIRTIO_BLK_T_IN;
+    r.lba = lba;
+    r.len_bytes = 0;
+    for (int i = 0; i < num_sg; i++)
+        r.len_bytes += sg[i].len_bytes;
+    OK_OR_RETURN(check_range(lba, r.len_bytes));
+    r.buffer = NULL;
+    r.sg = sg;
+    r.num_sg = num_sg;
+    virtio_blk_submit(&r);
+    return virtio_blk_wait(&r);
+}
+
+static void stream_submit(struct virtio_blk_stream *s, int i)
+{
+    struct virtio_blk_request *r = &s->requests[i];
+
+    // A zero length marks the end of the range
+    r->len_bytes = 0;
+    if (s->next_lba >= s->end_lba)
+        return;
+
+    r->len_bytes = request_len(s->next_lba, (s->end_lba - s->next_lba) * SECTOR_SIZE);
+    uint64_t sectors = r->len_bytes / SECTOR_SIZE;
+    if (sectors == 0)
+        return;
+
+    r->type = VIRTIO_BLK_T_IN;
+    r->lba = s->next_lba;
+    if (s->dest)
+        r->buffer = s->dest + (s->next_lba - s->start_lba) * SECTOR_SIZE;
+    else
+        r->buffer = s->staging + i * VIRTIO_BLK_CHUNK_SIZE;
+    r->num_sg = 0;
+    queue_request(r);
+    s->next_lba += sectors;
+}
+
+static int stream_open(struct virtio_blk_stream *s, uint64_t lba, uint64_t num_sectors, uint8_t *staging, uint8_t *dest)
+{
+    OK_OR_RETURN(check_range(lba, SECTOR_SIZE));
+    if (num_sectors > capacity - lba)
+        num_sectors = capacity - lba;
+
+    s->staging = staging;
+    s->dest = dest;
+    s->start_lba = lba;
+    s->next_lba = lba;
+    s->end_lba = lba + num_sectors;
+    s->current = -1;
+
+    for (int i = 0; i < VIRTIO_BLK_STREAM_DEPTH; i++)
+        stream_submit(s, i);
+    notify_device();
+    return 0;
+}
+
+// `staging` must hold VIRTIO_BLK_STREAM_DEPTH * VIRTIO_BLK_CHUNK_SIZE bytes.
+// Read-ahead stops at the end of the disk, but the start has to be on it.
+int virtio_blk_stream_open(struct virtio_blk_stream *s, uint64_t lba, uint64_t num_sectors, uint8_t *staging)
+{
+    return stream_open(s, lba, num_sectors, staging, NULL);
+}
+
+// Read the range into `dest`. This is for when the length isn't known until
+// the first data arrives. Open with an upper bound and then fix it with
+// virtio_blk_stream_set_length(). `dest` must have room for the upper bound.
+int virtio_blk_stream_open_direct(struct virtio_blk_stream *s, uint64_t lba, uint64_t num_sectors, uint8_t *dest)
+{
+    return stream_open(s, lba, num_sectors, NULL, dest);
+}
+
+// Change where a direct stream ends. Reads that were already started past
+// the new end still complete, but they aren't returned. Extending the range
+// only works before virtio_blk_stream_next() has returned 0.
+void virtio_blk_stream_set_length(struct virtio_blk_stream *s, uint64_t num_sectors)
+{
+    if (num_sectors > capacity - s->start_lba)
+        num_sectors = capacity - s->start_lba;
+    s->end_lba = s->start_lba + num_sectors;
+}
+
+// Wait for the next chunk. Returns its length, 0 at the end of the range, or
+// < 0 on error. The data is valid until the next call.
+int virtio_blk_stream_next(struct virtio_blk_stream *s, const uint8_t **data)
+{
+    // The previous chunk has been consumed, so reuse it for read-ahead
+    if (s->current >= 0) {
+        stream_submit(s, s->current);
+        notify_device();
+    }
+
+    s->current = (s->current + 1) % VIRTIO_BLK_STREAM_DEPTH;
+    struct virtio_blk_request *r = &s->requests[s->current];
+    if (r->len_bytes == 0)
+        return 0;
+
+    // Reads past a shortened end still have to finish before the request
+    // can be reused.
+    int rc = virtio_blk_wait(r);
+    if (r->lba >= s->end_lba)
+        return 0;
+    if (rc < 0)
+        ERR_RETURN("virtio_blk: read of LBA %lu failed (%d)", r->lba, rc);
+
+    // Small reads of the start, like the kernel header, can then come from
+    // the cache without going back to the disk
+    if (r->lba == s->start_lba)
+        blk_cache_insert(r->lba, r->len_bytes, r->buffer);
+
+    *data = r->buffer;
+    return (int) r->len_bytes;
+}
+
+// Stop reading ahead. This waits for outstanding reads since the device
+// still owns their buffers.
+void virtio_blk_stream_close(struct virtio_blk_stream *s)
+{
+    for (int i = 0; i < VIRTIO_BLK_STREAM_DEPTH; i++) {
+        struct virtio_blk_request *r = &s->requests[i];
+        if (r->len_bytes)
+            virtio_blk_wait(r);
+        r->len_bytes = 0;
+    }
+    s->end_lba = s->next_lba;
+}
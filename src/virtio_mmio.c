@@ -0,0 +1,204 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "virtio.h"
+#include "dt.h"
+#include "util.h"
+#include "libfdt/libfdt.h"
+
+// virtio-mmio transport (virtio spec section 4.2)
+
+// Without a DTB, the QEMU virt machine's 32 transport slots are scanned
+#define VIRTIO_MMIO_DEFAULT_BASE  0xa000000UL
+#define VIRTIO_MMIO_DEFAULT_SLOTS 32
+#define VIRTIO_MMIO_SLOT_SIZE     0x200
+
+#define VIRTIO_MMIO_MAGIC_VALUE   0x74726976 // "virt"
+
+static uintptr_t mmio_base;
+
+#define REG(offset) (*(volatile uint32_t *)(mmio_base + (offset)))
+
+// Common MMIO header
+#define VIRT_MMIO_MAGIC         REG(0x000)
+#define VIRT_MMIO_VERSION       REG(0x004)
+#define VIRT_MMIO_DEVICE_ID     REG(0x008)
+#define VIRT_MMIO_VENDOR_ID     REG(0x00C)
+
+// Feature negotiation
+#define VIRT_MMIO_DEVICE_FEATURES     REG(0x010)
+#define VIRT_MMIO_DEVICE_FEATURES_SEL REG(0x014)
+#define VIRT_MMIO_DRIVER_FEATURES     REG(0x020)
+#define VIRT_MMIO_DRIVER_FEATURES_SEL REG(0x024)
+
+// Queue configuration
+#define VIRT_MMIO_QUEUE_SEL           REG(0x030)
+#define VIRT_MMIO_QUEUE_NUM_MAX       REG(0x034)
+#define VIRT_MMIO_QUEUE_NUM           REG(0x038)
+
+#define VIRT_MMIO_QUEUE_READY         REG(0x044)
+#define VIRT_MMIO_QUEUE_NOTIFY        REG(0x050)
+
+#define VIRT_MMIO_INTERRUPT_STATUS    REG(0x060)
+#define VIRT_MMIO_INTERRUPT_ACK       REG(0x064)
+
+#define VIRT_MMIO_STATUS              REG(0x070)
+
+#define VIRT_MMIO_QUEUE_DESC_LOW      REG(0x080)
+#define VIRT_MMIO_QUEUE_DESC_HIGH     REG(0x084)
+#define VIRT_MMIO_QUEUE_DRIVER_LOW    REG(0x090)
+#define VIRT_MMIO_QUEUE_DRIVER_HIGH   REG(0x094)
+#define VIRT_MMIO_QUEUE_DEVICE_LOW    REG(0x0A0)
+#define VIRT_MMIO_QUEUE_DEVICE_HIGH   REG(0x0A4)
+
+#define VIRT_MMIO_CONFIG_GENERATION   REG(0x0FC)
+#define VIRT_MMIO_CONFIG(offset)      REG(0x100 + (offset))
+
+static uint32_t mmio_get_features(uint32_t sel)
+{
+    VIRT_MMIO_DEVICE_FEATURES_SEL = sel;
+    return VIRT_MMIO_DEVICE_FEATURES;
+}
+
+static void mmio_set_features(uint32_t sel, uint32_t features)
+{
+    VIRT_MMIO_DRIVER_FEATURES_SEL = sel;
+    VIRT_MMIO_DRIVER_FEATURES = features;
+}
+
+static uint8_t mmio_get_status(void)
+{
+    return VIRT_MMIO_STATUS;
+}
+
+static void mmio_set_status(uint8_t status)
+{
+    VIRT_MMIO_STATUS = status;
+}
+
+static uint32_t mmio_config_generation(void)
+{
+    return VIRT_MMIO_CONFIG_GENERATION;
+}
+
+static uint32_t mmio_read_config(uint32_t offset)
+{
+    return VIRT_MMIO_CONFIG(offset);
+}
+
+static uint16_t mmio_max_queue_size(uint16_t queue)
+{
+    VIRT_MMIO_QUEUE_SEL = queue;
+    if (VIRT_MMIO_QUEUE_READY != 0)
+        fatal("virtio disk queue in use?\n");
+
+    uint32_t num_max = VIRT_MMIO_QUEUE_NUM_MAX;
+    return num_max > 0xffff ? 0xffff : num_max;
+}
+
+static void mmio_setup_queue(uint16_t queue, uint16_t size, uintptr_t desc, uintptr_t driver, uintptr_t device)
+{
+    VIRT_MMIO_QUEUE_SEL = queue;
+    VIRT_MMIO_QUEUE_NUM = size;
+
+    VIRT_MMIO_QUEUE_DESC_LOW  = desc >> 0;
+    VIRT_MMIO_QUEUE_DESC_HIGH = (uint64_t) desc >> 32;
+
+    VIRT_MMIO_QUEUE_DRIVER_LOW  = driver >> 0;
+    VIRT_MMIO_QUEUE_DRIVER_HIGH = (uint64_t) driver >> 32;
+
+    VIRT_MMIO_QUEUE_DEVICE_LOW   = device >> 0;
+    VIRT_MMIO_QUEUE_DEVICE_HIGH  = (uint64_t) device >> 32;
+
+    VIRT_MMIO_QUEUE_READY = 1;
+}
+
+static void mmio_notify(uint16_t queue)
+{
+    VIRT_MMIO_QUEUE_NOTIFY = queue;
+}
+
+static void mmio_ack_interrupt(void)
+{
+    VIRT_MMIO_INTERRUPT_ACK = VIRT_MMIO_INTERRUPT_STATUS;
+}
+
+static int mmio_find_irq(const void *fdt)
+{
+    int node = -1;
+    uint64_t addr;
+
+    while ((node = fdt_node_offset_by_compatible(fdt, node, "virtio,mmio")) >= 0) {
+        if (dt_get_reg(fdt, node, 0, &addr, NULL) == 0 && addr == mmio_base)
+            return dt_get_spi(fdt, node);
+    }
+    return -1;
+}
+
+static void mmio_shutdown(void)
+{
+    VIRT_MMIO_STATUS = 0; // RESET
+}
+
+static const struct virtio_transport mmio_transport = {
+    .name = "virtio-mmio",
+    .get_features = mmio_get_features,
+    .set_features = mmio_set_features,
+    .get_status = mmio_get_status,
+    .set_status = mmio_set_status,
+    .config_generation = mmio_config_generation,
+    .read_config = mmio_read_config,
+    .max_queue_size = mmio_max_queue_size,
+    .setup_queue = mmio_setup_queue,
+    .notify = mmio_notify,
+    .ack_interrupt = mmio_ack_interrupt,
+    .find_irq = mmio_find_irq,
+    .shutdown = mmio_shutdown
+};
+
+static int is_device(uintptr_t base, uint32_t device_id)
+{
+    volatile uint32_t *regs = (volatile uint32_t *) base;
+
+    // Version 1 is the legacy interface, which isn't supported
+    return regs[0] == VIRTIO_MMIO_MAGIC_VALUE && regs[1] == 2 && regs[2] == device_id;
+}
+
+// Return the transport with the device at the lowest address. That's the
+// one on `virtio-mmio-bus.0` when the bus is given, like run_qemu.sh does.
+// When it isn't, QEMU virt gives later `-device` options lower addresses, so
+// with several disks, the last one on the command line is picked. Returns 0
+// if there isn't one.
+static uintptr_t find_device(const void *fdt, uint32_t device_id)
+{
+    uintptr_t best = 0;
+
+    if (fdt_check_header(fdt) == 0) {
+        int node = -1;
+        while ((node = fdt_node_offset_by_compatible(fdt, node, "virtio,mmio")) >= 0) {
+            uint64_t addr;
+            if (dt_get_reg(fdt, node, 0, &addr, NULL) < 0)
+                continue;
+            if ((best == 0 || addr < best) && is_device(addr, device_id))
+                best = addr;
+        }
+        if (best)
+            return best;
+    }
+
+    for (int i = 0; i < VIRTIO_MMIO_DEFAULT_SLOTS; i++) {
+        uintptr_t addr = VIRTIO_MMIO_DEFAULT_BASE + i * VIRTIO_MMIO_SLOT_SIZE;
+        if (is_device(addr, device_id))
+            return addr;
+    }
+    return 0;
+}
+
+const struct virtio_transport *virtio_mmio_probe(const void *fdt, uint32_t device_id)
+{
+    mmio_base = find_device(fdt, device_id);
+    return mmio_base ? &mmio_transport : NULL;
+}
@@ -0,0 +1,255 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "virtio.h"
+#include "pci.h"
+#include "util.h"
+
+// Modern virtio-pci transport (virtio spec section 4.1)
+//
+// Only the virtio 1.0 capability layout is supported. Transitional devices
+// work since QEMU gives them the modern capabilities too. Interrupts aren't
+// routed, so the block driver polls when this transport is used.
+
+#define VIRTIO_PCI_VENDOR_ID         0x1af4
+#define VIRTIO_PCI_MODERN_DEVICE_ID  0x1040 // + virtio device ID
+#define VIRTIO_PCI_LEGACY_BLOCK_ID   0x1001
+
+// struct virtio_pci_cap
+#define VIRTIO_PCI_CAP_CFG_TYPE      3
+#define VIRTIO_PCI_CAP_BAR           4
+#define VIRTIO_PCI_CAP_OFFSET        8
+#define VIRTIO_PCI_CAP_LENGTH        12
+#define VIRTIO_PCI_CAP_NOTIFY_MULT   16
+
+#define VIRTIO_PCI_CAP_COMMON_CFG    1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG    2
+#define VIRTIO_PCI_CAP_ISR_CFG       3
+#define VIRTIO_PCI_CAP_DEVICE_CFG    4
+
+#define VIRTIO_MSI_NO_VECTOR         0xffff
+
+static struct pci_device pdev;
+static uintptr_t common_cfg;
+static uintptr_t notify_base;
+static uint32_t notify_multiplier;
+static uintptr_t isr_cfg;
+static uintptr_t device_cfg;
+
+// Doorbell address for each queue. These are looked up when the queue is
+// set up since reading the offset needs QUEUE_SELECT, which CPUs notifying
+// different queues would otherwise fight over.
+static uintptr_t queue_notify_addr[VIRTIO_BLK_MAX_QUEUES];
+
+#define COMMON8(offset)  (*(volatile uint8_t *)(common_cfg + (offset)))
+#define COMMON16(offset) (*(volatile uint16_t *)(common_cfg + (offset)))
+#define COMMON32(offset) (*(volatile uint32_t *)(common_cfg + (offset)))
+
+// struct virtio_pci_common_cfg
+#define VIRTIO_PCI_DEVICE_FEATURE_SEL COMMON32(0x00)
+#define VIRTIO_PCI_DEVICE_FEATURE     COMMON32(0x04)
+#define VIRTIO_PCI_DRIVER_FEATURE_SEL COMMON32(0x08)
+#define VIRTIO_PCI_DRIVER_FEATURE     COMMON32(0x0C)
+#define VIRTIO_PCI_MSIX_CONFIG        COMMON16(0x10)
+#define VIRTIO_PCI_NUM_QUEUES         COMMON16(0x12)
+#define VIRTIO_PCI_DEVICE_STATUS      COMMON8(0x14)
+#define VIRTIO_PCI_CONFIG_GENERATION  COMMON8(0x15)
+#define VIRTIO_PCI_QUEUE_SELECT       COMMON16(0x16)
+#define VIRTIO_PCI_QUEUE_SIZE         COMMON16(0x18)
+#define VIRTIO_PCI_QUEUE_MSIX_VECTOR  COMMON16(0x1A)
+#define VIRTIO_PCI_QUEUE_ENABLE       COMMON16(0x1C)
+#define VIRTIO_PCI_QUEUE_NOTIFY_OFF   COMMON16(0x1E)
+#define VIRTIO_PCI_QUEUE_DESC_LOW     COMMON32(0x20)
+#define VIRTIO_PCI_QUEUE_DESC_HIGH    COMMON32(0x24)
+#define VIRTIO_PCI_QUEUE_DRIVER_LOW   COMMON32(0x28)
+#define VIRTIO_PCI_QUEUE_DRIVER_HIGH  COMMON32(0x2C)
+#define VIRTIO_PCI_QUEUE_DEVICE_LOW   COMMON32(0x30)
+#define VIRTIO_PCI_QUEUE_DEVICE_HIGH  COMMON32(0x34)
+
+static uint32_t pci_get_features(uint32_t sel)
+{
+    VIRTIO_PCI_DEVICE_FEATURE_SEL = sel;
+    return VIRTIO_PCI_DEVICE_FEATURE;
+}
+
+static void pci_set_features(uint32_t sel, uint32_t features)
+{
+    VIRTIO_PCI_DRIVER_FEATURE_SEL = sel;
+    VIRTIO_PCI_DRIVER_FEATURE = features;
+}
+
+static uint8_t pci_get_status(void)
+{
+    return VIRTIO_PCI_DEVICE_STATUS;
+}
+
+static void pci_set_status(uint8_t status)
+{
+    VIRTIO_PCI_DEVICE_STATUS = status;
+}
+
+static uint32_t pci_config_generation(void)
+{
+    return VIRTIO_PCI_CONFIG_GENERATION;
+}
+
+static uint32_t pci_read_config(uint32_t offset)
+{
+    return *(volatile uint32_t *)(device_cfg + offset);
+}
+
+static uint16_t pci_max_queue_size(uint16_t queue)
+{
+    if (queue >= VIRTIO_PCI_NUM_QUEUES)
+        return 0;
+
+    VIRTIO_PCI_QUEUE_SELECT = queue;
+    if (VIRTIO_PCI_QUEUE_ENABLE != 0)
+        fatal("virtio disk queue in use?\n");
+
+    return VIRTIO_PCI_QUEUE_SIZE;
+}
+
+static void pci_setup_queue(uint16_t queue, uint16_t size, uintptr_t desc, uintptr_t driver, uintptr_t device)
+{
+    if (queue >= VIRTIO_BLK_MAX_QUEUES)
+        fatal("virtio-pci: queue %d isn't supported", queue);
+
+    VIRTIO_PCI_QUEUE_SELECT = queue;
+    queue_notify_addr[queue] = notify_base + (uintptr_t) VIRTIO_PCI_QUEUE_NOTIFY_OFF * notify_multiplier;
+    VIRTIO_PCI_QUEUE_SIZE = size;
+    VIRTIO_PCI_QUEUE_MSIX_VECTOR = VIRTIO_MSI_NO_VECTOR;
+
+    VIRTIO_PCI_QUEUE_DESC_LOW  = desc >> 0;
+    VIRTIO_PCI_QUEUE_DESC_HIGH = (uint64_t) desc >> 32;
+
+    VIRTIO_PCI_QUEUE_DRIVER_LOW  = driver >> 0;
+    VIRTIO_PCI_QUEUE_DRIVER_HIGH = (uint64_t) driver >> 32;
+
+    VIRTIO_PCI_QUEUE_DEVICE_LOW  = device >> 0;
+    VIRTIO_PCI_QUEUE_DEVICE_HIGH = (uint64_t) device >> 32;
+
+    VIRTIO_PCI_QUEUE_ENABLE = 1;
+}
+
+static void pci_notify(uint16_t queue)
+{
+    *(volatile uint16_t *) queue_notify_addr[queue] = queue;
+}
+
+static void pci_ack_interrupt(void)
+{
+    // Reading the ISR status clears it
+    (void) *(volatile uint8_t *) isr_cfg;
+}
+
+static int pci_find_irq(const void *fdt)
+{
+    (void) fdt;
+
+    // INTx would need the host bridge's interrupt-map and MSI-X an ITS or
+    // GICv2m frame. Neither seems worth it for one disk.
+    return -1;
+}
+
+static void pci_shutdown(void)
+{
+    VIRTIO_PCI_DEVICE_STATUS = 0; // RESET
+
+    // The reset is complete when the status reads back as 0
+    while (VIRTIO_PCI_DEVICE_STATUS != 0)
+        ;
+    pci_disable_device(&pdev);
+}
+
+static const struct virtio_transport pci_transport = {
+    .name = "virtio-pci",
+    .get_features = pci_get_features,
+    .set_features = pci_set_features,
+    .get_status = pci_get_status,
+    .set_status = pci_set_status,
+    .config_generation = pci_config_generation,
+    .read_config = pci_read_config,
+    .max_queue_size = pci_max_queue_size,
+    .setup_queue = pci_setup_queue,
+    .notify = pci_notify,
+    .ack_interrupt = pci_ack_interrupt,
+    .find_irq = pci_find_irq,
+    .shutdown = pci_shutdown
+};
+
+// Return the CPU address of a capability's structure or 0
+static uintptr_t cap_address(int cap)
+{
+    uint8_t bar = pci_read8(&pdev, cap + VIRTIO_PCI_CAP_BAR);
+    if (bar >= PCI_NUM_BARS || pdev.bar[bar] == 0)
+        return 0;
+
+    return pdev.bar[bar] + pci_read32(&pdev, cap + VIRTIO_PCI_CAP_OFFSET);
+}
+
+static int find_structures(void)
+{
+    common_cfg = 0;
+    notify_base = 0;
+    isr_cfg = 0;
+    device_cfg = 0;
+
+    // Devices may list a structure more than once. The first one that can
+    // be used is the preferred one.
+    int cap = 0;
+    while ((cap = pci_find_capability(&pdev, PCI_CAP_ID_VNDR, cap)) > 0) {
+        uintptr_t addr = cap_address(cap);
+        if (addr == 0)
+            continue;
+
+        switch (pci_read8(&pdev, cap + VIRTIO_PCI_CAP_CFG_TYPE)) {
+        case VIRTIO_PCI_CAP_COMMON_CFG:
+            if (!common_cfg)
+                common_cfg = addr;
+            break;
+        case VIRTIO_PCI_CAP_NOTIFY_CFG:
+            if (!notify_base) {
+                notify_base = addr;
+                notify_multiplier = pci_read32(&pdev, cap + VIRTIO_PCI_CAP_NOTIFY_MULT);
+            }
+            break;
+        case VIRTIO_PCI_CAP_ISR_CFG:
+            if (!isr_cfg)
+                isr_cfg = addr;
+            break;
+        case VIRTIO_PCI_CAP_DEVICE_CFG:
+            if (!device_cfg)
+                device_cfg = addr;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (!common_cfg || !notify_base || !isr_cfg || !device_cfg)
+        ERR_RETURN("virtio-pci: %02x:%02x.%x is missing modern capabilities", pdev.bus, pdev.dev, pdev.fn);
+    return 0;
+}
+
+const struct virtio_transport *virtio_pci_probe(const void *fdt, uint32_t device_id)
+{
+    if (pci_init(fdt) < 0)
+        return NULL;
+
+    if (pci_find_device(VIRTIO_PCI_VENDOR_ID, VIRTIO_PCI_MODERN_DEVICE_ID + device_id, &pdev) < 0 &&
+        (device_id != VIRTIO_ID_BLOCK ||
+         pci_find_device(VIRTIO_PCI_VENDOR_ID, VIRTIO_PCI_LEGACY_BLOCK_ID, &pdev) < 0))
+        return NULL;
+
+    if (pci_enable_device(&pdev) < 0 || find_structures() < 0) {
+        pci_disable_device(&pdev);
+        return NULL;
+    }
+
+    VIRTIO_PCI_MSIX_CONFIG = VIRTIO_MSI_NO_VECTOR;
+    return &pci_transport;
+}
@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+
+# SPDX-FileCopyrightText: 2025 Frank Hunleth
+#
+# SPDX-License-Identifier: BSD-3-Clause
+
+# Compare sequential kernel read throughput with the split and packed
+# virtqueue layouts and with one and four queues. Each queue gets its own
+# QEMU iothread in the multi-queue case. This boots the loader in QEMU with
+# each configuration, stops
+# once it says "Starting Linux...", and divides the kernel size by the
+# load-kernel time from the boot timing report.
+#
+# Run from the tests directory after building with `make`. Pass the number
+# of runs per configuration as the first argument (default 5).
+
+set -e
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd -P)
+LITTLE_LOADER=$TESTS_DIR/../little_loader.elf
+DEMO_FW=$TESTS_DIR/../demo.fw
+WORK=$TESTS_DIR/work
+DISK_IMAGE=$WORK/disk.img
+RUNS=${1:-5}
+
+if [ ! -f "$LITTLE_LOADER" ]; then echo "Build $LITTLE_LOADER first"; exit 1; fi
+if [ ! -f "$DEMO_FW" ]; then echo "Build $DEMO_FW first"; exit 1; fi
+
+rm -fr "$WORK"
+mkdir -p "$WORK"
+fwup "$DEMO_FW" -d "$DISK_IMAGE" > /dev/null
+
+# Boot once and print "<kernel bytes> <load-kernel us>"
+boot_once() {
+    PACKED=$1
+    QUEUES=$2
+    LOG=$WORK/qemu.log
+
+    # iothread-vq-mapping is a list, so the device is described in JSON
+    DEVICE="\"driver\":\"virtio-blk-device\",\"drive\":\"vdisk\",\"bus\":\"virtio-mmio-bus.0\""
+    DEVICE+=",\"packed\":$PACKED,\"num-queues\":$QUEUES"
+    IOTHREADS=""
+    if [ "$QUEUES" -gt 1 ]; then
+        MAPPING=""
+        for i in $(seq 0 $((QUEUES - 1))); do
+            IOTHREADS+=" -object iothread,id=iothread$i"
+            MAPPING+="${MAPPING:+,}{\"iothread\":\"iothread$i\"}"
+        done
+        DEVICE+=",\"iothread-vq-mapping\":[$MAPPING]"
+    fi
+
+    qemu-system-aarch64 -M virt -cpu cortex-a53 -nographic -smp 1 \
+        -kernel "$LITTLE_LOADER" \
+        -global virtio-mmio.force-legacy=false \
+        $IOTHREADS \
+        -drive if=none,file="$DISK_IMAGE",format=raw,id=vdisk \
+        -device "{$DEVICE}" \
+        > "$LOG" 2>&1 &
+    QEMU_PID=$!
+
+    for _ in $(seq 100); do
+        if grep -q "Starting Linux" "$LOG"; then break; fi
+        sleep 0.1
+    done
+    kill "$QEMU_PID" 2>/dev/null || true
+    wait "$QEMU_PID" 2>/dev/null || true
+
+    BYTES=$(sed -n 's/.*Read \([0-9]*\) byte kernel.*/\1/p' "$LOG")
+    US=$(awk '$1 == "load-kernel" { print $3 }' "$LOG" | tr -d '\r')
+    if [ -z "$BYTES" ] || [ -z "$US" ]; then
+        echo "Couldn't find kernel size or timing in the loader output:" >&2
+        cat "$LOG" >&2
+        exit 1
+    fi
+    echo "$BYTES $US"
+}
+
+for CONFIG in "false 1" "true 1" "false 4" "true 4"; do
+    read -r PACKED QUEUES <<< "$CONFIG"
+    TOTAL_BYTES=0
+    TOTAL_US=0
+    for _ in $(seq "$RUNS"); do
+        read -r BYTES US <<< "$(boot_once "$PACKED" "$QUEUES")"
+        TOTAL_BYTES=$((TOTAL_BYTES + BYTES))
+        TOTAL_US=$((TOTAL_US + US))
+    done
+    # Bytes per microsecond is MB/s
+    awk -v b="$TOTAL_BYTES" -v us="$TOTAL_US" -v p="$PACKED" -v q="$QUEUES" \
+        'BEGIN { printf "packed=%-5s queues=%d %8.1f MB/s\n", p, q, b / us }'
+done
+
+rm -fr "$WORK"
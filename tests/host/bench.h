@@ -0,0 +1,78 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_CYCLES_NAME "cycle"
+static inline uint64_t bench_cycles(void) { return __rdtsc(); }
+#elif defined(__aarch64__)
+#define BENCH_CYCLES_NAME "tick"
+static inline uint64_t bench_cycles(void)
+{
+    uint64_t v;
+    __asm__ volatile ("isb; mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+}
+#else
+#define BENCH_CYCLES_NAME "ns"
+static inline uint64_t bench_cycles(void) { return 0; }
+#endif
+
+static inline uint64_t bench_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct bench_result {
+    uint64_t ns;
+    uint64_t cycles;
+};
+
+// Run `body` enough times to take a measurable amount of time and keep the
+// best run to reduce noise.
+#define BENCH_RUN(RESULT, ITERATIONS, BODY) do { \
+    (RESULT).ns = UINT64_MAX; \
+    (RESULT).cycles = UINT64_MAX; \
+    for (int _run = 0; _run < 5; _run++) { \
+        uint64_t _ns0 = bench_ns(); \
+        uint64_t _c0 = bench_cycles(); \
+        for (long _i = 0; _i < (ITERATIONS); _i++) { BODY; } \
+        uint64_t _c1 = bench_cycles(); \
+        uint64_t _ns1 = bench_ns(); \
+        if (_ns1 - _ns0 < (RESULT).ns) { \
+            (RESULT).ns = _ns1 - _ns0; \
+            (RESULT).cycles = _c1 - _c0; \
+        } \
+    } \
+} while (0)
+
+static inline void bench_report(const char *name, struct bench_result r, long iterations, size_t bytes)
+{
+    double total = (double) iterations * bytes;
+    printf("  %-32s %8.3f ns/byte  %8.3f bytes/%s  %9.1f MB/s\n",
+           name,
+           r.ns / total,
+           r.cycles ? total / r.cycles : 0.0,
+           BENCH_CYCLES_NAME,
+           total / (r.ns / 1e9) / 1e6);
+}
+
+// Keep the compiler from optimizing away benchmarked work
+static inline void bench_use(const void *p)
+{
+    __asm__ volatile ("" :: "r"(p) : "memory");
+}
+
+#endif // BENCH_H
@@ -0,0 +1,47 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdlib.h>
+
+#include "bench.h"
+#include "crc32.h"
+
+static uint32_t bytewise_crc32(const unsigned char *buf, size_t len)
+{
+    uint32_t crc = 0xffffffff;
+    while (len--) {
+        crc ^= *buf++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+int main(void)
+{
+    static const size_t sizes[] = {512, 4096, 128 * 1024};
+    unsigned char *buf = malloc(128 * 1024);
+    struct bench_result r;
+    volatile uint32_t sink;
+
+    for (size_t i = 0; i < 128 * 1024; i++)
+        buf[i] = (unsigned char) rand();
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t size = sizes[i];
+        long iterations = (32L * 1024 * 1024) / (long) size;
+
+        printf("crc32 over %zu bytes:\n", size);
+        BENCH_RUN(r, iterations / 16, { sink = bytewise_crc32(buf, size); });
+        bench_report("bit-at-a-time reference", r, iterations / 16, size);
+        BENCH_RUN(r, iterations, { sink = crc32buf((const char *) buf, size); });
+        bench_report("crc32buf", r, iterations, size);
+    }
+
+    (void) sink;
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <string.h>
+
+#include "bench.h"
+#include "compress_helpers.h"
+
+#define DATA_SIZE (8 * 1024 * 1024)
+
+static void decompress_once(enum decomp_format format, const uint8_t *compressed, size_t compressed_len, uint8_t *out)
+{
+    // Disk-sized pieces like the kernel loader uses
+    struct chunked_input c = {compressed, compressed_len, 0, 512 * 1024, 0};
+    struct decomp_input in = {NULL, NULL, chunked_refill, &c};
+    size_t out_len;
+
+    if (decompress(format, &in, out, DATA_SIZE, &out_len) < 0 || out_len != DATA_SIZE)
+        printf("decompression failed!\n");
+}
+
+static void bench_format(const char *cmd, enum decomp_format format, const uint8_t *data, uint8_t *out)
+{
+    struct bench_result r;
+    size_t compressed_len;
+    uint8_t *compressed = compress_with(cmd, data, DATA_SIZE, &compressed_len);
+    if (!compressed) {
+        printf("%s: not available, skipping\n", cmd);
+        return;
+    }
+
+    printf("%s (%zu -> %zu bytes):\n", cmd, (size_t) DATA_SIZE, compressed_len);
+    BENCH_RUN(r, 1, { decompress_once(format, compressed, compressed_len, out); });
+    bench_report(decomp_format_name(format), r, 1, DATA_SIZE);
+    bench_use(out);
+    free(compressed);
+}
+
+int main(void)
+{
+    uint8_t *data = make_test_data(DATA_SIZE);
+    uint8_t *out = malloc(DATA_SIZE);
+
+    util_init();
+    bench_format("gzip -9 -c", DECOMP_GZIP, data, out);
+    bench_format("zstd -19 -c", DECOMP_ZSTD, data, out);
+
+    if (memcmp(data, out, DATA_SIZE) != 0)
+        printf("output mismatch!\n");
+
+    free(out);
+    free(data);
+    return 0;
+}
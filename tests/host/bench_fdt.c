@@ -0,0 +1,75 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdlib.h>
+
+#include "bench.h"
+#include "fdt_helpers.h"
+#include "fdt_fixup.h"
+#include "util.h"
+
+#define DTB_SIZE (1024 * 1024)
+
+int main(void)
+{
+    char *original = malloc(DTB_SIZE);
+    char *dtb = malloc(DTB_SIZE);
+    long iterations = 20000;
+    struct bench_result r;
+
+    if (make_virt_like_fdt(original, DTB_SIZE) < 0) {
+        printf("Failed to make test DTB\n");
+        return EXIT_FAILURE;
+    }
+    fdt_pack(original);
+    size_t size = fdt_totalsize(original);
+
+    printf("fdt edits on a %zu byte DTB:\n", size);
+
+    BENCH_RUN(r, iterations, { fdt_open_into(original, dtb, DTB_SIZE); });
+    bench_report("fdt_open_into (copy)", r, iterations, size);
+
+    BENCH_RUN(r, iterations, {
+        fdt_open_into(original, dtb, DTB_SIZE);
+        int chosen = fdt_path_offset(dtb, "/chosen");
+        fdt_setprop_string(dtb, chosen, "bootargs", "booting=a root=/dev/vda2 console=ttyAMA0");
+    });
+    bench_report("copy + set bootargs", r, iterations, size);
+
+    BENCH_RUN(r, iterations, {
+        fdt_open_into(original, dtb, DTB_SIZE);
+        int chosen = fdt_path_offset(dtb, "/chosen");
+        fdt_setprop_string(dtb, chosen, "bootargs", "booting=a root=/dev/vda2 console=ttyAMA0");
+        fdt_setprop_u64(dtb, chosen, "linux,initrd-start", 0x48000000);
+        fdt_setprop_u64(dtb, chosen, "linux,initrd-end", 0x48800000);
+        int node = fdt_add_subnode(dtb, chosen, "bootstage");
+        for (int i = 0; i < 7; i++) {
+            char name[16];
+            snprintf(name, sizeof(name), "stage-%d", i);
+            fdt_setprop_u64(dtb, node, name, i * 1000);
+        }
+        fdt_add_mem_rsv(dtb, 0x40000000, 0x200000);
+    });
+    bench_report("copy + all loader fixups", r, iterations, size);
+
+    static const char *const stages[] = {"stage-0", "stage-1", "stage-2", "stage-3", "stage-4", "stage-5", "stage-6"};
+    BENCH_RUN(r, iterations, {
+        struct fdt_fixup f;
+        fdt_fixup_init(&f);
+        fdt_fixup_setprop_string(&f, "/chosen", "bootargs", "booting=a root=/dev/vda2 console=ttyAMA0");
+        fdt_fixup_setprop_u64(&f, "/chosen", "linux,initrd-start", 0x48000000);
+        fdt_fixup_setprop_u64(&f, "/chosen", "linux,initrd-end", 0x48800000);
+        for (int i = 0; i < 7; i++)
+            fdt_fixup_setprop_u64(&f, "/chosen/bootstage", stages[i], i * 1000);
+        fdt_fixup_add_reserve(&f, 0x40000000, 0x200000);
+        fdt_fixup_apply(&f, original, dtb, DTB_SIZE, 4096);
+    });
+    bench_report("single-pass fixups", r, iterations, size);
+
+    free(dtb);
+    free(original);
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Compare memcpy_/memset_/memmove_ against the original byte-at-a-time
+// versions.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "util.h"
+
+static void *ref_memcpy(void *dst, const void *src, size_t n)
+{
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    while (n--)
+        *d++ = *s++;
+    return dst;
+}
+
+static void *ref_memset(void *b, int c, size_t len)
+{
+    unsigned char *p = b;
+    while (len--)
+        *p++ = c;
+    return b;
+}
+
+static void *ref_memmove(void *dest, const void *src, size_t n)
+{
+    unsigned char *d = dest;
+    const unsigned char *s = src;
+
+    if (d < s) {
+        while (n--)
+            *d++ = *s++;
+    } else {
+        d += n;
+        s += n;
+        while (n--)
+            *(--d) = *(--s);
+    }
+    return dest;
+}
+
+static long iterations_for(size_t size)
+{
+    long n = (64L * 1024 * 1024) / (long) size;
+    return n < 4 ? 4 : n;
+}
+
+static void bench_size(size_t size, size_t misalign)
+{
+    unsigned char *src = malloc(size + 64);
+    unsigned char *dst = malloc(size + 64);
+    unsigned char *s = src + misalign;
+    unsigned char *d = dst + 1;
+    long iterations = iterations_for(size);
+    struct bench_result r;
+
+    for (size_t i = 0; i < size + 64; i++)
+        src[i] = (unsigned char) i;
+
+    printf("%zu bytes (source offset %zu, destination offset 1):\n", size, misalign);
+
+    BENCH_RUN(r, iterations, { ref_memcpy(d, s, size); bench_use(d); });
+    bench_report("memcpy (bytewise)", r, iterations, size);
+    BENCH_RUN(r, iterations, { memcpy_(d, s, size); bench_use(d); });
+    bench_report("memcpy_", r, iterations, size);
+    if (memcmp(d, s, size) != 0) {
+        printf("memcpy_ mismatch!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    BENCH_RUN(r, iterations, { ref_memset(d, 0xff, size); bench_use(d); });
+    bench_report("memset 0xff (bytewise)", r, iterations, size);
+    BENCH_RUN(r, iterations, { memset_(d, 0xff, size); bench_use(d); });
+    bench_report("memset_ 0xff", r, iterations, size);
+    BENCH_RUN(r, iterations, { memset_(d, 0, size); bench_use(d); });
+    bench_report("memset_ 0", r, iterations, size);
+
+    // Overlapping move like fdt_splice_() does when inserting a property
+    size_t move = size - 32;
+    BENCH_RUN(r, iterations, { ref_memmove(src + 32, src, move); bench_use(src); });
+    bench_report("memmove up (bytewise)", r, iterations, move);
+    BENCH_RUN(r, iterations, { memmove_(src + 32, src, move); bench_use(src); });
+    bench_report("memmove_ up", r, iterations, move);
+    BENCH_RUN(r, iterations, { memmove_(src, src + 32, move); bench_use(src); });
+    bench_report("memmove_ down", r, iterations, move);
+
+    free(src);
+    free(dst);
+}
+
+int main(void)
+{
+    util_init();
+
+    static const size_t sizes[] = {64, 4096, 128 * 1024, 1024 * 1024};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_size(sizes[i], 1);
+        bench_size(sizes[i], 3);
+    }
+    return 0;
+}
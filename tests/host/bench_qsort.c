@@ -0,0 +1,58 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdlib.h>
+
+#include "bench.h"
+#include "util.h"
+
+// Sort pointers to strings like uboot_env_sort() does
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp_(*(char * const *) a, *(char * const *) b);
+}
+
+static void bench_count(int count)
+{
+    char **names = malloc(count * sizeof(char *));
+    char **work = malloc(count * sizeof(char *));
+    long iterations = 2000000L / count + 3;
+    struct bench_result r;
+
+    for (int i = 0; i < count; i++) {
+        names[i] = malloc(32);
+        snprintf(names[i], 32, "%c.setting_%08d", 'a' + rand() % 26, rand());
+    }
+
+    BENCH_RUN(r, iterations, {
+        memcpy_(work, names, count * sizeof(char *));
+        qsort_(work, count, sizeof(char *), compare_names);
+    });
+    printf("  qsort_ %6d names %14.1f ns/sort %10.1f ns/element\n",
+           count, (double) r.ns / iterations, (double) r.ns / iterations / count);
+
+    for (int i = 1; i < count; i++) {
+        if (compare_names(&work[i - 1], &work[i]) > 0) {
+            printf("qsort_ result isn't sorted!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+        free(names[i]);
+    free(work);
+    free(names);
+}
+
+int main(void)
+{
+    static const int counts[] = {10, 100, 1000, 10000};
+
+    printf("qsort_:\n");
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+        bench_count(counts[i]);
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdlib.h>
+
+#include "bench.h"
+#include "uboot_env.h"
+#include "util.h"
+
+#define ENV_SIZE (128 * 1024)
+
+static void fill_env(struct uboot_env *env, int count)
+{
+    char name[64];
+    char value[64];
+
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "%c.app_setting_%05d", 'a' + (i * 7) % 26, (i * 7919) % 100000);
+        snprintf(value, sizeof(value), "f81d4fae-7dec-11d0-a765-%012d", i);
+        uboot_env_setenv(env, name, value);
+    }
+    uboot_env_setenv(env, "nerves_fw_active", "a");
+    uboot_env_setenv(env, "zz.last", "1");
+}
+
+static void bench_count(int count)
+{
+    char *block = malloc(ENV_SIZE);
+    long iterations = 200000 / count + 10;
+    struct uboot_env env;
+    struct bench_result r;
+
+    printf("%d variables:\n", count);
+
+    struct heap_mark mark = heap_mark();
+    uboot_env_init(&env, ENV_SIZE);
+    fill_env(&env, count);
+    BENCH_RUN(r, iterations, { uboot_env_write(&env, block); });
+    bench_report("uboot_env_write (serialize)", r, iterations, ENV_SIZE);
+
+    BENCH_RUN(r, iterations, {
+        uboot_env_free(&env);
+        uboot_env_init(&env, ENV_SIZE);
+        uboot_env_read(&env, block);
+    });
+    bench_report("uboot_env_read (parse)", r, iterations, ENV_SIZE);
+
+    BENCH_RUN(r, iterations, {
+        bench_use(uboot_env_get(&env, "nerves_fw_active"));
+        bench_use(uboot_env_get(&env, "zz.last"));
+    });
+    printf("  %-32s %8.1f ns/lookup\n", "uboot_env_get", r.ns / (iterations * 2.0));
+
+    uboot_env_free(&env);
+    heap_release(mark);
+
+    free(block);
+}
+
+int main(void)
+{
+    util_init();
+
+    static const int counts[] = {10, 100, 1000};
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+        bench_count(counts[i]);
+    return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef COMPRESS_HELPERS_H
+#define COMPRESS_HELPERS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "decompress.h"
+#include "util.h"
+
+// Helpers for feeding data compressed by the real gzip and zstd programs
+// through the decompressors
+
+struct chunked_input {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+    size_t chunk;
+    int refills;
+};
+
+// Hand out the input in small pieces like blocks arriving from disk
+static inline int chunked_refill(struct decomp_input *in)
+{
+    struct chunked_input *c = in->priv;
+    if (c->pos >= c->len)
+        return -1;
+
+    size_t n = c->len - c->pos;
+    if (n > c->chunk)
+        n = c->chunk;
+    in->next = c->data + c->pos;
+    in->end = in->next + n;
+    c->pos += n;
+    c->refills++;
+    return 0;
+}
+
+static inline uint8_t *compress_with(const char *cmd, const uint8_t *data, size_t len, size_t *out_len)
+{
+    char in_path[] = "/tmp/decompress_inXXXXXX";
+    char out_path[] = "/tmp/decompress_outXXXXXX";
+    char command[256];
+    uint8_t *result = NULL;
+
+    int in_fd = mkstemp(in_path);
+    int out_fd = mkstemp(out_path);
+    if (in_fd < 0 || out_fd < 0)
+        return NULL;
+
+    if (write(in_fd, data, len) == (ssize_t) len) {
+        snprintf(command, sizeof(command), "%s < %s > %s 2>/dev/null", cmd, in_path, out_path);
+        if (system(command) == 0) {
+            off_t size = lseek(out_fd, 0, SEEK_END);
+            result = malloc(size);
+            if (pread(out_fd, result, size, 0) != size) {
+                free(result);
+                result = NULL;
+            }
+            *out_len = size;
+        }
+    }
+
+    close(in_fd);
+    close(out_fd);
+    unlink(in_path);
+    unlink(out_path);
+    return result;
+}
+
+static inline int have_program(const char *name)
+{
+    char command[128];
+    snprintf(command, sizeof(command), "command -v %s > /dev/null 2>&1", name);
+    return system(command) == 0;
+}
+
+// Something that compresses about like a kernel: code-ish noise, runs of
+// zeros, and repeated strings.
+static inline uint8_t *make_test_data(size_t len)
+{
+    uint8_t *data = malloc(len);
+    uint32_t x = 12345;
+    size_t i = 0;
+
+    while (i < len) {
+        x = x * 1103515245 + 12345;
+        int kind = (x >> 16) % 4;
+        size_t run = 16 + ((x >> 8) % 512);
+        if (run > len - i)
+            run = len - i;
+
+        for (size_t j = 0; j < run; j++) {
+            switch (kind) {
+            case 0:
+                x = x * 1103515245 + 12345;
+                data[i + j] = x >> 24;
+                break;
+            case 1:
+                data[i + j] = 0;
+                break;
+            case 2:
+                data[i + j] = "little_loader boots Linux "[j % 26];
+                break;
+            default:
+                data[i + j] = (x >> 24) & 0x0f;
+                break;
+            }
+        }
+        i += run;
+    }
+    return data;
+}
+
+#endif // COMPRESS_HELPERS_H
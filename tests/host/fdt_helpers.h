@@ -0,0 +1,72 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef FDT_HELPERS_H
+#define FDT_HELPERS_H
+
+#include <stdio.h>
+
+#include "libfdt/libfdt.h"
+#include "util.h"
+
+// Create a DTB with an empty root node. The vendored libfdt doesn't include
+// the sequential write functions, so build the blob by hand.
+static inline int make_empty_fdt(void *buf, int bufsize)
+{
+    struct {
+        struct fdt_header header;
+        fdt64_t rsvmap[2];
+        fdt32_t structure[4];
+    } empty;
+
+    memset_(&empty, 0, sizeof(empty));
+    empty.header.magic = cpu_to_fdt32(FDT_MAGIC);
+    empty.header.totalsize = cpu_to_fdt32(sizeof(empty));
+    empty.header.off_mem_rsvmap = cpu_to_fdt32(sizeof(empty.header));
+    empty.header.off_dt_struct = cpu_to_fdt32(sizeof(empty.header) + sizeof(empty.rsvmap));
+    empty.header.off_dt_strings = cpu_to_fdt32(sizeof(empty));
+    empty.header.size_dt_struct = cpu_to_fdt32(sizeof(empty.structure));
+    empty.header.size_dt_strings = 0;
+    empty.header.version = cpu_to_fdt32(17);
+    empty.header.last_comp_version = cpu_to_fdt32(16);
+    empty.structure[0] = cpu_to_fdt32(FDT_BEGIN_NODE);
+    empty.structure[1] = 0; // Empty name, padded
+    empty.structure[2] = cpu_to_fdt32(FDT_END_NODE);
+    empty.structure[3] = cpu_to_fdt32(FDT_END);
+
+    return fdt_open_into(&empty, buf, bufsize);
+}
+
+// Build something shaped like the QEMU virt DTB
+static inline int make_virt_like_fdt(void *buf, int bufsize)
+{
+    char name[32];
+    int rc = make_empty_fdt(buf, bufsize);
+    if (rc < 0)
+        return rc;
+
+    int chosen = fdt_add_subnode(buf, 0, "chosen");
+    if (chosen < 0)
+        return chosen;
+
+    for (int i = 0; i < 32; i++) {
+        snprintf(name, sizeof(name), "virtio_mmio@%x", 0xa000000 + i * 0x200);
+        int node = fdt_add_subnode(buf, 0, name);
+        if (node < 0)
+            return node;
+
+        fdt64_t reg[2] = {cpu_to_fdt64(0xa000000 + i * 0x200), cpu_to_fdt64(0x200)};
+        fdt32_t irq[3] = {0, cpu_to_fdt32(16 + i), cpu_to_fdt32(1)};
+        if ((rc = fdt_setprop_string(buf, node, "compatible", "virtio,mmio")) < 0 ||
+            (rc = fdt_setprop(buf, node, "reg", reg, sizeof(reg))) < 0 ||
+            (rc = fdt_setprop(buf, node, "interrupts", irq, sizeof(irq))) < 0 ||
+            (rc = fdt_setprop_empty(buf, node, "dma-coherent")) < 0)
+            return rc;
+    }
+    return 0;
+}
+
+#endif // FDT_HELPERS_H
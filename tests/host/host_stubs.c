@@ -0,0 +1,48 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Platform functions for running the portable loader modules on the host
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pl011_uart.h"
+#include "mmu.h"
+#include "util.h"
+
+void uart_init(const void *fdt)
+{
+    (void) fdt;
+}
+
+void uart_putc(char c)
+{
+    if (c != '\r')
+        putchar(c);
+}
+
+void uart_puts(const char *s)
+{
+    while (*s)
+        uart_putc(*s++);
+}
+
+int mmu_enabled(void)
+{
+    // Host memory is always normal memory
+    return 1;
+}
+
+int get_el(void)
+{
+    return 0;
+}
+
+void host_poweroff(void)
+{
+    fflush(stdout);
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,37 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int test_failures;
+
+#define CHECK(COND) do { \
+    if (!(COND)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define RUN_TEST(FN) do { \
+    int _before = test_failures; \
+    FN(); \
+    printf("  %-40s %s\n", #FN, test_failures == _before ? "ok" : "FAILED"); \
+} while (0)
+
+static inline int test_exit_code(void)
+{
+    if (test_failures) {
+        printf("%d check(s) failed\n", test_failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+#endif // TEST_H
@@ -0,0 +1,237 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <string.h>
+
+#include "test.h"
+#include "blk_cache.h"
+#include "util.h"
+
+// Fake disk with a partial 4 KiB block at the end
+#define DISK_SECTORS 1003
+
+static uint8_t disk[DISK_SECTORS * SECTOR_SIZE];
+static int reads;
+static int last_num_sg;
+static uint64_t last_lba;
+static int fail_reads;
+
+static int fake_read(uint64_t lba, const struct virtio_blk_sg *sg, int num_sg)
+{
+    reads++;
+    last_num_sg = num_sg;
+    last_lba = lba;
+    if (fail_reads)
+        return -1;
+
+    uint64_t offset = lba * SECTOR_SIZE;
+    for (int i = 0; i < num_sg; i++) {
+        CHECK(sg[i].len_bytes % SECTOR_SIZE == 0);
+        CHECK(offset + sg[i].len_bytes <= sizeof(disk));
+        memcpy(sg[i].buffer, disk + offset, sg[i].len_bytes);
+        offset += sg[i].len_bytes;
+    }
+    return 0;
+}
+
+static void fill_disk(void)
+{
+    for (size_t i = 0; i < sizeof(disk); i++)
+        disk[i] = (uint8_t) (i * 7 + i / SECTOR_SIZE);
+}
+
+static void reset(int max_blocks_per_read)
+{
+    fill_disk();
+    reads = 0;
+    fail_reads = 0;
+    blk_cache_init(DISK_SECTORS, max_blocks_per_read, fake_read);
+}
+
+static int read_matches(uint64_t lba, uint32_t len)
+{
+    static uint8_t buffer[BLK_CACHE_MAX_READ];
+    memset(buffer, 0xaa, sizeof(buffer));
+    return blk_cache_read(lba, len, buffer) == (int) len &&
+           memcmp(buffer, disk + lba * SECTOR_SIZE, len) == 0;
+}
+
+static void test_miss_then_hit(void)
+{
+    reset(16);
+
+    // One sector misses and reads ahead to fill the rest of the read
+    CHECK(read_matches(16, SECTOR_SIZE));
+    CHECK(reads == 1);
+    CHECK(last_lba == 16);
+    CHECK(last_num_sg == 1 + BLK_CACHE_READ_AHEAD);
+
+    // Anything in the read-ahead is a hit
+    CHECK(read_matches(17, 3 * BLK_CACHE_BLOCK_SIZE));
+    CHECK(reads == 1);
+
+    struct blk_cache_stats stats = blk_cache_stats();
+    CHECK(stats.misses == 1);
+    CHECK(stats.hits == 4);
+    CHECK(stats.read_ahead == BLK_CACHE_READ_AHEAD);
+}
+
+static void test_multi_segment_fill(void)
+{
+    reset(16);
+
+    // 10 blocks that don't start on a block boundary take 11 slots. The
+    // read-ahead is capped by the blocks per read.
+    CHECK(read_matches(3, 10 * BLK_CACHE_BLOCK_SIZE));
+    CHECK(reads == 1);
+    CHECK(last_lba == 0);
+    CHECK(last_num_sg == 16);
+    CHECK(blk_cache_stats().read_ahead == 5);
+
+    // Reads bigger than one fill take several
+    reset(4);
+    CHECK(read_matches(0, BLK_CACHE_MAX_READ));
+    CHECK(reads == BLK_CACHE_MAX_READ / BLK_CACHE_BLOCK_SIZE / 4);
+    CHECK(blk_cache_stats().read_ahead == 0);
+}
+
+static void test_read_ahead_stops_at_cached_block(void)
+{
+    reset(16);
+
+    CHECK(read_matches(80, SECTOR_SIZE));
+    CHECK(reads == 1);
+
+    // Read-ahead from block 5 stops before block 10
+    CHECK(read_matches(40, SECTOR_SIZE));
+    CHECK(reads == 2);
+    CHECK(last_num_sg == 5);
+}
+
+static void test_lru_eviction(void)
+{
+    reset(1);
+
+    for (int i = 0; i < BLK_CACHE_BLOCKS; i++)
+        CHECK(read_matches(i * BLK_CACHE_SECTORS, SECTOR_SIZE));
+    CHECK(reads == BLK_CACHE_BLOCKS);
+
+    // Touch block 0 so that block 1 is the least recently used
+    CHECK(read_matches(0, SECTOR_SIZE));
+    CHECK(reads == BLK_CACHE_BLOCKS);
+
+    CHECK(read_matches(BLK_CACHE_BLOCKS * BLK_CACHE_SECTORS, SECTOR_SIZE));
+    CHECK(reads == BLK_CACHE_BLOCKS + 1);
+
+    CHECK(read_matches(0, SECTOR_SIZE));
+    CHECK(read_matches(2 * BLK_CACHE_SECTORS, SECTOR_SIZE));
+    CHECK(reads == BLK_CACHE_BLOCKS + 1);
+
+    CHECK(read_matches(BLK_CACHE_SECTORS, SECTOR_SIZE));
+    CHECK(reads == BLK_CACHE_BLOCKS + 2);
+    CHECK(last_lba == BLK_CACHE_SECTORS);
+}
+
+static void test_invalidate(void)
+{
+    reset(16);
+
+    CHECK(read_matches(0, BLK_CACHE_BLOCK_SIZE));
+    CHECK(reads == 1);
+
+    // Pretend that sector 9 was written
+    disk[9 * SECTOR_SIZE] ^= 0xff;
+    blk_cache_invalidate(9, SECTOR_SIZE);
+
+    CHECK(read_matches(0, BLK_CACHE_BLOCK_SIZE));
+    CHECK(reads == 1);
+    CHECK(read_matches(8, BLK_CACHE_BLOCK_SIZE));
+    CHECK(reads == 2);
+    CHECK(last_lba == 8);
+}
+
+static void test_partial_last_block(void)
+{
+    reset(16);
+
+    CHECK(read_matches(DISK_SECTORS - 5, 5 * SECTOR_SIZE));
+    CHECK(reads == 1);
+    CHECK(last_num_sg == 2);
+}
+
+static void test_large_reads_only_use_cached_blocks(void)
+{
+    static uint8_t buffer[2 * BLK_CACHE_MAX_READ];
+    reset(16);
+
+    CHECK(blk_cache_read(0, sizeof(buffer), buffer) == 0);
+    CHECK(reads == 0);
+
+    // The leading blocks come from the cache once they're there
+    CHECK(read_matches(0, SECTOR_SIZE));
+    CHECK(blk_cache_read(0, sizeof(buffer), buffer) == 16 * BLK_CACHE_BLOCK_SIZE);
+    CHECK(memcmp(buffer, disk, 16 * BLK_CACHE_BLOCK_SIZE) == 0);
+    CHECK(reads == 1);
+}
+
+static void test_insert(void)
+{
+    reset(16);
+
+    // Only the whole blocks in the range are kept
+    blk_cache_insert(3, 3 * BLK_CACHE_BLOCK_SIZE, disk + 3 * SECTOR_SIZE);
+    CHECK(read_matches(8, 2 * BLK_CACHE_BLOCK_SIZE));
+    CHECK(reads == 0);
+    CHECK(read_matches(0, SECTOR_SIZE));
+    CHECK(reads == 1);
+    CHECK(read_matches(24, SECTOR_SIZE));
+    CHECK(reads == 2);
+
+    // Cached blocks get the new data
+    disk[9 * SECTOR_SIZE] ^= 0xff;
+    blk_cache_insert(8, BLK_CACHE_BLOCK_SIZE, disk + 8 * SECTOR_SIZE);
+    CHECK(read_matches(8, BLK_CACHE_BLOCK_SIZE));
+    CHECK(reads == 2);
+
+    // No more is kept than a miss would have read
+    reset(16);
+    blk_cache_insert(0, 2 * BLK_CACHE_MAX_READ, disk);
+    CHECK(read_matches(0, (1 + BLK_CACHE_READ_AHEAD) * BLK_CACHE_BLOCK_SIZE));
+    CHECK(reads == 0);
+    CHECK(read_matches((1 + BLK_CACHE_READ_AHEAD) * BLK_CACHE_SECTORS, SECTOR_SIZE));
+    CHECK(reads == 1);
+}
+
+static void test_read_error(void)
+{
+    uint8_t buffer[SECTOR_SIZE];
+    reset(16);
+
+    fail_reads = 1;
+    CHECK(blk_cache_read(0, sizeof(buffer), buffer) < 0);
+
+    // Nothing from the failed read is left in the cache
+    fail_reads = 0;
+    CHECK(read_matches(0, SECTOR_SIZE));
+    CHECK(reads == 2);
+}
+
+int main(void)
+{
+    util_init();
+
+    printf("blk_cache:\n");
+    RUN_TEST(test_miss_then_hit);
+    RUN_TEST(test_multi_segment_fill);
+    RUN_TEST(test_read_ahead_stops_at_cached_block);
+    RUN_TEST(test_lru_eviction);
+    RUN_TEST(test_invalidate);
+    RUN_TEST(test_partial_last_block);
+    RUN_TEST(test_large_reads_only_use_cached_blocks);
+    RUN_TEST(test_insert);
+    RUN_TEST(test_read_error);
+    return test_exit_code();
+}
@@ -0,0 +1,77 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "test.h"
+#include "crc32.h"
+
+// Bit-at-a-time reference implementation
+static uint32_t ref_crc32(const unsigned char *buf, size_t len)
+{
+    uint32_t crc = 0xffffffff;
+    while (len--) {
+        crc ^= *buf++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static void test_known_values(void)
+{
+    CHECK(crc32buf("", 0) == 0);
+    CHECK(crc32buf("123456789", 9) == 0xcbf43926);
+    CHECK(crc32buf("The quick brown fox jumps over the lazy dog", 43) == 0x414fa339);
+}
+
+static void test_alignments_and_lengths(void)
+{
+    static unsigned char buf[4096 + 16];
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (unsigned char) (i * 131 + 7);
+
+    for (size_t offset = 0; offset < 16; offset++) {
+        for (size_t len = 0; len < 100; len++)
+            CHECK(crc32buf((const char *) buf + offset, len) == ref_crc32(buf + offset, len));
+
+        CHECK(crc32buf((const char *) buf + offset, 4096) == ref_crc32(buf + offset, 4096));
+    }
+}
+
+static void test_erased_env_block(void)
+{
+    // A fresh U-Boot environment block is all 0xff
+    static unsigned char block[128 * 1024];
+    for (size_t i = 0; i < sizeof(block); i++)
+        block[i] = 0xff;
+
+    CHECK(crc32buf((const char *) block + 4, sizeof(block) - 4) == ref_crc32(block + 4, sizeof(block) - 4));
+}
+
+static void test_combine(void)
+{
+    static unsigned char buf[10000];
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (unsigned char) (i * 7 + 3);
+
+    static const size_t splits[] = {0, 1, 7, 8, 1000, 9999, 10000};
+    uint32_t whole = crc32buf((const char *) buf, sizeof(buf));
+    for (size_t i = 0; i < sizeof(splits) / sizeof(splits[0]); i++) {
+        size_t a = splits[i];
+        uint32_t crc_a = crc32buf((const char *) buf, a);
+        uint32_t crc_b = crc32buf((const char *) buf + a, sizeof(buf) - a);
+        CHECK(crc32_combine(crc_a, crc_b, sizeof(buf) - a) == whole);
+    }
+}
+
+int main(void)
+{
+    printf("crc32:\n");
+    RUN_TEST(test_known_values);
+    RUN_TEST(test_alignments_and_lengths);
+    RUN_TEST(test_erased_env_block);
+    RUN_TEST(test_combine);
+    return test_exit_code();
+}
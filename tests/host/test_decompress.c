@@ -0,0 +1,134 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "test.h"
+#include "compress_helpers.h"
+
+#include <string.h>
+
+// Compressed data comes from the real gzip and zstd programs. Tests that
+// need a missing program are skipped.
+
+static int run_decompress(enum decomp_format format, const uint8_t *compressed, size_t compressed_len,
+                          size_t chunk, uint8_t *out, size_t out_max, size_t *out_len)
+{
+    struct chunked_input c = {compressed, compressed_len, 0, chunk, 0};
+    struct decomp_input in = {NULL, NULL, chunked_refill, &c};
+    return decompress(format, &in, out, out_max, out_len);
+}
+
+static void check_round_trip(const char *cmd, enum decomp_format format, size_t len)
+{
+    uint8_t *data = make_test_data(len);
+    size_t compressed_len;
+    uint8_t *compressed = compress_with(cmd, data, len, &compressed_len);
+    CHECK(compressed != NULL);
+    if (!compressed) {
+        free(data);
+        return;
+    }
+
+    CHECK(decomp_detect(compressed, compressed_len) == format);
+
+    uint8_t *out = malloc(len + 1);
+    static const size_t chunks[] = {1, 7, 512, 64 * 1024, 1 << 30};
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        size_t out_len = 0;
+        memset(out, 0xaa, len + 1);
+
+        // Stream the data in with trailing garbage like the rest of a partition
+        uint8_t *padded = malloc(compressed_len + 4096);
+        memcpy(padded, compressed, compressed_len);
+        memset(padded + compressed_len, 0x5a, 4096);
+
+        int rc = run_decompress(format, padded, compressed_len + 4096, chunks[i], out, len + 1, &out_len);
+        CHECK(rc == 0);
+        CHECK(out_len == len);
+        CHECK(memcmp(out, data, len) == 0);
+        free(padded);
+    }
+
+    free(out);
+    free(compressed);
+    free(data);
+}
+
+static void check_rejects_corruption(const char *cmd, enum decomp_format format, size_t checksum_offset)
+{
+    size_t len = 100000;
+    uint8_t *data = make_test_data(len);
+    size_t compressed_len;
+    uint8_t *compressed = compress_with(cmd, data, len, &compressed_len);
+    uint8_t *out = malloc(len);
+    size_t out_len;
+
+    CHECK(compressed != NULL);
+    if (compressed) {
+        // Truncated
+        CHECK(run_decompress(format, compressed, compressed_len / 2, 4096, out, len, &out_len) < 0);
+
+        // Output doesn't fit
+        CHECK(run_decompress(format, compressed, compressed_len, 4096, out, len / 2, &out_len) < 0);
+
+        // Checksum failure
+        compressed[compressed_len - checksum_offset] ^= 0x01;
+        CHECK(run_decompress(format, compressed, compressed_len, 4096, out, len, &out_len) < 0);
+    }
+
+    free(out);
+    free(compressed);
+    free(data);
+}
+
+static void test_detect(void)
+{
+    static const uint8_t gzip_magic[] = {0x1f, 0x8b, 0x08, 0x00};
+    static const uint8_t zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+    static const uint8_t arm64_image[] = {0x4d, 0x5a, 0x00, 0x91};
+
+    CHECK(decomp_detect(gzip_magic, sizeof(gzip_magic)) == DECOMP_GZIP);
+    CHECK(decomp_detect(zstd_magic, sizeof(zstd_magic)) == DECOMP_ZSTD);
+    CHECK(decomp_detect(arm64_image, sizeof(arm64_image)) == DECOMP_NONE);
+    CHECK(decomp_detect(zstd_magic, 2) == DECOMP_NONE);
+}
+
+static void test_gzip(void)
+{
+    if (!have_program("gzip")) {
+        printf("  (gzip not found, skipping)\n");
+        return;
+    }
+    check_round_trip("gzip -1 -c", DECOMP_GZIP, 1000000);
+    check_round_trip("gzip -9 -c", DECOMP_GZIP, 1000000);
+    check_round_trip("gzip -9 -c", DECOMP_GZIP, 1);
+    check_round_trip("gzip -9 -c", DECOMP_GZIP, 0);
+    check_rejects_corruption("gzip -9 -c", DECOMP_GZIP, 8);
+}
+
+static void test_zstd(void)
+{
+    if (!have_program("zstd")) {
+        printf("  (zstd not found, skipping)\n");
+        return;
+    }
+    check_round_trip("zstd -1 -c", DECOMP_ZSTD, 1000000);
+    check_round_trip("zstd -19 -c", DECOMP_ZSTD, 1000000);
+    check_round_trip("zstd --ultra -22 -c", DECOMP_ZSTD, 300000);
+    check_round_trip("zstd -3 --no-check -c", DECOMP_ZSTD, 1000000);
+    check_round_trip("zstd -19 -c", DECOMP_ZSTD, 1);
+    check_round_trip("zstd -19 -c", DECOMP_ZSTD, 0);
+    check_rejects_corruption("zstd -19 -c", DECOMP_ZSTD, 4);
+}
+
+int main(void)
+{
+    util_init();
+    printf("decompress:\n");
+    RUN_TEST(test_detect);
+    RUN_TEST(test_gzip);
+    RUN_TEST(test_zstd);
+    return test_exit_code();
+}
@@ -0,0 +1,196 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <string.h>
+
+#include "test.h"
+#include "fdt_helpers.h"
+#include "fdt_fixup.h"
+#include "util.h"
+
+static char dtb[64 * 1024];
+
+static void test_virt_like_tree(void)
+{
+    CHECK(make_virt_like_fdt(dtb, sizeof(dtb)) == 0);
+    CHECK(fdt_check_header(dtb) == 0);
+
+    int count = 0;
+    int node = fdt_node_offset_by_compatible(dtb, -1, "virtio,mmio");
+    while (node >= 0) {
+        count++;
+        node = fdt_node_offset_by_compatible(dtb, node, "virtio,mmio");
+    }
+    CHECK(count == 32);
+}
+
+static void test_set_bootargs(void)
+{
+    int len;
+
+    CHECK(make_virt_like_fdt(dtb, sizeof(dtb)) == 0);
+    int chosen = fdt_path_offset(dtb, "/chosen");
+    CHECK(chosen >= 0);
+    CHECK(fdt_setprop_string(dtb, chosen, "bootargs", "booting=a") == 0);
+
+    chosen = fdt_path_offset(dtb, "/chosen");
+    const char *bootargs = fdt_getprop(dtb, chosen, "bootargs", &len);
+    CHECK(bootargs != NULL && len == 10 && strcmp(bootargs, "booting=a") == 0);
+}
+
+static void test_no_space(void)
+{
+    static char small[1024];
+
+    CHECK(make_empty_fdt(small, 128) == 0);
+    int chosen = fdt_add_subnode(small, 0, "chosen");
+    CHECK(chosen >= 0);
+    CHECK(fdt_setprop(small, chosen, "bootargs", dtb, 512) == -FDT_ERR_NOSPACE);
+}
+
+static char fixed[64 * 1024];
+
+// The vendored libfdt doesn't have fdt_check_full(), so walk every tag
+static int check_struct(const void *fdt)
+{
+    int offset = 0;
+    int next;
+    int depth = 0;
+    uint32_t tag;
+
+    if (fdt_check_header(fdt) < 0)
+        return -1;
+    do {
+        tag = fdt_next_tag(fdt, offset, &next);
+        if (next < 0)
+            return -1;
+        if (tag == FDT_BEGIN_NODE) {
+            depth++;
+        } else if (tag == FDT_END_NODE) {
+            if (--depth < 0)
+                return -1;
+        } else if (tag == FDT_PROP) {
+            const struct fdt_property *prop = fdt_offset_ptr(fdt, offset, sizeof(*prop));
+            if (!fdt_string(fdt, fdt32_to_cpu(prop->nameoff)))
+                return -1;
+        }
+        offset = next;
+    } while (tag != FDT_END);
+    return depth == 0 ? 0 : -1;
+}
+
+static void test_fixup_props(void)
+{
+    struct fdt_fixup f;
+    int len;
+
+    CHECK(make_virt_like_fdt(dtb, sizeof(dtb)) == 0);
+    int chosen = fdt_path_offset(dtb, "/chosen");
+    CHECK(fdt_setprop_string(dtb, chosen, "bootargs", "old") == 0);
+
+    fdt_fixup_init(&f);
+    CHECK(fdt_fixup_setprop_string(&f, "/chosen", "bootargs", "booting=a") == 0);
+    CHECK(fdt_fixup_setprop_u64(&f, "/chosen", "linux,initrd-start", 0x48000000) == 0);
+    CHECK(fdt_fixup_setprop_string(&f, "/", "model", "test") == 0);
+    CHECK(fdt_fixup_setprop_string(&f, "/virtio_mmio@a000000", "compatible", "changed") == 0);
+    CHECK(fdt_fixup_apply(&f, dtb, fixed, sizeof(fixed), 1024) == 0);
+    CHECK(check_struct(fixed) == 0);
+
+    chosen = fdt_path_offset(fixed, "/chosen");
+    const char *bootargs = fdt_getprop(fixed, chosen, "bootargs", &len);
+    CHECK(bootargs != NULL && len == 10 && strcmp(bootargs, "booting=a") == 0);
+    const fdt64_t *start = fdt_getprop(fixed, chosen, "linux,initrd-start", &len);
+    CHECK(start != NULL && len == 8 && fdt64_to_cpu(*start) == 0x48000000);
+    const char *model = fdt_getprop(fixed, 0, "model", &len);
+    CHECK(model != NULL && strcmp(model, "test") == 0);
+
+    int node = fdt_path_offset(fixed, "/virtio_mmio@a000000");
+    CHECK(fdt_node_check_compatible(fixed, node, "changed") == 0);
+    node = fdt_path_offset(fixed, "/virtio_mmio@a000200");
+    CHECK(fdt_node_check_compatible(fixed, node, "virtio,mmio") == 0);
+
+    // Headroom is usable by libfdt
+    CHECK(fdt_setprop_string(fixed, chosen, "extra", "still fits") == 0);
+}
+
+static void test_fixup_new_nodes(void)
+{
+    struct fdt_fixup f;
+    int len;
+
+    CHECK(make_empty_fdt(dtb, sizeof(dtb)) == 0);
+
+    fdt_fixup_init(&f);
+    CHECK(fdt_fixup_setprop_u64(&f, "/chosen/bootstage", "start", 1) == 0);
+    CHECK(fdt_fixup_setprop_string(&f, "/chosen", "bootargs", "x") == 0);
+    CHECK(fdt_fixup_setprop_u64(&f, "/chosen/bootstage", "handoff", 2) == 0);
+    CHECK(fdt_fixup_setprop_u64(&f, "/chosen/bootstage", "start", 3) == 0);
+    CHECK(fdt_fixup_apply(&f, dtb, fixed, sizeof(fixed), 0) == 0);
+    CHECK(check_struct(fixed) == 0);
+
+    int chosen = fdt_path_offset(fixed, "/chosen");
+    CHECK(chosen >= 0);
+    CHECK(fdt_getprop(fixed, chosen, "bootargs", &len) != NULL && len == 2);
+
+    int node = fdt_path_offset(fixed, "/chosen/bootstage");
+    const fdt64_t *v = fdt_getprop(fixed, node, "start", &len);
+    CHECK(v != NULL && fdt64_to_cpu(*v) == 3);
+    v = fdt_getprop(fixed, node, "handoff", &len);
+    CHECK(v != NULL && fdt64_to_cpu(*v) == 2);
+}
+
+static void test_fixup_reserves(void)
+{
+    struct fdt_fixup f;
+    uint64_t address, size;
+
+    CHECK(make_virt_like_fdt(dtb, sizeof(dtb)) == 0);
+    CHECK(fdt_add_mem_rsv(dtb, 0x1000, 0x2000) == 0);
+
+    fdt_fixup_init(&f);
+    CHECK(fdt_fixup_add_reserve(&f, 0x40000000, 0x200000) == 0);
+    CHECK(fdt_fixup_apply(&f, dtb, fixed, sizeof(fixed), 0) == 0);
+
+    CHECK(fdt_num_mem_rsv(fixed) == 2);
+    CHECK(fdt_get_mem_rsv(fixed, 0, &address, &size) == 0 && address == 0x1000 && size == 0x2000);
+    CHECK(fdt_get_mem_rsv(fixed, 1, &address, &size) == 0 && address == 0x40000000 && size == 0x200000);
+}
+
+static void test_fixup_errors(void)
+{
+    struct fdt_fixup f;
+
+    fdt_fixup_init(&f);
+    CHECK(fdt_fixup_setprop_string(&f, "chosen", "bootargs", "x") == -FDT_ERR_BADPATH);
+    CHECK(fdt_fixup_setprop_string(&f, "/chosen/", "bootargs", "x") == -FDT_ERR_BADPATH);
+
+    // Headroom counts against the destination size
+    CHECK(make_virt_like_fdt(dtb, sizeof(dtb)) == 0);
+    fdt_pack(dtb);
+    int size = fdt_totalsize(dtb);
+    CHECK(fdt_fixup_apply(&f, dtb, fixed, size, 0) == 0);
+    CHECK(fdt_fixup_apply(&f, dtb, fixed, size, 1) == -FDT_ERR_NOSPACE);
+    CHECK(fdt_fixup_setprop_string(&f, "/chosen", "bootargs", "x") == 0);
+    CHECK(fdt_fixup_apply(&f, dtb, fixed, size, 0) == -FDT_ERR_NOSPACE);
+
+    memset(fixed, 0, 64);
+    CHECK(fdt_fixup_apply(&f, fixed, dtb, sizeof(dtb), 0) < 0);
+}
+
+int main(void)
+{
+    util_init();
+
+    printf("fdt:\n");
+    RUN_TEST(test_virt_like_tree);
+    RUN_TEST(test_set_bootargs);
+    RUN_TEST(test_no_space);
+    RUN_TEST(test_fixup_props);
+    RUN_TEST(test_fixup_new_nodes);
+    RUN_TEST(test_fixup_reserves);
+    RUN_TEST(test_fixup_errors);
+    return test_exit_code();
+}
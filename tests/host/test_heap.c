@@ -0,0 +1,169 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Run the loader's heap users with the loader's HEAP_SIZE. This is built with
+// HOST_HEAP_SIZE set to HEAP_SIZE, so running out of memory is fatal just
+// like on the target.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+#include "compress_helpers.h"
+#include "fdt_helpers.h"
+#include "fdt_fixup.h"
+#include "uboot_env.h"
+#include "util.h"
+
+// Same as main.c
+#define UBOOT_ENV_SIZE  (256 * 512)
+#define KERNEL_ARGS_MAX 2048
+
+static char env_block[UBOOT_ENV_SIZE];
+static uint8_t dtb[64 * 1024];
+
+static char *heap_top(void)
+{
+    return heap_mark().top;
+}
+
+// Fill the whole environment with variables about the size of the ones that
+// fwup writes. Returns the number of variables.
+static int make_full_env(void)
+{
+    static const char value[] = "0123456789abcdef0123456789abcdef";
+    struct uboot_env env;
+    char name[32];
+    int count = 0;
+
+    uboot_env_init(&env, UBOOT_ENV_SIZE);
+    uboot_env_setenv(&env, "nerves_fw_active", "a");
+    uboot_env_setenv(&env, "upgrade_available", "1");
+    uboot_env_setenv(&env, "bootcount", "0");
+    uboot_env_setenv(&env, "a.kernel_lba", "8192");
+
+    // Leave room for the CRC, the fixed variables and the terminating NUL
+    size_t used = 128;
+    for (;;) {
+        snprintf(name, sizeof(name), "a.nerves_fw_var%05d", count);
+        used += strlen(name) + sizeof(value) + 1;
+        if (used > UBOOT_ENV_SIZE)
+            break;
+        uboot_env_setenv(&env, name, value);
+        count++;
+    }
+    CHECK(uboot_env_write(&env, env_block) == 0);
+    uboot_env_free(&env);
+    return count;
+}
+
+// Do what process_uboot_env() does when the bootcount changes
+static void test_uboot_env(void)
+{
+    int count = make_full_env();
+    CHECK(count > 2000);
+
+    util_init();
+    char *top = heap_top();
+
+    struct heap_mark mark = heap_mark();
+    uint8_t *buffer = malloc_(UBOOT_ENV_SIZE);
+    memcpy(buffer, env_block, UBOOT_ENV_SIZE);
+
+    struct uboot_env env;
+    uboot_env_init(&env, UBOOT_ENV_SIZE);
+    CHECK(uboot_env_read(&env, (const char *) buffer) == 0);
+    CHECK(env.count == (size_t) count + 4);
+    CHECK(uboot_env_setenv(&env, "bootcount", "1") == 0);
+
+    uint8_t *new_buffer = malloc_(UBOOT_ENV_SIZE);
+    CHECK(uboot_env_write(&env, (char *) new_buffer) == 0);
+    free_(new_buffer);
+
+    uboot_env_free(&env);
+    free_(buffer);
+    heap_release(mark);
+
+    CHECK(heap_top() == top);
+    heap_report();
+}
+
+// The DTB edits are collected in a static struct and written in one pass
+// without using the heap
+static void test_fdt_edits(void)
+{
+    static char bootargs[KERNEL_ARGS_MAX];
+    static uint8_t src[64 * 1024];
+    static struct fdt_fixup fixup;
+    memset(bootargs, 'x', sizeof(bootargs) - 1);
+
+    util_init();
+    char *top = heap_top();
+
+    CHECK(make_virt_like_fdt(src, sizeof(src)) == 0);
+    fdt_fixup_init(&fixup);
+    CHECK(fdt_fixup_setprop_string(&fixup, "/chosen", "bootargs", bootargs) == 0);
+    CHECK(fdt_fixup_setprop_u64(&fixup, "/chosen/bootstage", "start", 0) == 0);
+    CHECK(fdt_fixup_add_reserve(&fixup, 0x40000000, 0x200000) == 0);
+    CHECK(fdt_fixup_apply(&fixup, src, dtb, sizeof(dtb), 4096) == 0);
+
+    CHECK(heap_top() == top);
+}
+
+// Decompress a multi-MiB kernel the way load_compressed_kernel() does
+static void check_decompress(const char *cmd, enum decomp_format format)
+{
+    size_t len = 8 * 1024 * 1024;
+    uint8_t *data = make_test_data(len);
+    size_t compressed_len;
+    uint8_t *compressed = compress_with(cmd, data, len, &compressed_len);
+    uint8_t *out = malloc(len);
+    CHECK(compressed != NULL);
+
+    if (compressed) {
+        util_init();
+        char *top = heap_top();
+
+        struct chunked_input c = {compressed, compressed_len, 0, 64 * 1024, 0};
+        struct decomp_input in = {NULL, NULL, chunked_refill, &c};
+        size_t out_len;
+        struct heap_mark mark = heap_mark();
+        CHECK(decompress(format, &in, out, len, &out_len) == 0);
+        heap_release(mark);
+
+        CHECK(out_len == len && memcmp(out, data, len) == 0);
+        CHECK(heap_top() == top);
+        heap_report();
+    }
+
+    free(out);
+    free(compressed);
+    free(data);
+}
+
+static void test_decompress(void)
+{
+    if (have_program("gzip"))
+        check_decompress("gzip -6 -c", DECOMP_GZIP);
+    else
+        printf("  (gzip not found, skipping)\n");
+
+    if (have_program("zstd"))
+        check_decompress("zstd -19 -c", DECOMP_ZSTD);
+    else
+        printf("  (zstd not found, skipping)\n");
+}
+
+int main(void)
+{
+    util_init();
+
+    printf("heap (%d bytes):\n", HEAP_SIZE);
+    RUN_TEST(test_uboot_env);
+    RUN_TEST(test_fdt_edits);
+    RUN_TEST(test_decompress);
+    return test_exit_code();
+}
@@ -0,0 +1,243 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <string.h>
+
+#include "test.h"
+#include "uboot_env.h"
+#include "util.h"
+
+#define ENV_SIZE (128 * 1024)
+
+static char block[ENV_SIZE];
+
+// Make an environment block like fwup would
+static void make_block(void)
+{
+    struct uboot_env env;
+    uboot_env_init(&env, ENV_SIZE);
+    uboot_env_setenv(&env, "nerves_fw_active", "a");
+    uboot_env_setenv(&env, "upgrade_available", "0");
+    uboot_env_setenv(&env, "a.kernel_lba", "8192");
+    uboot_env_setenv(&env, "b.kernel_lba", "73728");
+    uboot_env_setenv(&env, "a.kernel_args", "booting=a root=/dev/vda2");
+    CHECK(uboot_env_write(&env, block) == 0);
+    uboot_env_free(&env);
+}
+
+static void test_round_trip(void)
+{
+    struct uboot_env env;
+    char *value;
+
+    make_block();
+    uboot_env_init(&env, ENV_SIZE);
+    CHECK(uboot_env_read(&env, block) == 0);
+
+    CHECK(uboot_env_getenv(&env, "nerves_fw_active", &value) == 0 && strcmp(value, "a") == 0);
+    CHECK(uboot_env_getenv(&env, "b.kernel_lba", &value) == 0 && strcmp(value, "73728") == 0);
+    CHECK(uboot_env_getenv(&env, "a.kernel_args", &value) == 0 && strcmp(value, "booting=a root=/dev/vda2") == 0);
+    CHECK(uboot_env_getenv(&env, "missing", &value) < 0 && value == NULL);
+    uboot_env_free(&env);
+}
+
+static void test_serialization_is_sorted(void)
+{
+    make_block();
+
+    // Variables are written sorted by name after the 4-byte CRC
+    CHECK(strcmp(block + 4, "a.kernel_args=booting=a root=/dev/vda2") == 0);
+    CHECK((unsigned char) block[ENV_SIZE - 1] == 0xff);
+}
+
+static void test_setenv_and_unsetenv(void)
+{
+    struct uboot_env env;
+    char *value;
+
+    make_block();
+    uboot_env_init(&env, ENV_SIZE);
+    CHECK(uboot_env_read(&env, block) == 0);
+
+    uboot_env_setenv(&env, "bootcount", "1");
+    uboot_env_setenv(&env, "nerves_fw_active", "b");
+    uboot_env_unsetenv(&env, "upgrade_available");
+    CHECK(uboot_env_write(&env, block) == 0);
+    uboot_env_free(&env);
+
+    uboot_env_init(&env, ENV_SIZE);
+    CHECK(uboot_env_read(&env, block) == 0);
+    CHECK(uboot_env_getenv(&env, "bootcount", &value) == 0 && strcmp(value, "1") == 0);
+    CHECK(uboot_env_getenv(&env, "nerves_fw_active", &value) == 0 && strcmp(value, "b") == 0);
+    CHECK(uboot_env_getenv(&env, "upgrade_available", &value) < 0);
+    uboot_env_free(&env);
+}
+
+static void test_lookups_borrow_from_block(void)
+{
+    struct uboot_env env;
+
+    make_block();
+    uboot_env_init(&env, ENV_SIZE);
+    CHECK(uboot_env_read(&env, block) == 0);
+
+    const char *value = uboot_env_get(&env, "a.kernel_lba");
+    CHECK(value != NULL && strcmp(value, "8192") == 0);
+    CHECK(value > block && value < block + ENV_SIZE);
+    CHECK(uboot_env_get(&env, "a.kernel") == NULL);
+    CHECK(uboot_env_get(&env, "a.kernel_lba_") == NULL);
+    uboot_env_free(&env);
+}
+
+static void test_many_variables(void)
+{
+    struct uboot_env env;
+    char name[32];
+    char value[32];
+
+    uboot_env_init(&env, ENV_SIZE);
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "var%d", i);
+        snprintf(value, sizeof(value), "%d", i * 3);
+        uboot_env_setenv(&env, name, value);
+    }
+    for (int i = 0; i < 1000; i += 3) {
+        snprintf(name, sizeof(name), "var%d", i);
+        uboot_env_unsetenv(&env, name);
+    }
+    CHECK(uboot_env_write(&env, block) == 0);
+    uboot_env_free(&env);
+
+    uboot_env_init(&env, ENV_SIZE);
+    CHECK(uboot_env_read(&env, block) == 0);
+    CHECK(env.count == 666);
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "var%d", i);
+        snprintf(value, sizeof(value), "%d", i * 3);
+        const char *v = uboot_env_get(&env, name);
+        if (i % 3 == 0)
+            CHECK(v == NULL);
+        else
+            CHECK(v != NULL && strcmp(v, value) == 0);
+    }
+    uboot_env_free(&env);
+}
+
+static void test_bad_crc(void)
+{
+    struct uboot_env env;
+
+    make_block();
+    block[100] ^= 1;
+    uboot_env_init(&env, ENV_SIZE);
+    CHECK(uboot_env_read(&env, block) < 0);
+    uboot_env_free(&env);
+}
+
+static void test_dirty_sectors(void)
+{
+    struct uboot_env env;
+    static char new_block[ENV_SIZE];
+
+    static char padding[1200];
+    memset(padding, 'x', sizeof(padding) - 1);
+
+    // Push the variables that sort after "a.padding" past the first sector
+    make_block();
+    uboot_env_init(&env, ENV_SIZE);
+    CHECK(uboot_env_read(&env, block) == 0);
+    uboot_env_setenv(&env, "a.padding", padding);
+    CHECK(uboot_env_write(&env, new_block) == 0);
+    uboot_env_free(&env);
+    memcpy(block, new_block, ENV_SIZE);
+
+    uboot_env_init(&env, ENV_SIZE);
+    CHECK(uboot_env_read(&env, block) == 0);
+
+    // Nothing changed
+    CHECK(uboot_env_write(&env, new_block) == 0);
+    CHECK(env.num_dirty == 0);
+
+    // Only the CRC's sector and the variable's sector change
+    uboot_env_setenv(&env, "upgrade_available", "1");
+    CHECK(uboot_env_write(&env, new_block) == 0);
+    CHECK(env.num_dirty == 2);
+    CHECK(uboot_env_sector_dirty(&env, 0));
+    CHECK(!uboot_env_sector_dirty(&env, 1));
+
+    for (size_t i = 0; i < ENV_SIZE / UBOOT_ENV_SECTOR_SIZE; i++) {
+        size_t offset = i * UBOOT_ENV_SECTOR_SIZE;
+        int same = memcmp(block + offset, new_block + offset, UBOOT_ENV_SECTOR_SIZE) == 0;
+        CHECK(same == !uboot_env_sector_dirty(&env, i));
+    }
+
+    // Writing over the block that was read leaves nothing to compare with
+    CHECK(uboot_env_write(&env, block) == 0);
+    CHECK(env.num_dirty == ENV_SIZE / UBOOT_ENV_SECTOR_SIZE);
+    uboot_env_free(&env);
+}
+
+static void test_unchanged_is_clean(void)
+{
+    struct uboot_env env;
+    static char new_block[ENV_SIZE];
+
+    make_block();
+    uboot_env_init(&env, ENV_SIZE);
+    CHECK(uboot_env_dirty(&env));
+    CHECK(uboot_env_read(&env, block) == 0);
+    CHECK(!uboot_env_dirty(&env));
+
+    // Setting a variable to its current value or removing a missing one
+    // doesn't change anything
+    uboot_env_setenv(&env, "upgrade_available", "0");
+    uboot_env_unsetenv(&env, "not_there");
+    CHECK(!uboot_env_dirty(&env));
+
+    // Clean environments are copied rather than serialized
+    memset(new_block, 0, sizeof(new_block));
+    CHECK(uboot_env_write(&env, new_block) == 0);
+    CHECK(env.num_dirty == 0);
+    CHECK(memcmp(block, new_block, ENV_SIZE) == 0);
+
+    uboot_env_setenv(&env, "upgrade_available", "1");
+    CHECK(uboot_env_dirty(&env));
+    uboot_env_free(&env);
+
+    uboot_env_init(&env, ENV_SIZE);
+    CHECK(uboot_env_read(&env, block) == 0);
+    uboot_env_unsetenv(&env, "upgrade_available");
+    CHECK(uboot_env_dirty(&env));
+    uboot_env_free(&env);
+}
+
+static void test_too_small(void)
+{
+    struct uboot_env env;
+    static char small[64];
+
+    uboot_env_init(&env, sizeof(small));
+    uboot_env_setenv(&env, "a_very_long_variable_name", "with an even longer value that won't fit");
+    CHECK(uboot_env_write(&env, small) < 0);
+    uboot_env_free(&env);
+}
+
+int main(void)
+{
+    util_init();
+
+    printf("uboot_env:\n");
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_serialization_is_sorted);
+    RUN_TEST(test_setenv_and_unsetenv);
+    RUN_TEST(test_lookups_borrow_from_block);
+    RUN_TEST(test_many_variables);
+    RUN_TEST(test_bad_crc);
+    RUN_TEST(test_dirty_sectors);
+    RUN_TEST(test_unchanged_is_clean);
+    RUN_TEST(test_too_small);
+    return test_exit_code();
+}
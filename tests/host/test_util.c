@@ -0,0 +1,284 @@
+/*
+ * SPDX-FileCopyrightText: 2025 Frank Hunleth
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <string.h>
+
+#include "test.h"
+#include "util.h"
+
+static void test_memcpy(void)
+{
+    unsigned char src[256], a[300], b[300];
+    for (size_t i = 0; i < sizeof(src); i++)
+        src[i] = (unsigned char) (i * 37);
+
+    for (size_t so = 0; so < 9; so++) {
+        for (size_t d = 0; d < 9; d++) {
+            for (size_t n = 0; n < sizeof(src) - 9; n += 5) {
+                memset(a, 0x55, sizeof(a));
+                memset(b, 0x55, sizeof(b));
+                memcpy_(a + d, src + so, n);
+                memcpy(b + d, src + so, n);
+                CHECK(memcmp(a, b, sizeof(a)) == 0);
+            }
+        }
+    }
+}
+
+static void test_memmove_overlapping(void)
+{
+    unsigned char a[512], b[512];
+    for (size_t from = 0; from < 64; from += 3) {
+        for (size_t to = 0; to < 64; to += 5) {
+            for (size_t n = 0; n < 400; n += 37) {
+                for (size_t i = 0; i < sizeof(a); i++)
+                    a[i] = b[i] = (unsigned char) i;
+
+                memmove_(a + to, a + from, n);
+                memmove(b + to, b + from, n);
+                CHECK(memcmp(a, b, sizeof(a)) == 0);
+            }
+        }
+    }
+}
+
+static void test_memset(void)
+{
+    unsigned char a[4096 + 64], b[4096 + 64];
+    int values[] = {0, 0xff, 0x5a};
+    for (size_t v = 0; v < 3; v++) {
+        for (size_t offset = 0; offset < 17; offset++) {
+            for (size_t n = 0; n < 4096; n = n * 2 + 1) {
+                memset(a, 1, sizeof(a));
+                memset(b, 1, sizeof(b));
+                memset_(a + offset, values[v], n);
+                memset(b + offset, values[v], n);
+                CHECK(memcmp(a, b, sizeof(a)) == 0);
+            }
+        }
+    }
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+    int x = *(const int *) a;
+    int y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+static void test_qsort(void)
+{
+    int values[200];
+    for (int n = 1; n <= 200; n += 13) {
+        for (int i = 0; i < n; i++)
+            values[i] = (i * 7919) % 101;
+
+        qsort_(values, n, sizeof(int), compare_ints);
+        for (int i = 1; i < n; i++)
+            CHECK(values[i - 1] <= values[i]);
+    }
+}
+
+static int compare_ptrs(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *) a;
+    uintptr_t y = *(const uintptr_t *) b;
+    return (x > y) - (x < y);
+}
+
+struct three_bytes {
+    uint8_t key;
+    uint8_t pad[2];
+};
+
+static int compare_three_bytes(const void *a, const void *b)
+{
+    return ((const struct three_bytes *) a)->key - ((const struct three_bytes *) b)->key;
+}
+
+// Inputs that are bad for naive quicksorts
+static uintptr_t pattern_value(int pattern, size_t i, size_t n)
+{
+    switch (pattern) {
+    case 0: return i;                           // sorted
+    case 1: return n - i;                       // reversed
+    case 2: return 42;                          // all equal
+    case 3: return i < n / 2 ? i : n - i;       // organ pipe
+    case 4: return i % 7;                       // sawtooth
+    default: return (i * 2654435761u) % 1000;   // scrambled
+    }
+}
+
+static void test_qsort_patterns(void)
+{
+    static uintptr_t values[10000];
+
+    for (int pattern = 0; pattern < 6; pattern++) {
+        for (size_t n = 2; n <= 10000; n *= 3) {
+            uintptr_t sum = 0;
+            for (size_t i = 0; i < n; i++) {
+                values[i] = pattern_value(pattern, i, n);
+                sum += values[i];
+            }
+
+            qsort_(values, n, sizeof(uintptr_t), compare_ptrs);
+            for (size_t i = 0; i < n; i++) {
+                sum -= values[i];
+                if (i > 0)
+                    CHECK(values[i - 1] <= values[i]);
+            }
+            CHECK(sum == 0);
+        }
+    }
+}
+
+static void test_qsort_odd_width(void)
+{
+    struct three_bytes values[500];
+    for (int i = 0; i < 500; i++) {
+        values[i].key = (i * 37) % 251;
+        values[i].pad[0] = values[i].key;
+        values[i].pad[1] = ~values[i].key;
+    }
+
+    qsort_(values, 500, sizeof(values[0]), compare_three_bytes);
+    for (int i = 0; i < 500; i++) {
+        // Elements move as a whole
+        CHECK(values[i].pad[0] == values[i].key && values[i].pad[1] == (uint8_t) ~values[i].key);
+        if (i > 0)
+            CHECK(values[i - 1].key <= values[i].key);
+    }
+
+    // Nothing to do
+    qsort_(values, 0, sizeof(values[0]), compare_three_bytes);
+}
+
+static void test_strings(void)
+{
+    char buffer[32];
+
+    CHECK(strlen_("") == 0);
+    CHECK(strlen_("hello") == 5);
+    CHECK(strnlen_("hello", 3) == 3);
+    CHECK(strcmp_("abc", "abc") == 0);
+    CHECK(strcmp_("abc", "abd") < 0);
+    CHECK(strcmp_("b", "abc") > 0);
+    CHECK(strcmp_(strcpy_(buffer, "copy"), "copy") == 0);
+    CHECK(strcmp_(strdup_("dup"), "dup") == 0);
+    CHECK(strcmp_(strndup_("truncate", 5), "trunc") == 0);
+    CHECK(strrchr_("a.b.c", '.') != NULL && strcmp_(strrchr_("a.b.c", '.'), ".c") == 0);
+    CHECK(memchr_("abc", 'c', 3) != NULL);
+    CHECK(memchr_("abc", 'd', 3) == NULL);
+}
+
+static void test_strtoull(void)
+{
+    char *end;
+
+    CHECK(strtoull_("8192", NULL, 10) == 8192);
+    CHECK(strtoull_("  73728", NULL, 10) == 73728);
+    CHECK(strtoull_("0x2000", NULL, 0) == 0x2000);
+    CHECK(strtoull_("ff", NULL, 16) == 0xff);
+    CHECK(strtoull_("12ab", &end, 10) == 12 && *end == 'a');
+}
+
+static void test_malloc_reuses_freed_blocks(void)
+{
+    char *a = malloc_(100);
+    char *b = malloc_(100);
+    CHECK(a != NULL && b != NULL && a != b);
+    CHECK(((uintptr_t) a & 15) == 0);
+
+    free_(a);
+    char *c = malloc_(120);
+    CHECK(c == a);
+
+    // Different size class
+    char *d = malloc_(1000);
+    CHECK(d != a && d != b);
+
+    free_(NULL);
+    free_(b);
+    free_(c);
+    free_(d);
+}
+
+static void test_heap_mark_release(void)
+{
+    struct heap_mark mark = heap_mark();
+    char *a = malloc_(4096);
+    char *b = malloc_(64);
+    free_(b);
+    heap_release(mark);
+
+    // Everything after the mark is available again, including the freed
+    // block that was carved after it.
+    char *c = malloc_(4096);
+    CHECK(c == a);
+    char *d = malloc_(64);
+    CHECK(d == b);
+    heap_release(mark);
+}
+
+static void test_heap_release_returns_reused_blocks(void)
+{
+    char *a = malloc_(100);
+    char *b = malloc_(100);
+
+    // Free a block from before the mark and reuse it after the mark
+    struct heap_mark mark = heap_mark();
+    free_(a);
+    char *c = malloc_(100);
+    CHECK(c == a);
+    heap_release(mark);
+
+    // The reused block is free again rather than leaked
+    char *d = malloc_(100);
+    CHECK(d == a);
+    char *e = malloc_(100);
+    CHECK(e != a && e != b);
+
+    free_(b);
+    free_(d);
+    free_(e);
+}
+
+static void test_malloc_large_blocks(void)
+{
+    // Large blocks aren't rounded up to a power of two
+    char *a = malloc_(128 * 1024 + 16);
+    char *b = malloc_(128 * 1024 + 16);
+    CHECK(((uintptr_t) b & 15) == 0);
+    CHECK(b - a < 129 * 1024);
+
+    // Freed large blocks are reused by smaller large requests
+    free_(a);
+    char *c = malloc_(100 * 1024);
+    CHECK(c == a);
+
+    free_(b);
+    free_(c);
+}
+
+int main(void)
+{
+    util_init();
+
+    printf("util:\n");
+    RUN_TEST(test_memcpy);
+    RUN_TEST(test_memmove_overlapping);
+    RUN_TEST(test_memset);
+    RUN_TEST(test_qsort);
+    RUN_TEST(test_qsort_patterns);
+    RUN_TEST(test_qsort_odd_width);
+    RUN_TEST(test_strings);
+    RUN_TEST(test_strtoull);
+    RUN_TEST(test_malloc_reuses_freed_blocks);
+    RUN_TEST(test_heap_mark_release);
+    RUN_TEST(test_heap_release_returns_reused_blocks);
+    RUN_TEST(test_malloc_large_blocks);
+    return test_exit_code();
+}
@@ -76,6 +76,12 @@ run() {
     TEST=$1
     QEMU_MACHINE=virt
     QEMU_CPU=cortex-a53
+    QEMU_SMP=1
+    QEMU_VIRTIO_BUS=virtio-mmio-bus.0
+    QEMU_BLK_DEVICE=
+    QEMU_MEM=128M
+    LOADER_MAKE_ARGS=
+    CONSOLE_EXPECT=
 
     echo Running $TEST...
 
@@ -87,12 +93,29 @@ run() {
     # Run the test script to setup files for the test
     source "$TESTS_DIR/$TEST"
 
+    # Tests that need a differently configured loader get their own build
+    LOADER=$LITTLE_LOADER
+    if [ -n "$LOADER_MAKE_ARGS" ]; then
+        mkdir -p "$WORK/build"
+        cp -R "$TESTS_DIR/../src" "$TESTS_DIR/../Makefile" "$WORK/build"
+        if ! make -s -C "$WORK/build" little_loader.elf $LOADER_MAKE_ARGS ${CROSS:+CROSS=$CROSS}; then
+            echo "Failed to build the loader with $LOADER_MAKE_ARGS"
+            exit 1
+        fi
+        LOADER=$WORK/build/little_loader.elf
+    fi
+
+    if [ -z "$QEMU_BLK_DEVICE" ]; then
+        QEMU_BLK_DEVICE="virtio-blk-device,drive=vdisk,bus=$QEMU_VIRTIO_BUS"
+    fi
+
     QEMU_ARGS="-M $QEMU_MACHINE -cpu $QEMU_CPU -nographic"
-    QEMU_ARGS+=" -smp 1"
-    QEMU_ARGS+=" -kernel $LITTLE_LOADER"
+    QEMU_ARGS+=" -smp $QEMU_SMP"
+    QEMU_ARGS+=" -m $QEMU_MEM"
+    QEMU_ARGS+=" -kernel $LOADER"
     QEMU_ARGS+=" -global virtio-mmio.force-legacy=false"
     QEMU_ARGS+=" -drive if=none,file=$DISK_IMAGE,format=raw,id=vdisk"
-    QEMU_ARGS+=" -device virtio-blk-device,drive=vdisk,bus=virtio-mmio-bus.0"
+    QEMU_ARGS+=" -device $QEMU_BLK_DEVICE"
     QEMU_ARGS+=" -virtfs local,path=$HOSTSHARE,mount_tag=hostshare,security_model=none,id=hostshare"
 
     if [ ! -e "$DISK_IMAGE" ]; then
@@ -105,11 +128,20 @@ run() {
 
 #$TIMEOUT 10 qemu-system-aarch64 -M virt -cpu cortex-a53 -nographic -smp 1 -kernel "$LITTLE_LOADER" -global virtio-mmio.force-legacy=false -drive if=none,file="$DISK_IMAGE",format=raw,id=vdisk -device virtio-blk-device,drive=vdisk,bus=virtio-mmio-bus.0 -virtfs local,path="$HOSTSHARE",mount_tag=hostshare,security_model=none,id=hostshare
 
-    if ! timeout 10 qemu-system-aarch64 $QEMU_ARGS; then
+    timeout 10 qemu-system-aarch64 $QEMU_ARGS | tee "$WORK/console.log"
+    if [ "${PIPESTATUS[0]}" != 0 ]; then
         echo "QEMU failed or timed out when running $TEST"
         exit 1
     fi
 
+    # Check for loader messages that the test expects, one per line
+    while IFS= read -r LINE; do
+        if [ -n "$LINE" ] && ! grep -qF -- "$LINE" "$WORK/console.log"; then
+            echo "Didn't find \"$LINE\" in the console output. Test failed."
+            exit 1
+        fi
+    done <<< "$CONSOLE_EXPECT"
+
     # check results
     if [ ! -e "$HOSTSHARE/success" ]; then
         echo "Didn't find $HOSTSHARE/success file. Test failed."